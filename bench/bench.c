@@ -0,0 +1,49 @@
+#include "bench.h"
+
+#include <stdarg.h>
+#include <time.h>
+
+FILE *results;
+
+/* Whether an array has been started, and whether it has any results yet. */
+static bool in_array = false;
+static bool array_empty = true;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* End the current array, if any. */
+static void results_end_array() {
+    if (in_array) {
+        fprintf(results, "\n    ]");
+        in_array = false;
+    }
+}
+
+void results_begin(const char *name) {
+    results_end_array();
+    fprintf(results, ",\n    \"%s\": [", name);
+    in_array = true;
+    array_empty = true;
+}
+
+void results_add(const char *format, ...) {
+    fprintf(results, "%s\n        {", array_empty ? "" : ",");
+    
+    va_list args;
+    va_start(args, format);
+    vfprintf(results, format, args);
+    va_end(args);
+    
+    fprintf(results, "}");
+    array_empty = false;
+    fflush(results);
+}
+
+void results_end() {
+    results_end_array();
+    fprintf(results, "\n}\n");
+}
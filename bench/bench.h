@@ -0,0 +1,45 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "utils.h"
+
+/* Minimum time to run each benchmark for, in seconds. */
+#define BENCH_TIME 0.25
+
+/*
+ * File results are written to as a JSON object. The object must already be
+ * opened, with at least one member, before any arrays are added.
+ */
+extern FILE *results;
+
+/* Get the current monotonic time in seconds. */
+double now();
+
+/* Start an array of results called `name`, ending any array before it. */
+void results_begin(const char *name);
+
+/*
+ * Add a result to the current array. `format` is printf-style and should
+ * give the members of the result object, without the braces.
+ */
+void results_add(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+/* End the current array and the results object. */
+void results_end();
+
+/*
+ * Benchmark the kernels of each supported kernel set on buffers of `size`
+ * bytes, adding a "kernels" array to the results.
+ */
+void bench_kernels(size_t size);
+
+/*
+ * Benchmark the bitwise.h functions end-to-end on input files of increasing
+ * sizes up to `max_size`, writing to each kind of output, adding an
+ * "operations" array to the results.
+ */
+void bench_bitwise(size_t max_size);
+
+#endif
@@ -0,0 +1,299 @@
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "bitwise.h"
+
+#define NSIZES (sizeof(sizes) / sizeof(*sizes))
+#define NCASES (sizeof(cases) / sizeof(*cases))
+#define NSINKS (sizeof(sink_names) / sizeof(*sink_names))
+
+/* Input sizes to benchmark, up to the maximum size. */
+static const size_t sizes[] = {
+    1,
+    64,
+    4 * 1024,
+    256 * 1024,
+    16 * 1024 * 1024,
+    1024 * 1024 * 1024,
+    (size_t) 4 * 1024 * 1024 * 1024,
+};
+
+/* Kinds of output file. */
+typedef enum sink {
+    SINK_FILE,
+    SINK_PIPE,
+    SINK_NULL,
+} sink;
+
+static const char *sink_names[] = {"file", "pipe", "null"};
+
+static const char *eof_names[] = {"error", "truncate", "loop", "zero", "one"};
+
+// Operands
+
+static const byte pattern[] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0x5a};
+
+static byte table[BW_MAP_SIZE];
+
+// Operations
+
+/* Run an operation with an operand file of the size needed by `eof`. */
+typedef bw_error (*bench_run)(FILE *input, FILE *output, FILE *operand, eof_mode eof);
+
+#define BENCH_OPERATOR(op) \
+    static bw_error run_##op##_byte(FILE *input, FILE *output, FILE *operand, eof_mode eof) { \
+        return op##_byte(input, output, 0x5a); \
+    } \
+    static bw_error run_##op##_pattern(FILE *input, FILE *output, FILE *operand, eof_mode eof) { \
+        return op##_pattern(input, output, pattern, sizeof(pattern)); \
+    } \
+    static bw_error run_##op##_file(FILE *input, FILE *output, FILE *operand, eof_mode eof) { \
+        return op##_file(input, output, operand, eof); \
+    }
+
+BENCH_OPERATOR(or)
+BENCH_OPERATOR(and)
+BENCH_OPERATOR(xor)
+
+static bw_error run_not(FILE *input, FILE *output, FILE *operand, eof_mode eof) {
+    return not(input, output);
+}
+
+static bw_error run_map(FILE *input, FILE *output, FILE *operand, eof_mode eof) {
+    return map(input, output, table);
+}
+
+static bw_error run_expr(FILE *input, FILE *output, FILE *operand, eof_mode eof) {
+    bw_step steps[] = {
+        {.op = BW_XOR, .operand = operand, .eof = eof},
+        {.op = BW_AND, .pattern = (const byte[]) {0x7f}, .size = 1},
+        {.op = BW_NOT},
+    };
+    size_t failed;
+    return expr(input, output, steps, sizeof(steps) / sizeof(*steps), &failed);
+}
+
+static bw_error run_lshift(FILE *input, FILE *output, FILE *operand, eof_mode eof) {
+    return lshift(input, output, 13);
+}
+
+static bw_error run_rshift(FILE *input, FILE *output, FILE *operand, eof_mode eof) {
+    return rshift(input, output, 13);
+}
+
+/* An operation to benchmark. */
+typedef struct bench_case {
+    const char *name;
+    bench_run run;
+    /* Whether the operation reads an operand file. */
+    bool file;
+    /*
+     * EOF mode to use. With modes other than EOF_ERROR the operand is half
+     * the size of the input so the EOF mode is used.
+     */
+    eof_mode eof;
+} bench_case;
+
+static const bench_case cases[] = {
+    {"or_byte", run_or_byte},
+    {"and_byte", run_and_byte},
+    {"xor_byte", run_xor_byte},
+    {"or_pattern", run_or_pattern},
+    {"and_pattern", run_and_pattern},
+    {"xor_pattern", run_xor_pattern},
+    {"or_file", run_or_file, true, EOF_ERROR},
+    {"and_file", run_and_file, true, EOF_ERROR},
+    {"xor_file", run_xor_file, true, EOF_ERROR},
+    {"xor_file", run_xor_file, true, EOF_TRUNCATE},
+    {"xor_file", run_xor_file, true, EOF_LOOP},
+    {"xor_file", run_xor_file, true, EOF_ZERO},
+    {"xor_file", run_xor_file, true, EOF_ONE},
+    {"not", run_not},
+    {"map", run_map},
+    {"expr", run_expr, true, EOF_ERROR},
+    {"lshift", run_lshift},
+    {"rshift", run_rshift},
+};
+
+// Files
+
+/* Create a temporary file of `size` bytes of junk. */
+static FILE *create_file(size_t size) {
+    static byte junk[BUF_SIZE];
+    for (size_t i = 0; i < sizeof(junk); i++) {
+        junk[i] = rand();
+    }
+    
+    FILE *f = tmpfile();
+    if (!f) {
+        perror("tmpfile");
+        exit(EXIT_FAILURE);
+    }
+    
+    for (size_t total = 0, n; total < size; total += n) {
+        n = MIN(sizeof(junk), size - total);
+        if (fwrite(junk, sizeof(byte), n, f) != n) {
+            perror("fwrite");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    if (fflush(f) != 0) {
+        perror("fflush");
+        exit(EXIT_FAILURE);
+    }
+    
+    return f;
+}
+
+/* Read and discard everything from the pipe with the read end at `arg`. */
+static void *drain(void *arg) {
+    int fd = *(int *) arg;
+    static byte buf[64 * 1024];
+    while (read(fd, buf, sizeof(buf)) > 0);
+    return NULL;
+}
+
+// Running
+
+/* Result of running a benchmark, sent back from the process which ran it. */
+typedef struct bench_result {
+    /* Number of times the operation was run, or 0 on error. */
+    size_t runs;
+    /* Total time taken by all runs, in seconds. */
+    double seconds;
+} bench_result;
+
+/*
+ * Run `c` repeatedly on `input` for at least BENCH_TIME, writing to `s`, and
+ * return the result.
+ */
+static bench_result run_case(const bench_case *c, FILE *input, FILE *operand, sink s) {
+    bench_result result = {0};
+    
+    FILE *output;
+    int fds[2];
+    pthread_t drainer;
+    switch (s) {
+        case SINK_FILE:
+            output = tmpfile();
+            break;
+        case SINK_PIPE:
+            if (pipe(fds) != 0 || pthread_create(&drainer, NULL, drain, &fds[0]) != 0) {
+                return result;
+            }
+            output = fdopen(fds[1], "wb");
+            break;
+        default:
+            output = fopen("/dev/null", "wb");
+            break;
+    }
+    if (!output) {
+        return result;
+    }
+    
+    double start = now();
+    do {
+        if (fseeko(input, 0, SEEK_SET) != 0
+                || (operand && fseeko(operand, 0, SEEK_SET) != 0)
+                || (s == SINK_FILE && fseeko(output, 0, SEEK_SET) != 0)) {
+            return result;
+        }
+        
+        bw_error error = c->run(input, output, operand, c->eof);
+        if (error.type || fflush(output) != 0) {
+            result.runs = 0;
+            return result;
+        }
+        
+        result.runs++;
+        result.seconds = now() - start;
+    } while (result.seconds < BENCH_TIME);
+    
+    fclose(output);
+    if (s == SINK_PIPE) {
+        pthread_join(drainer, NULL);
+    }
+    
+    return result;
+}
+
+/*
+ * Run `c` in a child process so it's peak RSS can be measured alone, adding
+ * the result. Returns false if it failed.
+ */
+static bool bench_case_in_child(const bench_case *c, FILE *input, FILE *operand, size_t size, size_t processed, sink s) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return false;
+    }
+    
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == -1) {
+        return false;
+    } else if (pid == 0) {
+        close(fds[0]);
+        bench_result result = run_case(c, input, operand, s);
+        _exit(write(fds[1], &result, sizeof(result)) == sizeof(result) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    
+    close(fds[1]);
+    bench_result result = {0};
+    bool received = read(fds[0], &result, sizeof(result)) == sizeof(result);
+    close(fds[0]);
+    
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == -1 || !received || !result.runs) {
+        return false;
+    }
+    
+    // ru_maxrss is in kilobytes
+    double per_run = result.seconds / result.runs;
+    double gbps = processed / per_run / 1e9;
+    fprintf(stderr, "%-12s %-8s %-4s %10zu %10.2f\n", c->name, c->file ? eof_names[c->eof] : "-", sink_names[s], size, gbps);
+    results_add("\"operation\": \"%s\", \"eof\": %s%s%s, \"sink\": \"%s\", \"size\": %zu, \"runs\": %zu, "
+                "\"seconds\": %.9f, \"gbps\": %.3f, \"ns_per_byte\": %.4f, \"peak_rss\": %ld",
+                c->name, c->file ? "\"" : "", c->file ? eof_names[c->eof] : "null", c->file ? "\"" : "",
+                sink_names[s], size, result.runs, per_run, gbps, per_run * 1e9 / processed,
+                usage.ru_maxrss * 1024);
+    return true;
+}
+
+void bench_bitwise(size_t max_size) {
+    for (size_t i = 0; i < BW_MAP_SIZE; i++) {
+        table[i] = i * 167 + 13;
+    }
+    
+    results_begin("operations");
+    fprintf(stderr, "%-12s %-8s %-4s %10s %10s\n", "operation", "eof", "sink", "size", "GB/s");
+    for (size_t i = 0; i < NSIZES && sizes[i] <= max_size; i++) {
+        size_t size = sizes[i], half = (size + 1) / 2;
+        FILE *input = create_file(size);
+        FILE *operand = create_file(size);
+        FILE *half_operand = create_file(half);
+        
+        for (size_t j = 0; j < NCASES; j++) {
+            const bench_case *c = &cases[j];
+            // Output stops at the end of a truncated operand
+            bool short_operand = c->file && c->eof != EOF_ERROR;
+            size_t processed = c->file && c->eof == EOF_TRUNCATE ? half : size;
+            
+            for (sink s = 0; s < NSINKS; s++) {
+                if (!bench_case_in_child(c, input, !c->file ? NULL : short_operand ? half_operand : operand, size, processed, s)) {
+                    fprintf(stderr, "%s failed with %zu bytes to %s\n", c->name, size, sink_names[s]);
+                }
+            }
+        }
+        
+        fclose(input);
+        fclose(operand);
+        fclose(half_operand);
+    }
+}
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "bench.h"
+#include "project.h"
+
+/* Size of the buffers each kernel is run over. */
+#define BENCH_SIZE (1 << 20)
+/* Largest input file size for end-to-end benchmarks. */
+#define BENCH_MAX_SIZE (1 << 30)
+
+/*
+ * Parse a size in bytes with an optional K, M or G (binary) suffix. Exits with
+ * an error if `arg` isn't a valid size.
+ */
+static size_t parse_size(const char *arg) {
+    char *end;
+    unsigned long long size = strtoull(arg, &end, 0);
+    
+    // Multiply by suffix
+    int shift = 0;
+    switch (toupper(*end)) {
+        case 'G': shift += 10; // Fall through
+        case 'M': shift += 10; // Fall through
+        case 'K': shift += 10;
+            end++;
+            break;
+    }
+    
+    if (end == arg || *end != '\0' || arg[0] == '-') {
+        fprintf(stderr, "Invalid size '%s'\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    
+    return size << shift;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-k SIZE] [-m SIZE] [-o FILE]\n"
+        "Benchmark the kernels and end-to-end operations, writing the results to\n"
+        "FILE, or stdout, as JSON.\n"
+        "\n"
+        "  -k SIZE    Size of the buffers to run kernels over (default 1M)\n"
+        "  -m SIZE    Largest input file to run operations on (default 1G), or 0\n"
+        "             to only benchmark the kernels\n"
+        "  -o FILE    File to write JSON results to (default stdout)\n",
+        name);
+}
+
+int main(int argc, char *argv[]) {
+    size_t kernel_size = BENCH_SIZE, max_size = BENCH_MAX_SIZE;
+    const char *path = NULL;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "k:m:o:h")) != -1) {
+        switch (opt) {
+            case 'k':
+                kernel_size = parse_size(optarg);
+                break;
+            case 'm':
+                max_size = parse_size(optarg);
+                break;
+            case 'o':
+                path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    
+    results = path ? fopen(path, "w") : stdout;
+    if (!results) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    fprintf(results, "{\n    \"name\": \"%s\",\n    \"version\": \"%s\"", PROJECT_NAME, PROJECT_VERSION);
+    
+    bench_kernels(kernel_size);
+    if (max_size > 0) {
+        bench_bitwise(max_size);
+    }
+    
+    results_end();
+    if (fclose(results) != 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    
+    return EXIT_SUCCESS;
+}
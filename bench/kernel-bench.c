@@ -0,0 +1,102 @@
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "kernel.h"
+
+/*
+ * Benchmark a kernel and return it's throughput in GB/s. The map kernel uses
+ * the start of `op` as it's table, shift kernels shift by a few bits and find
+ * kernels search `dst`, which should be all zeros so every byte is checked.
+ */
+static double bench_kernel(bw_kernel mem, bw_kernel_byte byte_kernel, bw_kernel_map map, bw_kernel_shift shift_kernel, bw_kernel_count count, bw_kernel_find find, byte *dst, byte *src, byte *op, size_t size) {
+    size_t total = 0;
+    double start = now(), elapsed;
+    
+    do {
+        for (int i = 0; i < 16; i++) {
+            if (mem) {
+                mem(dst, src, op, size);
+            } else if (map) {
+                map(dst, src, op, size);
+            } else if (shift_kernel) {
+                // Shifts read one byte past what they write
+                shift_kernel(dst, src, size - 1, 3);
+            } else if (count) {
+                // Keep the result so the call isn't optimised out
+                dst[0] = count(src, size);
+            } else if (find) {
+                op[0] = find(dst, size);
+            } else {
+                byte_kernel(dst, src, op[i], size);
+            }
+            total += size;
+        }
+        
+        elapsed = now() - start;
+    } while (elapsed < BENCH_TIME);
+    
+    return total / elapsed / 1e9;
+}
+
+void bench_kernels(size_t size) {
+    // The op buffer doubles as the map table
+    if (size < 256) {
+        size = 256;
+    }
+    
+    byte *dst = malloc(size), *src = malloc(size), *op = malloc(size);
+    if (!dst || !src || !op) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(src, 0x5a, size);
+    memset(op, 0xa5, size);
+    
+    results_begin("kernels");
+    fprintf(stderr, "%-8s %-10s %10s\n", "set", "kernel", "GB/s");
+    for (const kernel_set *const *s = kernel_sets; *s; s++) {
+        const kernel_set *set = *s;
+        if (!set->supported()) {
+            continue;
+        }
+        
+        struct {
+            const char *name;
+            bw_kernel mem;
+            bw_kernel_byte byte;
+            bw_kernel_map map;
+            bw_kernel_shift shift;
+            bw_kernel_count count;
+            bw_kernel_find find;
+        } benches[] = {
+            {"or_mem", set->or_mem, NULL, NULL},
+            {"and_mem", set->and_mem, NULL, NULL},
+            {"xor_mem", set->xor_mem, NULL, NULL},
+            {"or_byte", NULL, set->or_byte, NULL},
+            {"and_byte", NULL, set->and_byte, NULL},
+            {"xor_byte", NULL, set->xor_byte, NULL},
+            {"not_byte", NULL, set->not_byte, NULL},
+            {"map", NULL, NULL, set->map},
+            {"shiftl", NULL, NULL, NULL, set->shiftl},
+            {"shiftr", NULL, NULL, NULL, set->shiftr},
+            {"popcount", NULL, NULL, NULL, NULL, set->popcount},
+            {"nonzero", NULL, NULL, NULL, NULL, NULL, set->nonzero},
+        };
+        
+        for (size_t i = 0; i < sizeof(benches) / sizeof(*benches); i++) {
+            if (benches[i].find) {
+                memset(dst, 0, size);
+            }
+            
+            double gbps = bench_kernel(benches[i].mem, benches[i].byte, benches[i].map, benches[i].shift, benches[i].count, benches[i].find, dst, src, op, size);
+            fprintf(stderr, "%-8s %-10s %10.2f\n", set->name, benches[i].name, gbps);
+            results_add("\"set\": \"%s\", \"kernel\": \"%s\", \"size\": %zu, \"gbps\": %.3f, \"ns_per_byte\": %.4f",
+                        set->name, benches[i].name, size, gbps, 1 / gbps);
+        }
+    }
+    
+    free(dst);
+    free(src);
+    free(op);
+}
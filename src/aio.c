@@ -0,0 +1,550 @@
+#define _GNU_SOURCE
+
+#include "aio.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+/* Alignment of blocks, so they can also be used for O_DIRECT. */
+#define AIO_ALIGN 4096
+
+/* A block being read or written. */
+typedef struct aio_slot {
+    byte *buf;
+    /* File offset and size of the I/O. */
+    off_t offset;
+    size_t size;
+    /* Bytes read or written, or -errno, once not pending. */
+    ssize_t result;
+    bool pending;
+} aio_slot;
+
+#ifdef __linux__
+/* Shared rings of an io_uring instance. */
+typedef struct aio_uring {
+    int fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    struct io_uring_sqe *sqes;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} aio_uring;
+#endif
+
+struct bw_aio {
+    /* File descriptor given, or one of it's own opened with O_DIRECT. */
+    int fd;
+    /* Whether `fd` was opened for O_DIRECT, so can be changed and closed. */
+    bool own_fd;
+    bool write;
+    aio_slot slots[AIO_DEPTH];
+    /* Next slot to be returned by aio_read() or aio_reserve(). */
+    size_t next;
+    /* Set once aio_read() has returned a block, from the slot before `next`. */
+    bool returned;
+    /* File offset of the next block to be submitted. */
+    off_t offset;
+    /* Set once a read reaches EOF or fails. */
+    bool eof;
+    /* Whether `fd` still has O_DIRECT on, and AIO_NOCACHE was given. */
+    bool direct, nocache;
+    /* File offset everything before which has been dropped from the page cache. */
+    off_t dropped;
+    
+    /* Using io_uring instead of the thread. */
+    bool use_uring;
+#ifdef __linux__
+    aio_uring uring;
+#endif
+
+    /* Thread and the queue of slots for it to do, in order. */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued, done;
+    size_t queue[AIO_DEPTH];
+    size_t queue_start, queue_size;
+    bool stop;
+};
+
+bool aio_use_uring = true;
+
+// Page cache
+
+/*
+ * Open the file of `fd` again with O_DIRECT, leaving the flags of `fd` and
+ * anything else sharing it alone. Returns -1 if the file system doesn't allow
+ * it, or the file can't be opened again.
+ */
+static int direct_open(int fd) {
+    int e = errno;
+    int flags = fcntl(fd, F_GETFL), direct = -1;
+    if (flags != -1) {
+        char path[32];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        direct = open(path, (flags & O_ACCMODE) | O_DIRECT | O_CLOEXEC);
+    }
+    errno = e;
+    return direct;
+}
+
+/* Turn off O_DIRECT for the fd of `aio`. Returns false if it wasn't on. */
+static bool direct_off(bw_aio *aio) {
+    if (!aio->own_fd) {
+        return false;
+    }
+    
+    int e = errno;
+    int flags = fcntl(aio->fd, F_GETFL);
+    bool off = flags != -1 && (flags & O_DIRECT) && fcntl(aio->fd, F_SETFL, flags & ~O_DIRECT) == 0;
+    errno = e;
+    return off;
+}
+
+/*
+ * Drop everything read or written before `end` from the page cache. Dirty
+ * pages can't be dropped, so they're written back first. Pages are cached in
+ * folios of up to HUGEPAGE_SIZE which are only dropped when entirely in range,
+ * so each drop starts from the boundary before the end of the last.
+ */
+static void cache_drop(bw_aio *aio, off_t end) {
+    off_t start = aio->dropped / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+    if (end <= start) {
+        return;
+    }
+    
+    // Errors are harmless, they just mean the pages stay cached
+    int e = errno;
+#ifdef __linux__
+    if (aio->write) {
+        sync_file_range(aio->fd, start, end - start,
+                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+#endif
+    posix_fadvise(aio->fd, start, end - start, POSIX_FADV_DONTNEED);
+    aio->dropped = MAX(aio->dropped, end);
+    errno = e;
+}
+
+// Synchronous I/O
+
+/*
+ * Finish a short read or write of `slot` synchronously, as io_uring and pread
+ * can both stop early. Reads stop at EOF. Anything O_DIRECT refuses, such as
+ * the unaligned rest of a short read, is done again without it.
+ */
+static void slot_finish(bw_aio *aio, aio_slot *slot) {
+    if (slot->result == -EINVAL && direct_off(aio)) {
+        slot->result = 0;
+    }
+    
+    while (slot->result >= 0 && (size_t)slot->result < slot->size) {
+        byte *buf = slot->buf + slot->result;
+        size_t n = slot->size - slot->result;
+        off_t offset = slot->offset + slot->result;
+        
+        ssize_t done = aio->write ? pwrite(aio->fd, buf, n, offset) : pread(aio->fd, buf, n, offset);
+        if (done == -1 && (errno == EINTR || (errno == EINVAL && direct_off(aio)))) {
+            continue;
+        } else if (done <= 0) {
+            slot->result = done == 0 ? slot->result : -errno;
+            break;
+        }
+        
+        slot->result += done;
+    }
+
+#ifdef __linux__
+    // Start writing back straight away so it's done by the time it's dropped
+    if (aio->nocache && aio->write && slot->result > 0) {
+        int e = errno;
+        sync_file_range(aio->fd, slot->offset, slot->result, SYNC_FILE_RANGE_WRITE);
+        errno = e;
+    }
+#endif
+}
+
+// io_uring
+
+#ifdef __linux__
+
+/* Set up an io_uring for `aio`. Returns false if io_uring isn't supported. */
+static bool uring_open(bw_aio *aio) {
+    aio_uring *u = &aio->uring;
+    struct io_uring_params params = {0};
+    
+    int e = errno;
+    u->fd = syscall(__NR_io_uring_setup, AIO_DEPTH, &params);
+    if (u->fd == -1) {
+        errno = e;
+        return false;
+    }
+    
+    // IORING_OP_READ and IORING_OP_WRITE came with the same kernel as this
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(u->fd);
+        errno = e;
+        return false;
+    }
+    
+    u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        u->sq_ring_size = u->cq_ring_size = MAX(u->sq_ring_size, u->cq_ring_size);
+    }
+    
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_ring = u->sq_ring;
+    if (u->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    }
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        // Closing the ring frees any mappings that did work
+        close(u->fd);
+        errno = e;
+        return false;
+    }
+    
+    byte *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + params.sq_off.array);
+    u->cq_head = (unsigned *)(cq + params.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+}
+
+static void uring_submit(bw_aio *aio, size_t i) {
+    aio_uring *u = &aio->uring;
+    aio_slot *slot = &aio->slots[i];
+    
+    // Never more than AIO_DEPTH in flight, so there's always room
+    unsigned tail = *u->sq_tail;
+    unsigned index = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = aio->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = aio->fd;
+    sqe->addr = (uintptr_t)slot->buf;
+    sqe->len = slot->size;
+    sqe->off = slot->offset;
+    sqe->user_data = i;
+    u->sq_array[index] = index;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    
+    int e = errno;
+    while (syscall(__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0) == -1) {
+        if (errno != EINTR && errno != EAGAIN) {
+            // Do it ourselves if the kernel won't
+            __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+            slot->result = 0;
+            slot_finish(aio, slot);
+            slot->pending = false;
+            break;
+        }
+    }
+    errno = e;
+}
+
+static void uring_wait(bw_aio *aio, size_t i) {
+    aio_uring *u = &aio->uring;
+    
+    int e = errno;
+    while (aio->slots[i].pending) {
+        unsigned head = *u->cq_head;
+        if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            continue;
+        }
+        
+        // Completions can come in any order
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        aio_slot *slot = &aio->slots[cqe->user_data];
+        slot->result = cqe->res;
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+        
+        slot_finish(aio, slot);
+        slot->pending = false;
+    }
+    errno = e;
+}
+
+static void uring_close(bw_aio *aio) {
+    aio_uring *u = &aio->uring;
+    munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+}
+
+#endif
+
+// Thread
+
+static void *thread_main(void *arg) {
+    bw_aio *aio = arg;
+    
+    pthread_mutex_lock(&aio->lock);
+    while (true) {
+        while (!aio->queue_size && !aio->stop) {
+            pthread_cond_wait(&aio->queued, &aio->lock);
+        }
+        if (!aio->queue_size) {
+            break;
+        }
+        
+        aio_slot *slot = &aio->slots[aio->queue[aio->queue_start]];
+        pthread_mutex_unlock(&aio->lock);
+        
+        slot->result = 0;
+        slot_finish(aio, slot);
+        
+        pthread_mutex_lock(&aio->lock);
+        aio->queue_start = (aio->queue_start + 1) % AIO_DEPTH;
+        aio->queue_size--;
+        slot->pending = false;
+        pthread_cond_broadcast(&aio->done);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    
+    return NULL;
+}
+
+static bool thread_open(bw_aio *aio) {
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->queued, NULL);
+    pthread_cond_init(&aio->done, NULL);
+    
+    int error = pthread_create(&aio->thread, NULL, thread_main, aio);
+    if (error) {
+        pthread_mutex_destroy(&aio->lock);
+        pthread_cond_destroy(&aio->queued);
+        pthread_cond_destroy(&aio->done);
+        errno = error;
+        return false;
+    }
+    
+    return true;
+}
+
+static void thread_submit(bw_aio *aio, size_t i) {
+    pthread_mutex_lock(&aio->lock);
+    aio->queue[(aio->queue_start + aio->queue_size++) % AIO_DEPTH] = i;
+    pthread_cond_signal(&aio->queued);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+static void thread_wait(bw_aio *aio, size_t i) {
+    pthread_mutex_lock(&aio->lock);
+    while (aio->slots[i].pending) {
+        pthread_cond_wait(&aio->done, &aio->lock);
+    }
+    pthread_mutex_unlock(&aio->lock);
+}
+
+static void thread_close(bw_aio *aio) {
+    pthread_mutex_lock(&aio->lock);
+    aio->stop = true;
+    pthread_cond_signal(&aio->queued);
+    pthread_mutex_unlock(&aio->lock);
+    
+    pthread_join(aio->thread, NULL);
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->queued);
+    pthread_cond_destroy(&aio->done);
+}
+
+// Slots
+
+/* Start reading or writing `size` bytes of slot `i` at the next offset. */
+static void slot_submit(bw_aio *aio, size_t i, size_t size) {
+    aio_slot *slot = &aio->slots[i];
+    slot->offset = aio->offset;
+    slot->size = size;
+    slot->pending = true;
+    aio->offset += size;
+
+#ifdef __linux__
+    if (aio->use_uring) {
+        uring_submit(aio, i);
+        return;
+    }
+#endif
+    thread_submit(aio, i);
+}
+
+/* Wait for slot `i` to finish. */
+static void slot_wait(bw_aio *aio, size_t i) {
+#ifdef __linux__
+    if (aio->use_uring) {
+        uring_wait(aio, i);
+        return;
+    }
+#endif
+    thread_wait(aio, i);
+}
+
+// Functions
+
+/* Free `aio` and it's buffers. */
+static void aio_free(bw_aio *aio) {
+    if (aio->own_fd) {
+        close(aio->fd);
+    }
+    for (size_t i = 0; i < AIO_DEPTH; i++) {
+        free(aio->slots[i].buf);
+    }
+    free(aio);
+}
+
+static bw_aio *aio_open(int fd, off_t offset, bool write, int flags) {
+    bw_aio *aio = calloc(1, sizeof(bw_aio));
+    if (!aio) {
+        return NULL;
+    }
+    
+    aio->write = write;
+    aio->offset = offset;
+    aio->nocache = flags & AIO_NOCACHE;
+    aio->dropped = offset;
+    
+    // Blocks stay aligned as long as they start aligned
+    if ((flags & AIO_DIRECT) && offset % AIO_ALIGN == 0 && (aio->fd = direct_open(fd)) != -1) {
+        aio->own_fd = aio->direct = true;
+    } else {
+        aio->fd = fd;
+    }
+    
+    for (size_t i = 0; i < AIO_DEPTH; i++) {
+        if (!(aio->slots[i].buf = aligned_alloc(AIO_ALIGN, AIO_BLOCK))) {
+            aio_free(aio);
+            return NULL;
+        }
+    }
+
+#ifdef __linux__
+    aio->use_uring = aio_use_uring && uring_open(aio);
+#endif
+    if (!aio->use_uring && !thread_open(aio)) {
+        aio_free(aio);
+        return NULL;
+    }
+    
+    return aio;
+}
+
+bw_aio *aio_open_read(int fd, off_t offset, int flags) {
+    bw_aio *aio = aio_open(fd, offset, false, flags);
+    
+    // Start reading every block straight away
+    for (size_t i = 0; aio && i < AIO_DEPTH; i++) {
+        slot_submit(aio, i, AIO_BLOCK);
+    }
+    
+    return aio;
+}
+
+bw_aio *aio_open_write(int fd, off_t offset, int flags) {
+    return aio_open(fd, offset, true, flags);
+}
+
+ssize_t aio_read(bw_aio *aio, byte **block) {
+    if (aio->eof) {
+        return 0;
+    }
+    
+    // The last block returned is finished with, so read ahead into it. Other
+    // slots may have finished too, but haven't been returned yet.
+    size_t last = (aio->next + AIO_DEPTH - 1) % AIO_DEPTH;
+    if (aio->returned) {
+        if (aio->nocache) {
+            cache_drop(aio, aio->slots[last].offset + aio->slots[last].size);
+        }
+        slot_submit(aio, last, AIO_BLOCK);
+    }
+    
+    aio_slot *slot = &aio->slots[aio->next];
+    slot_wait(aio, aio->next);
+    aio->next = (aio->next + 1) % AIO_DEPTH;
+    
+    if (slot->result < 0) {
+        aio->eof = true;
+        errno = -slot->result;
+        return -1;
+    }
+    
+    aio->eof = (size_t)slot->result < AIO_BLOCK;
+    aio->returned = true;
+    *block = slot->buf;
+    return slot->result;
+}
+
+byte *aio_reserve(bw_aio *aio) {
+    aio_slot *slot = &aio->slots[aio->next];
+    slot_wait(aio, aio->next);
+    
+    if (slot->result < 0) {
+        errno = -slot->result;
+        return NULL;
+    }
+    
+    if (aio->nocache && slot->size) {
+        cache_drop(aio, slot->offset + slot->size);
+    }
+    return slot->buf;
+}
+
+void aio_write(bw_aio *aio, size_t n) {
+    // O_DIRECT can't write a short block, which can only be the last
+    if (aio->direct && n % AIO_ALIGN) {
+        direct_off(aio);
+        aio->direct = false;
+    }
+    
+    slot_submit(aio, aio->next, n);
+    aio->next = (aio->next + 1) % AIO_DEPTH;
+}
+
+bool aio_close(bw_aio *aio) {
+    bool ok = true;
+    int e = errno;
+    
+    for (size_t i = 0; i < AIO_DEPTH; i++) {
+        slot_wait(aio, i);
+        if (aio->write && aio->slots[i].result < 0 && ok) {
+            e = -aio->slots[i].result;
+            ok = false;
+        }
+    }
+    if (aio->nocache) {
+        cache_drop(aio, aio->offset);
+    }
+
+#ifdef __linux__
+    if (aio->use_uring) {
+        uring_close(aio);
+    }
+#endif
+    if (!aio->use_uring) {
+        thread_close(aio);
+    }
+    
+    aio_free(aio);
+    errno = e;
+    return ok;
+}
@@ -0,0 +1,93 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "utils.h"
+
+// Tunables
+
+/* Number of blocks each async reader or writer keeps in flight. */
+#ifndef AIO_DEPTH
+#define AIO_DEPTH 4
+#endif
+
+/* Size of the blocks read and written asynchronously. */
+#ifndef AIO_BLOCK
+#define AIO_BLOCK (256 * 1024)
+#endif
+
+/*
+ * Whether io_uring should be used where the kernel supports it, instead of a
+ * thread. Defaults to true.
+ */
+extern bool aio_use_uring;
+
+// Flags
+
+/*
+ * Bypass the page cache with O_DIRECT while the file system allows it, using
+ * a descriptor of it's own so the flags of the one given are left alone. Falls
+ * back to normal I/O from the first block which isn't aligned, e.g. the last
+ * block written.
+ */
+#define AIO_DIRECT 1
+
+/*
+ * Drop blocks from the page cache once they've been read or written, so
+ * streaming through a large file doesn't push everything else out of it.
+ */
+#define AIO_NOCACHE 2
+
+// Types
+
+/*
+ * Reads or writes a regular file in blocks of AIO_BLOCK bytes at increasing
+ * offsets, keeping up to AIO_DEPTH of them in flight so the I/O overlaps with
+ * whatever is done with the blocks in the meantime. Uses io_uring where the
+ * kernel supports it, otherwise a thread doing pread() and pwrite().
+ */
+typedef struct bw_aio bw_aio;
+
+// Functions
+
+/*
+ * Start reading blocks of `fd` from `offset`, with any of the AIO_* `flags`.
+ * Returns NULL if the buffers or thread couldn't be created.
+ */
+bw_aio *aio_open_read(int fd, off_t offset, int flags);
+
+/*
+ * Start writing blocks to `fd` from `offset`, with any of the AIO_* `flags`.
+ * Returns NULL if the buffers or thread couldn't be created.
+ */
+bw_aio *aio_open_write(int fd, off_t offset, int flags);
+
+/*
+ * Get the next block read by `aio`, waiting for it to finish if needed, and
+ * put a pointer to it in `block`. The block is valid until the next call.
+ * Returns the number of bytes in the block, which is only less than AIO_BLOCK
+ * at EOF, or -1 on error with errno set.
+ */
+ssize_t aio_read(bw_aio *aio, byte **block);
+
+/*
+ * Get an empty block of AIO_BLOCK bytes to be written by `aio`, waiting for
+ * an earlier write from it to finish if needed. Returns NULL if an earlier
+ * write failed, with errno set.
+ */
+byte *aio_reserve(bw_aio *aio);
+
+/*
+ * Start writing the first `n` bytes of the block from aio_reserve() after the
+ * last block written.
+ */
+void aio_write(bw_aio *aio, size_t n);
+
+/*
+ * Wait for everything in flight to finish and free `aio`, leaving `fd` without
+ * O_DIRECT. Returns false if a write failed, with errno set.
+ */
+bool aio_close(bw_aio *aio);
+
+#endif
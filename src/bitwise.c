@@ -1,9 +1,15 @@
 #include "bitwise.h"
 
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <unistd.h>
+#include "kernel.h"
+#include "io.h"
+#include "parallel.h"
+#include "stats.h"
 
 // Utils
 
@@ -12,6 +18,8 @@ const bw_error no_error = {
     .error_number = 0
 };
 
+size_t bw_loop_cache_limit = BW_LOOP_CACHE_LIMIT;
+
 static bw_error create_error(int type) {
     int e = errno;
     if (type == BW_ERR_NONE || type == BW_ERR_OPERAND_EOF) {
@@ -24,32 +32,47 @@ static bw_error create_error(int type) {
     };
 }
 
+/*
+ * Run `job` with parallel_run() if possible. Returns true and puts the result
+ * in `error` if it was run, otherwise the job should be run serially.
+ */
+static bool try_parallel(const parallel_job *job, bw_error *error) {
+    int type = parallel_run(job);
+    if (type == PARALLEL_UNSUPPORTED) {
+        return false;
+    }
+    
+    *error = create_error(type);
+    return true;
+}
+
 /*
  * Handle operand file reaching EOF. Returns error to be returned after writing
  * remaining data. If `eof` is EOF_TRUNCATE, will return no error but `op_read`
  * won't be changed, indicating that writing should stop with no error.
  */
-static inline bw_error handle_eof(FILE *operand, eof_mode eof, size_t in_read, byte *op_buf, size_t *op_read) {
+static inline bw_error handle_eof(bw_reader *operand, eof_mode eof, size_t in_read, byte *op_buf, size_t *op_read) {
     switch (eof) {
         case EOF_ERROR:
             return create_error(BW_ERR_OPERAND_EOF);
         case EOF_LOOP:
             // Check that operand file isn't 0 bytes long
-            if (ftell(operand) == 0) {
+            if (reader_tell(operand) == 0) {
                 return create_error(BW_ERR_OPERAND_EOF);
             }
             
             // Seek to beginning of operand file and read until we have enough
             while (*op_read < in_read) {
                 // Seek operand file to start, or return error
-                if (fseek(operand, 0, SEEK_SET) != 0) {
+                if (!reader_rewind(operand)) {
                     return create_error(BW_ERR_OPERAND_SEEK);
                 }
+                stats.rewinds++;
                 
                 byte *op_buf_rem = op_buf + *op_read;
                 size_t in_read_rem = in_read - *op_read;
                 
-                *op_read += fread(op_buf_rem, 1, in_read_rem, operand);
+                *op_read += reader_read(operand, op_buf_rem, in_read_rem);
             }
             
             break;
@@ -68,30 +91,233 @@ static inline bw_error handle_eof(FILE *operand, eof_mode eof, size_t in_read, b
     return no_error;
 }
 
+/* In-memory copy of an operand file read while using EOF_LOOP. */
+typedef struct op_cache {
+    byte *buf;
+    size_t size, capacity;
+} op_cache;
+
+/*
+ * Append `n` bytes from `data` to `cache`. Returns false and frees the cache
+ * if it would grow larger than bw_loop_cache_limit or couldn't be allocated,
+ * indicating that the operand can't be cached.
+ */
+static bool op_cache_append(op_cache *cache, const byte *data, size_t n) {
+    if (cache->size + n > bw_loop_cache_limit) {
+        free(cache->buf);
+        *cache = (op_cache){0};
+        return false;
+    }
+    
+    // Grow geometrically, up to the limit
+    if (cache->size + n > cache->capacity) {
+        size_t capacity = MAX(cache->size + n, MIN(cache->capacity * 2, bw_loop_cache_limit));
+        byte *buf = realloc(cache->buf, capacity);
+        if (!buf) {
+            free(cache->buf);
+            *cache = (op_cache){0};
+            return false;
+        }
+        
+        cache->buf = buf;
+        cache->capacity = capacity;
+    }
+    
+    memcpy(cache->buf + cache->size, data, n);
+    cache->size += n;
+    return true;
+}
+
+/*
+ * Handle the operand file reaching EOF in EOF_LOOP mode when the whole operand
+ * is in `cache`. Fills the rest of `op_buf` up to `in_read` from the start of
+ * the operand and returns the cache expanded with mempattern() to cover blocks
+ * of `block` bytes, with the phase to continue from in `phase`. Returns NULL
+ * and sets `error` if the operand is empty or the expanded buffer couldn't be
+ * allocated.
+ */
+static byte *op_cache_loop(op_cache *cache, byte *op_buf, size_t in_read, size_t *op_read, size_t block, size_t *phase, bw_error *error) {
+    // Check that operand file isn't 0 bytes long
+    if (cache->size == 0) {
+        *error = create_error(BW_ERR_OPERAND_EOF);
+        return NULL;
+    }
+    
+    size_t pat_size;
+    byte *pat_buf = mempattern(cache->buf, cache->size, block, &pat_size);
+    if (!pat_buf) {
+        *error = create_error(BW_ERR_MEMORY);
+        return NULL;
+    }
+    
+    // Fill the rest of op_buf from the start of the operand
+    memcpy(op_buf + *op_read, pat_buf, in_read - *op_read);
+    *phase = (in_read - *op_read) % cache->size;
+    *op_read = in_read;
+    
+    return pat_buf;
+}
+
+/*
+ * Finish using `in` and `out`, returning `error` or an error from closing
+ * `out` if there wasn't already an error.
+ */
+static bw_error io_close(bw_reader *in, bw_writer *out, bw_error error) {
+    reader_close(in);
+    if (!writer_close(out) && !error.type) {
+        error = create_error(BW_ERR_OUTPUT_WRITE);
+    }
+    
+    return error;
+}
+
+// Shortcuts
+
+/* What an operator does to each byte with a particular byte operand. */
+typedef enum operand_class {
+    /* Bytes need the operator applied. */
+    OPERAND_ANY,
+    /* Bytes are left unchanged. */
+    OPERAND_IDENTITY,
+    /* Bytes all become the same constant. */
+    OPERAND_CONSTANT,
+} operand_class;
+
+/*
+ * Classify the byte `operand` of `op`, putting the byte every byte becomes in
+ * `constant` if it's OPERAND_CONSTANT.
+ */
+static operand_class classify_operand(bw_operator op, byte operand, byte *constant) {
+    switch (op) {
+        case BW_OR:
+            *constant = 0xff;
+            return operand == 0 ? OPERAND_IDENTITY : operand == 0xff ? OPERAND_CONSTANT : OPERAND_ANY;
+        case BW_AND:
+            *constant = 0;
+            return operand == 0xff ? OPERAND_IDENTITY : operand == 0 ? OPERAND_CONSTANT : OPERAND_ANY;
+        case BW_XOR:
+            return operand == 0 ? OPERAND_IDENTITY : OPERAND_ANY;
+        default:
+            return OPERAND_ANY;
+    }
+}
+
+/*
+ * Pass the rest of `input` through to `output` unchanged, having the kernel
+ * copy it where possible, or just skipping it when writing in place. Returns
+ * false without doing anything if holes would be filled in.
+ */
+static bool pass_through(FILE *input, FILE *output, bw_error *error) {
+    // Copying would fill in holes, which the normal path keeps
+    if (input != output && use_sparse && fsparse(input)) {
+        return false;
+    }
+    
+    double start = stats_start();
+    off_t passed = input == output ? (off_t)fskip(input, OFF_MAX) : fcopy(input, output, OFF_MAX);
+    if (input != output) {
+        stats_count(&stats.input, passed, 0);
+        stats_count(&stats.output, passed, start);
+    }
+    
+    if (ferror(input)) {
+        *error = create_error(BW_ERR_INPUT_READ);
+    } else if (ferror(output)) {
+        *error = create_error(BW_ERR_OUTPUT_WRITE);
+    } else {
+        *error = no_error;
+    }
+    return true;
+}
+
+/*
+ * Write `value` to `output` in place of each byte of the rest of regular file
+ * `input`, without reading it. Zeros are left as a hole where possible.
+ * Returns false without doing anything if the size of `input` isn't known.
+ */
+static bool fill_constant(FILE *input, FILE *output, byte value, bw_error *error) {
+    off_t start = ftello(input), end = fsize(input);
+    if (start == -1 || end == -1 || start > end) {
+        return false;
+    }
+    
+    // Writing in place starts where reading would have
+    if (input == output && fseeko(output, start, SEEK_SET) != 0) {
+        return false;
+    }
+    
+    size_t size = end - start, written = 0;
+    double io_start = stats_start();
+    *error = no_error;
+    if (value == 0) {
+        written = fzero(output, size);
+    } else if (size) {
+        size_t block = buf_size_for(output);
+        byte *buf = buf_alloc(block);
+        if (!buf) {
+            *error = create_error(BW_ERR_MEMORY);
+            return true;
+        }
+        
+        memset(buf, value, block);
+        for (size_t n = 1; n && written < size; written += n) {
+            n = fwrite(buf, 1, MIN(block, size - written), output);
+        }
+        buf_free(buf);
+    }
+    stats_count(&stats.output, written, io_start);
+    
+    if (written < size) {
+        *error = create_error(BW_ERR_OUTPUT_WRITE);
+    } else if (input != output && fseeko(input, end, SEEK_SET) != 0) {
+        *error = create_error(BW_ERR_INPUT_READ);
+    }
+    return true;
+}
+
+/*
+ * Apply `op` with the byte `operand` to the rest of `input` without reading
+ * it, if the operand leaves `op` as an identity or constant. Returns false
+ * without doing anything if it can't be done this way, in which case the
+ * normal path should be used.
+ */
+static bool byte_shortcut(FILE *input, FILE *output, bw_operator op, byte operand, bw_error *error) {
+    byte constant;
+    switch (classify_operand(op, operand, &constant)) {
+        case OPERAND_IDENTITY:
+            return pass_through(input, output, error);
+        case OPERAND_CONSTANT:
+            return fill_constant(input, output, constant, error);
+        default:
+            return false;
+    }
+}
+
 // OR
 
 #define OP_NAME or
-#define OP(a, b) a |= b
+#define OP_OPERATOR BW_OR
 #include "bitwise_template.inc"
 
 // AND
 
 #define OP_NAME and
-#define OP(a, b) a &= b
+#define OP_OPERATOR BW_AND
 #include "bitwise_template.inc"
 
 // XOR
 
 #define OP_NAME xor
-#define OP(a, b) a ^= b
+#define OP_OPERATOR BW_XOR
 #include "bitwise_template.inc"
 
 // NOT
 
 // Define not_byte function which ignores operand argument
 #define OP_NAME not
-#define OP(a, b) a = ~(a)
+#define OP_OPERATOR BW_NOT
 #define QUALIFIERS static inline
+#define NO_PATTERN_FUNCTION
 #define NO_FILE_FUNCTION
 #include "bitwise_template.inc"
 
@@ -99,39 +325,1074 @@ bw_error not(FILE * input, FILE *output) {
     return not_byte(input, output, 0);
 }
 
-// Shift functions
+// Map function
+
+bw_error map(FILE *input, FILE *output, const byte *table) {
+    // Split large regular files between threads, unless there are holes to skip
+    bw_error error;
+    parallel_job job = {
+        .input = input,
+        .output = output,
+        .map_kernel = kernels()->map,
+        .table = table
+    };
+    if (!(use_sparse && fsparse(input)) && try_parallel(&job, &error)) {
+        return error;
+    }
+    
+    bw_step step = {.op = BW_MAP, .pattern = table, .size = BW_MAP_SIZE};
+    size_t failed;
+    return expr(input, output, &step, 1, &failed);
+}
+
+// Expression function
+
+/* State of a step of an expression while running. */
+typedef struct expr_state {
+    /* Reader for the operand file, if any. */
+    bw_reader op;
+    /*
+     * Expanded pattern and current phase in it, if a multi-byte pattern, and
+     * whether the pattern is all zeros.
+     */
+    byte *pat_buf;
+    size_t phase;
+    bool pat_zero;
+    /*
+     * Table of this and the following `folded` steps, or NULL. If `bitwise`,
+     * the table is the same as AND with `and_mask` then XOR with `xor_mask`.
+     */
+    byte *table;
+    size_t folded;
+    bool bitwise;
+    byte and_mask, xor_mask;
+    /* Buffer for a block of the operand file. */
+    byte *op_buf;
+} expr_state;
 
-typedef void (*bw_shifter)(byte *buffer, size_t size, shift amount);
+static bw_kernel expr_mem_kernel(bw_operator op) {
+    switch (op) {
+        case BW_OR: return kernels()->or_mem;
+        case BW_AND: return kernels()->and_mem;
+        case BW_XOR: return kernels()->xor_mem;
+        default: return NULL;
+    }
+}
+
+static bw_kernel_byte expr_byte_kernel(bw_operator op) {
+    switch (op) {
+        case BW_OR: return kernels()->or_byte;
+        case BW_AND: return kernels()->and_byte;
+        case BW_XOR: return kernels()->xor_byte;
+        default: return kernels()->not_byte;
+    }
+}
 
-/* Generic function for shifting. Actual shifting done by `shifter` function. */
-static bw_error bw_shift(FILE *input, FILE *output, shift amount, bw_shifter shifter) {
-    // Keep track of most recent error to return at end
+/* Returns true if `step` maps each byte to another without any operand I/O. */
+static bool expr_is_constant(const bw_step *step) {
+    return step->op == BW_NOT || step->op == BW_MAP || (!step->operand && step->size == 1);
+}
+
+/* Apply the constant `step` to a single byte. */
+static byte expr_apply_byte(const bw_step *step, byte b) {
+    switch (step->op) {
+        case BW_OR: return b | step->pattern[0];
+        case BW_AND: return b & step->pattern[0];
+        case BW_XOR: return b ^ step->pattern[0];
+        case BW_NOT: return ~b;
+        default: return step->pattern[b];
+    }
+}
+
+/*
+ * Fold the run of `count` constant steps into the table of `state`. Returns
+ * false if the table couldn't be allocated.
+ */
+static bool expr_fold(const bw_step *steps, size_t count, expr_state *state) {
+    if (!(state->table = malloc(BW_MAP_SIZE))) {
+        return false;
+    }
+    
+    for (size_t b = 0; b < BW_MAP_SIZE; b++) {
+        state->table[b] = b;
+        for (size_t i = 0; i < count; i++) {
+            state->table[b] = expr_apply_byte(&steps[i], state->table[b]);
+        }
+    }
+    state->folded = count - 1;
+    
+    // Bits which are kept or flipped show in the result for all ones, the rest
+    // are constant and show in the result for zero
+    state->xor_mask = state->table[0];
+    state->and_mask = state->table[BW_MAP_SIZE - 1] ^ state->xor_mask;
+    state->bitwise = true;
+    for (size_t b = 0; b < BW_MAP_SIZE && state->bitwise; b++) {
+        state->bitwise = state->table[b] == ((b & state->and_mask) ^ state->xor_mask);
+    }
+    
+    return true;
+}
+
+/*
+ * Apply `step` to `n` bytes from `src` and put the result in `dst`. If the
+ * operand file reaches EOF or fails, `n` is reduced to the number of bytes
+ * which could be processed and an error may be returned.
+ */
+static bw_error expr_apply(const bw_step *step, expr_state *state, byte *dst, const byte *src, size_t *n) {
     bw_error error = no_error;
     
-    // Read entire `input`
-    size_t size;
-    byte *buffer = freadall(sizeof(byte), &size, input);
-    // Record error if there was one, but continue with what we did read
-    if (ferror(input)) {
-        error = create_error(BW_ERR_INPUT_READ);
+    if (state->table && state->bitwise) {
+        // Skip operations which would do nothing
+        if (state->and_mask != 0xff) {
+            kernels()->and_byte(dst, src, state->and_mask, *n);
+            src = dst;
+        }
+        if (state->xor_mask != 0 || src != dst) {
+            kernels()->xor_byte(dst, src, state->xor_mask, *n);
+        }
+    } else if (state->table) {
+        kernels()->map(dst, src, state->table, *n);
+    } else if (expr_is_constant(step)) {
+        byte operand = step->op == BW_NOT ? 0 : step->pattern[0];
+        expr_byte_kernel(step->op)(dst, src, operand, *n);
+    } else if (!step->operand) {
+        expr_mem_kernel(step->op)(dst, src, state->pat_buf + state->phase, *n);
+        state->phase = (state->phase + *n) % step->size;
+    } else {
+        size_t op_read;
+        const byte *op_src = reader_next(&state->op, state->op_buf, *n, &op_read);
+        
+        // Check error if not enough read, or use EOF mode if EOF reached
+        if (op_read < *n) {
+            if (op_src != state->op_buf) {
+                memcpy(state->op_buf, op_src, op_read);
+                op_src = state->op_buf;
+            }
+            
+            if (state->op.eof) {
+                error = handle_eof(&state->op, step->eof, *n, state->op_buf, &op_read);
+            } else {
+                error = create_error(BW_ERR_OPERAND_READ);
+            }
+            *n = op_read;
+        }
+        
+        expr_mem_kernel(step->op)(dst, src, op_src, *n);
     }
     
-    // Do shift
-    shifter(buffer, size, amount);
+    return error;
+}
+
+/* Close operands and free the states of the `count` steps. */
+static void expr_close(const bw_step *steps, expr_state *states, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(states[i].pat_buf);
+        free(states[i].table);
+        buf_free(states[i].op_buf);
+        if (!expr_is_constant(&steps[i]) && steps[i].operand) {
+            reader_close(&states[i].op);
+        }
+    }
     
-    // Write to output
-    size_t written = fwrite(buffer, sizeof(byte), size, output);
-    if (written != size) {
-        error = create_error(BW_ERR_OUTPUT_WRITE);
+    free(states);
+}
+
+/*
+ * Check map tables, open operands, expand patterns and fold constant steps of
+ * the expression into `states`, for blocks of up to `block` bytes. On error,
+ * the index of the step that failed is put in `failed`.
+ */
+static bw_error expr_prepare(const bw_step *steps, expr_state *states, size_t count, size_t block, size_t *failed) {
+    // Tables which are too short are like a short operand file
+    for (size_t i = 0; i < count; i++) {
+        if (steps[i].op == BW_MAP && steps[i].size < BW_MAP_SIZE) {
+            *failed = i;
+            return create_error(BW_ERR_OPERAND_EOF);
+        }
+    }
+    
+    for (size_t i = 0; i < count; i += 1 + states[i].folded) {
+        const bw_step *step = &steps[i];
+        expr_state *state = &states[i];
+        
+        if (expr_is_constant(step)) {
+            // Fold runs into a table, lone byte operands are faster as they are
+            size_t run = 1;
+            while (i + run < count && expr_is_constant(&steps[i + run])) {
+                run++;
+            }
+            
+            if ((run > 1 || step->op == BW_MAP) && !expr_fold(step, run, state)) {
+                return create_error(BW_ERR_MEMORY);
+            }
+        } else if (step->operand) {
+            reader_open(&state->op, step->operand);
+            state->op.stats = &stats.operand;
+            if (!(state->op_buf = buf_alloc(block))) {
+                return create_error(BW_ERR_MEMORY);
+            }
+        } else if (step->size == 0) {
+            // An empty pattern is the same as an empty operand file
+            *failed = i;
+            return create_error(BW_ERR_OPERAND_EOF);
+        } else {
+            size_t pat_size;
+            state->pat_buf = mempattern(step->pattern, step->size, block, &pat_size);
+            if (!state->pat_buf) {
+                return create_error(BW_ERR_MEMORY);
+            }
+            
+            state->pat_zero = true;
+            for (size_t b = 0; b < step->size && state->pat_zero; b++) {
+                state->pat_zero = step->pattern[b] == 0;
+            }
+        }
+    }
+    
+    return no_error;
+}
+
+/*
+ * Skip `n` bytes of the operands of the prepared expression, as if `n` bytes
+ * of input had been processed. Operands which end and aren't looped are left
+ * at EOF, to be handled by their EOF mode if more of them is needed.
+ */
+static bw_error expr_skip(const bw_step *steps, expr_state *states, size_t count, off_t n, size_t *failed) {
+    for (size_t i = 0; i < count; i += 1 + states[i].folded) {
+        const bw_step *step = &steps[i];
+        expr_state *state = &states[i];
+        
+        if (state->table || expr_is_constant(step)) {
+            continue;
+        } else if (!step->operand) {
+            state->phase = (state->phase + n % step->size) % step->size;
+            continue;
+        }
+        
+        off_t skipped = reader_skip(&state->op, n);
+        bw_error error = no_error;
+        if (state->op.error) {
+            error = create_error(BW_ERR_OPERAND_READ);
+        } else if (skipped < n && step->eof == EOF_LOOP && reader_tell(&state->op) > 0) {
+            // Skip the remainder from the start of the operand
+            off_t op_size = reader_tell(&state->op);
+            if (!reader_rewind(&state->op)) {
+                error = create_error(BW_ERR_OPERAND_SEEK);
+            } else {
+                stats.rewinds++;
+                reader_skip(&state->op, (n - skipped) % op_size);
+            }
+        }
+        
+        if (error.type) {
+            *failed = i;
+            return error;
+        }
+    }
+    
+    return no_error;
+}
+
+/*
+ * Find how many bytes from the current position of `in` the output of the
+ * prepared expression is known to be zero, because they're in a hole of the
+ * input or of operand files the steps turn into zeros. Returns 0 if it isn't
+ * known to be zero for at least HOLE_MIN bytes, in which case `n` is limited
+ * so the next block stops before the next hole of the input or operands.
+ */
+static size_t expr_hole(const bw_step *steps, expr_state *states, size_t count, bw_reader *in, size_t *n) {
+    bool hole;
+    size_t extent = reader_extent(in, &hole);
+    if (!extent) {
+        return 0;
+    }
+    
+    // Work out the value of a byte of the output from what's known to be
+    // zero, over the length everything used is known for
+    bool known = hole;
+    byte value = 0;
+    size_t length = extent, data = hole ? SIZE_MAX : extent;
+    for (size_t i = 0; i < count; i += 1 + states[i].folded) {
+        const bw_step *step = &steps[i];
+        expr_state *state = &states[i];
+        
+        if (state->table) {
+            value = state->table[value];
+            continue;
+        } else if (expr_is_constant(step)) {
+            value = expr_apply_byte(step, value);
+            continue;
+        }
+        
+        bool op_zero = !step->operand && state->pat_zero;
+        if (step->operand) {
+            // Operands which stop early must be handled block by block
+            off_t remaining = reader_remaining(&state->op);
+            if (step->eof != EOF_LOOP) {
+                length = remaining == -1 ? 0 : MIN(length, (size_t)remaining);
+            }
+            
+            bool op_hole;
+            size_t op_extent = reader_extent(&state->op, &op_hole);
+            if (op_extent && op_hole) {
+                op_zero = true;
+                length = MIN(length, op_extent);
+            } else if (op_extent) {
+                data = MIN(data, op_extent);
+            }
+        }
+        
+        // A zero operand clears everything for AND, and changes nothing for
+        // OR and XOR
+        if (op_zero && step->op == BW_AND) {
+            known = true;
+            value = 0;
+        } else if (!op_zero && !(step->op == BW_AND && known && value == 0)) {
+            known = false;
+        }
+    }
+    
+    if (known && value == 0 && length >= HOLE_MIN) {
+        return length;
+    }
+    
+    *n = MIN(*n, data);
+    return 0;
+}
+
+/*
+ * Run the prepared expression over up to `length` bytes of `input`, or the
+ * rest of it if -1, in blocks of up to `block` bytes, putting the number of
+ * bytes read in `processed`. Sets `stopped` if output ended early because an
+ * operand was truncated or an error occurred.
+ */
+static bw_error expr_run(FILE *input, FILE *output, const bw_step *steps, expr_state *states, size_t count, size_t block, off_t length, off_t *processed, bool *stopped, size_t *failed) {
+    bw_reader in;
+    reader_open(&in, input);
+    if (length != -1) {
+        reader_limit(&in, length);
+    }
+    
+    // Output will be no larger than the input or any operand being truncated
+    off_t size = reader_remaining(&in);
+    for (size_t i = 0; i < count; i += 1 + states[i].folded) {
+        if (!states[i].table && steps[i].operand && steps[i].eof == EOF_TRUNCATE
+                && reader_remaining(&states[i].op) < size) {
+            size = reader_remaining(&states[i].op);
+        }
+    }
+    
+    bw_writer out;
+    writer_open(&out, output, size, &in);
+    
+    bw_error error = no_error;
+    *processed = 0;
+    *stopped = false;
+    while (!*stopped) {
+        // Skip holes which would come out as zeros, leaving a hole in the output
+        size_t n = block, read;
+        size_t zeros = expr_hole(steps, states, count, &in, &n);
+        if (zeros) {
+            reader_skip(&in, zeros);
+            *processed += zeros;
+            error = expr_skip(steps, states, count, zeros, failed);
+            if (!error.type && !writer_zero(&out, zeros)) {
+                error = create_error(BW_ERR_OUTPUT_WRITE);
+            }
+            *stopped = error.type;
+            continue;
+        }
+        
+        // Read from input, straight into the output if it isn't mapped. Blocks
+        // are kept small so they stay in cache between steps.
+        byte *dst = writer_reserve(&out, &n);
+        const byte *src = reader_next(&in, dst, n, &read);
+        // Check error if nothing read, or stop if reached EOF
+        if (!read) {
+            if (in.error) {
+                error = create_error(BW_ERR_INPUT_READ);
+                *stopped = true;
+            }
+            break;
+        }
+        *processed += read;
+        
+        // Apply every step to the block, keeping the first error
+        size_t n_out = read;
+        for (size_t i = 0; i < count; i += 1 + states[i].folded) {
+            bw_error step_error = expr_apply(&steps[i], &states[i], dst, src, &n_out);
+            if (step_error.type && !error.type) {
+                error = step_error;
+                *failed = i;
+            }
+            src = dst;
+        }
+        
+        if (src != dst) {
+            memcpy(dst, src, n_out);
+        }
+        
+        // Write to output
+        if (!writer_commit(&out, n_out)) {
+            error = create_error(BW_ERR_OUTPUT_WRITE);
+        }
+        
+        // Stop if an operand was truncated
+        *stopped = n_out < read || error.type;
+    }
+    
+    return io_close(&in, &out, error);
+}
+
+bw_error expr(FILE *input, FILE *output, const bw_step *steps, size_t count, size_t *failed) {
+    bw_range all = {.offset = 0, .length = -1};
+    return expr_ranges(input, output, steps, count, &all, 1, failed);
+}
+
+bw_error expr_ranges(FILE *input, FILE *output, const bw_step *steps, size_t count, const bw_range *ranges, size_t nranges, size_t *failed) {
+    expr_state *states = calloc(count, sizeof(expr_state));
+    if (!states && count) {
+        return create_error(BW_ERR_MEMORY);
+    }
+    
+    size_t block = buf_size_for(input);
+    bw_error error = expr_prepare(steps, states, count, block, failed);
+    bool stopped = error.type;
+    off_t pos = 0;
+    
+    for (size_t r = 0; r <= nranges && !stopped; r++) {
+        // Pass bytes before the range through untouched, or everything after
+        // the last range. When writing in place they can just be skipped.
+        off_t gap = r < nranges ? ranges[r].offset - pos : OFF_MAX;
+        if (gap > 0) {
+            double start = stats_start();
+            off_t passed = input == output ? (off_t)fskip(input, gap) : fcopy(input, output, gap);
+            if (input != output) {
+                stats_count(&stats.input, passed, 0);
+                stats_count(&stats.output, passed, start);
+            }
+            if (ferror(input)) {
+                error = create_error(BW_ERR_INPUT_READ);
+            } else if (ferror(output)) {
+                error = create_error(BW_ERR_OUTPUT_WRITE);
+            } else if (r < nranges) {
+                // Operands stay lined up with the input
+                error = expr_skip(steps, states, count, passed, failed);
+            }
+            
+            pos += passed;
+            stopped = passed < gap || error.type;
+        }
+        
+        if (r < nranges && !stopped) {
+            off_t processed;
+            error = expr_run(input, output, steps, states, count, block, ranges[r].length, &processed, &stopped, failed);
+            pos += processed;
+            stopped |= ranges[r].length == -1 || processed < ranges[r].length;
+        }
     }
     
+    expr_close(steps, states, count);
     return error;
 }
 
+// Stream functions
+
+struct bw_stream {
+    const bw_step *steps;
+    size_t count;
+    expr_state *states;
+    /* Size of the blocks the operand buffers and patterns cover. */
+    size_t block;
+};
+
+bw_stream *bw_stream_open(const bw_step *steps, size_t count, bw_error *error, size_t *failed) {
+    bw_stream *s = calloc(1, sizeof(bw_stream));
+    expr_state *states = calloc(count, sizeof(expr_state));
+    if (!s || (!states && count)) {
+        *error = create_error(BW_ERR_MEMORY);
+        free(s);
+        free(states);
+        return NULL;
+    }
+    
+    *s = (bw_stream){
+        .steps = steps,
+        .count = count,
+        .states = states,
+        .block = buf_size ? buf_size : BUF_SIZE_DEFAULT
+    };
+    
+    *error = expr_prepare(steps, states, count, s->block, failed);
+    if (error->type) {
+        bw_stream_close(s);
+        return NULL;
+    }
+    
+    return s;
+}
+
+bw_error bw_stream_next(bw_stream *s, byte *dst, const byte *src, size_t *n, size_t *failed) {
+    bw_error error = no_error;
+    size_t total = 0;
+    
+    while (total < *n) {
+        // Apply every step to each block, keeping the first error
+        size_t block = MIN(s->block, *n - total), n_out = block;
+        byte *block_dst = dst + total;
+        const byte *block_src = src + total;
+        for (size_t i = 0; i < s->count; i += 1 + s->states[i].folded) {
+            bw_error step_error = expr_apply(&s->steps[i], &s->states[i], block_dst, block_src, &n_out);
+            if (step_error.type && !error.type) {
+                error = step_error;
+                *failed = i;
+            }
+            block_src = block_dst;
+        }
+        
+        if (block_src != block_dst) {
+            memcpy(block_dst, block_src, n_out);
+        }
+        total += n_out;
+        
+        // Stop if an operand was truncated
+        if (n_out < block || error.type) {
+            break;
+        }
+    }
+    
+    *n = total;
+    return error;
+}
+
+void bw_stream_close(bw_stream *s) {
+    if (s) {
+        expr_close(s->steps, s->states, s->count);
+        free(s);
+    }
+}
+
+// Reduction functions
+
+bw_error popcount(FILE *input, uint64_t *bits) {
+    size_t failed;
+    return popcount_expr(input, NULL, 0, bits, &failed);
+}
+
+bw_error popcount_expr(FILE *input, const bw_step *steps, size_t count, uint64_t *bits, size_t *failed) {
+    *bits = 0;
+    *failed = 0;
+    
+    bw_error error = no_error;
+    bw_stream *s = NULL;
+    if (count && !(s = bw_stream_open(steps, count, &error, failed))) {
+        return error;
+    }
+    
+    // Results of the steps go in buf, the input is used directly if mapped
+    size_t block = buf_size_for(input);
+    byte *buf = buf_alloc(block);
+    if (!buf) {
+        bw_stream_close(s);
+        return create_error(BW_ERR_MEMORY);
+    }
+    
+    bw_reader in;
+    reader_open(&in, input);
+    while (!error.type) {
+        // Holes have no bits set, unless steps could change that
+        bool hole;
+        size_t extent = s ? 0 : reader_extent(&in, &hole);
+        if (extent && hole && reader_skip(&in, extent)) {
+            continue;
+        }
+        
+        size_t n = in.map && !s ? MAP_BLOCK : block, read;
+        const byte *src = reader_next(&in, buf, n, &read);
+        // Check error if nothing read, or stop if reached EOF
+        if (!read) {
+            if (in.error) {
+                error = create_error(BW_ERR_INPUT_READ);
+            }
+            break;
+        }
+        
+        n = read;
+        if (s) {
+            error = bw_stream_next(s, buf, src, &n, failed);
+            src = buf;
+        }
+        *bits += kernels()->popcount(src, n);
+        
+        // Stop if an operand was truncated
+        if (n < read) {
+            break;
+        }
+    }
+    
+    reader_close(&in);
+    buf_free(buf);
+    bw_stream_close(s);
+    return error;
+}
+
+bw_error hamming(FILE *input, FILE *operand, eof_mode eof, uint64_t *bits) {
+    bw_step step = {.op = BW_XOR, .operand = operand, .eof = eof};
+    size_t failed;
+    return popcount_expr(input, &step, 1, bits, &failed);
+}
+
+/*
+ * Find the first nonzero byte of the result of the steps like cmp_expr(),
+ * also putting the number of bytes which were checked in `total`.
+ */
+static bw_error find_nonzero(FILE *input, const bw_step *steps, size_t count, off_t *offset, int *bit, off_t *total, size_t *failed) {
+    *offset = -1;
+    *bit = -1;
+    *total = 0;
+    *failed = 0;
+    
+    bw_error error = no_error;
+    bw_stream *s = NULL;
+    if (count && !(s = bw_stream_open(steps, count, &error, failed))) {
+        return error;
+    }
+    
+    // Results of the steps go in buf, the input is used directly if mapped
+    size_t block = buf_size_for(input);
+    byte *buf = buf_alloc(block);
+    if (!buf) {
+        bw_stream_close(s);
+        return create_error(BW_ERR_MEMORY);
+    }
+    
+    bw_reader in;
+    reader_open(&in, input);
+    while (!error.type) {
+        // Holes are all zero, unless steps could change that
+        bool hole;
+        size_t extent = s ? 0 : reader_extent(&in, &hole);
+        if (extent && hole) {
+            size_t skipped = reader_skip(&in, extent);
+            *total += skipped;
+            if (skipped) {
+                continue;
+            }
+        }
+        
+        size_t n = in.map && !s ? MAP_BLOCK : block, read;
+        const byte *src = reader_next(&in, buf, n, &read);
+        // Check error if nothing read, or stop if reached EOF
+        if (!read) {
+            if (in.error) {
+                error = create_error(BW_ERR_INPUT_READ);
+            }
+            break;
+        }
+        
+        n = read;
+        if (s) {
+            error = bw_stream_next(s, buf, src, &n, failed);
+            src = buf;
+        }
+        
+        // A difference before any error from the steps is still the first
+        size_t i = kernels()->nonzero(src, n);
+        if (i < n) {
+            *offset = *total + i;
+            *bit = __builtin_clz(src[i]) - (sizeof(unsigned) - 1) * BYTE_BIT;
+            error = no_error;
+            break;
+        }
+        *total += n;
+        
+        // Stop if an operand was truncated
+        if (n < read) {
+            break;
+        }
+    }
+    
+    reader_close(&in);
+    buf_free(buf);
+    bw_stream_close(s);
+    return error;
+}
+
+bw_error cmp_expr(FILE *input, const bw_step *steps, size_t count, off_t *offset, int *bit, size_t *failed) {
+    off_t total;
+    return find_nonzero(input, steps, count, offset, bit, &total, failed);
+}
+
+bw_error cmp_file(FILE *input, FILE *operand, eof_mode eof, off_t *offset, int *bit) {
+    bw_step step = {.op = BW_XOR, .operand = operand, .eof = eof};
+    size_t failed;
+    off_t total;
+    bw_error error = find_nonzero(input, &step, 1, offset, bit, &total, &failed);
+    
+    // The shorter file ends where the other still has bytes
+    if (eof == EOF_ERROR && *offset == -1) {
+        if (error.type == BW_ERR_OPERAND_EOF) {
+            *offset = total;
+            error = no_error;
+        } else if (!error.type && getc(operand) != EOF) {
+            *offset = total;
+        } else if (!error.type && ferror(operand)) {
+            error = create_error(BW_ERR_OPERAND_READ);
+        }
+    }
+    
+    return error;
+}
+
+// Shift functions
+
+/*
+ * Shift the rest of regular file `input` by `byte_offset` whole bytes without
+ * reading it, by collapsing or inserting a range of the file when shifting in
+ * place, or having the kernel copy it to its new offset in `output`. Returns
+ * false without changing anything if it can't be done this way.
+ */
+static bool shift_bytes(FILE *input, FILE *output, bool left, size_t byte_offset, bw_error *error) {
+    off_t start = ftello(input), end = fsize(input);
+    if (start == -1 || end == -1 || start > end || fflush(output) != 0) {
+        return false;
+    }
+    
+    size_t size = end - start, zeros = MIN(byte_offset, size), kept = size - zeros;
+    double io_start = stats_start();
+    bool ok;
+    *error = no_error;
+    
+    if (input == output) {
+        // Only whole filesystem blocks can be moved, and some must be left
+        if (!kept || !(left ? fcollapse : finsert)(input, start, zeros)) {
+            return false;
+        }
+        
+        // Put the file back to its size, zero filling the end or the hole left
+        // at the start if holes aren't wanted
+        if (left) {
+            ok = fseeko(input, start + kept, SEEK_SET) == 0 && fzero(input, zeros) == zeros;
+        } else {
+            ok = ftruncate(fileno(input), end) == 0
+                && (use_sparse || (fseeko(input, start, SEEK_SET) == 0 && fzero(input, zeros) == zeros))
+                && fseeko(input, end, SEEK_SET) == 0;
+        }
+        
+        if (!ok) {
+            *error = create_error(BW_ERR_OUTPUT_WRITE);
+        }
+        stats_count(&stats.output, zeros, io_start);
+        return true;
+    }
+    
+    // Copying would fill in holes, which the normal path keeps
+    if (use_sparse && fsparse(input)) {
+        return false;
+    }
+    
+    if (left) {
+        ok = fseeko(input, start + zeros, SEEK_SET) == 0 && fcopy(input, output, kept) == kept
+            && fzero(output, zeros) == zeros;
+    } else {
+        ok = fzero(output, zeros) == zeros && fcopy(input, output, kept) == kept
+            && fseeko(input, end, SEEK_SET) == 0;
+    }
+    
+    if (!ok) {
+        *error = create_error(ferror(input) ? BW_ERR_INPUT_READ : BW_ERR_OUTPUT_WRITE);
+    }
+    stats_count(&stats.input, kept, 0);
+    stats_count(&stats.output, size, io_start);
+    return true;
+}
+
 bw_error lshift(FILE *input, FILE *output, shift amount) {
-    return bw_shift(input, output, amount, memshiftl);
+    size_t byte_offset = amount / BYTE_BIT;
+    shift bit_offset = amount % BYTE_BIT;
+    
+    bw_error error;
+    if (!bit_offset && shift_bytes(input, output, true, byte_offset, &error)) {
+        return error;
+    }
+    
+    // Each output byte needs the next input byte, so the last byte read is
+    // kept at the start of window for the next block
+    size_t block = buf_size_for(input);
+    byte *window = buf_alloc(block + 1);
+    if (!window) {
+        return create_error(BW_ERR_MEMORY);
+    }
+    size_t pending = 0;
+    
+    bw_reader in;
+    reader_open(&in, input);
+    bw_writer out;
+    writer_open(&out, output, reader_remaining(&in), &in);
+    
+    // Drop the leading bytes, they'll be replaced by zeros at the end
+    size_t skipped = reader_skip(&in, byte_offset);
+    
+    error = no_error;
+    while (true) {
+        // Read from input after the pending byte
+        size_t n = block;
+        byte *dst = writer_reserve(&out, &n);
+        size_t read = reader_read(&in, window + pending, n);
+        // Check error if nothing read, or stop if reached EOF
+        if (!read) {
+            if (in.error) {
+                error = create_error(BW_ERR_INPUT_READ);
+            }
+            break;
+        }
+        
+        // Shift all but the new last byte
+        size_t total = pending + read;
+        bitshiftl(dst, window, total - 1, bit_offset);
+        
+        // Write to output
+        if (!writer_commit(&out, total - 1)) {
+            error = create_error(BW_ERR_OUTPUT_WRITE);
+            break;
+        }
+        
+        window[0] = window[total - 1];
+        pending = 1;
+    }
+    
+    // Shift in zero bits after the last byte, then zero fill the skipped bytes
+    if (!error.type && pending) {
+        size_t n = 1;
+        byte *dst = writer_reserve(&out, &n);
+        dst[0] = window[0] << bit_offset;
+        
+        if (!writer_commit(&out, 1)) {
+            error = create_error(BW_ERR_OUTPUT_WRITE);
+        }
+    }
+    if (!error.type && !writer_zero(&out, skipped)) {
+        error = create_error(BW_ERR_OUTPUT_WRITE);
+    }
+    
+    buf_free(window);
+    return io_close(&in, &out, error);
+}
+
+/*
+ * Shift the rest of regular file `f` right in place. Works backwards from the
+ * end of the file so nothing is overwritten before it's been read.
+ */
+static bw_error rshift_in_place(FILE *f, size_t byte_offset, shift bit_offset) {
+    off_t start = ftello(f), end = fsize(f);
+    if (start == -1 || end == -1 || fflush(f) != 0) {
+        return create_error(BW_ERR_OUTPUT_WRITE);
+    }
+    
+    int fd = fileno(f);
+    size_t size = end - start;
+    size_t zeros = MIN(byte_offset, size);
+    
+    size_t block = buf_size_for(f);
+    byte *in_buf = buf_alloc(block + 1), *out_buf = buf_alloc(block);
+    bw_error error = in_buf && out_buf ? no_error : create_error(BW_ERR_MEMORY);
+    for (size_t hi = size, n; hi > zeros && !error.type; hi -= n) {
+        // Output [lo, hi) comes from input [lo - byte_offset - 1, hi - byte_offset)
+        n = MIN(block, hi - zeros);
+        size_t lo = hi - n, src = lo - zeros;
+        
+        // Bits shifted in before the first byte are zero
+        in_buf[0] = 0;
+        byte *read_buf = src == 0 ? in_buf + 1 : in_buf;
+        size_t read_n = src == 0 ? n : n + 1;
+        off_t read_pos = start + (src == 0 ? 0 : src - 1);
+        double read_start = stats_start();
+        if (pread(fd, read_buf, read_n, read_pos) != read_n) {
+            error = create_error(BW_ERR_INPUT_READ);
+            break;
+        }
+        stats_count(&stats.input, read_n, read_start);
+        
+        bitshiftr(out_buf, in_buf, n, bit_offset);
+        
+        double write_start = stats_start();
+        if (pwrite(fd, out_buf, n, start + lo) != n) {
+            error = create_error(BW_ERR_OUTPUT_WRITE);
+        }
+        stats_count(&stats.output, n, write_start);
+    }
+    
+    // Zero fill the start
+    if (!error.type) {
+        memset(out_buf, 0, MIN(block, zeros));
+    }
+    for (size_t pos = 0, n; pos < zeros && !error.type; pos += n) {
+        n = MIN(block, zeros - pos);
+        double write_start = stats_start();
+        if (pwrite(fd, out_buf, n, start + pos) != n) {
+            error = create_error(BW_ERR_OUTPUT_WRITE);
+        }
+        stats_count(&stats.output, n, write_start);
+    }
+    
+    buf_free(in_buf);
+    buf_free(out_buf);
+    
+    if (!error.type && fseeko(f, end, SEEK_SET) != 0) {
+        error = create_error(BW_ERR_OUTPUT_WRITE);
+    }
+    
+    return error;
+}
+
+/* FIFO of bytes used by rshift to delay output when the input size is unknown. */
+typedef struct byte_queue {
+    byte *buf;
+    size_t start, size, capacity;
+} byte_queue;
+
+/* Add `n` bytes from `data` to the end of `q`. Returns false if out of memory. */
+static bool queue_push(byte_queue *q, const byte *data, size_t n) {
+    // Move everything back to the start if there isn't enough room at the end
+    if (q->start + q->size + n > q->capacity) {
+        memmove(q->buf, q->buf + q->start, q->size);
+        q->start = 0;
+    }
+    
+    if (q->size + n > q->capacity) {
+        size_t capacity = MAX(q->size + n, q->capacity * 2);
+        byte *buf = realloc(q->buf, capacity);
+        if (!buf) {
+            return false;
+        }
+        
+        q->buf = buf;
+        q->capacity = capacity;
+    }
+    
+    memcpy(q->buf + q->start + q->size, data, n);
+    q->size += n;
+    return true;
 }
 
 bw_error rshift(FILE *input, FILE *output, shift amount) {
-    return bw_shift(input, output, amount, memshiftr);
+    size_t byte_offset = amount / BYTE_BIT;
+    shift bit_offset = amount % BYTE_BIT;
+    
+    bw_error error;
+    if (!bit_offset && shift_bytes(input, output, false, byte_offset, &error)) {
+        return error;
+    }
+    
+    if (output == input) {
+        return rshift_in_place(input, byte_offset, bit_offset);
+    }
+    
+    bw_reader in;
+    reader_open(&in, input);
+    off_t size = reader_remaining(&in);
+    bw_writer out;
+    writer_open(&out, output, size, NULL);
+    
+    // The last byte_offset bytes of input are dropped. If the input size is
+    // known we can just stop early. Otherwise if the output is a regular file
+    // it can be truncated afterwards, or else output has to be delayed by
+    // byte_offset bytes until we know which bytes are the last.
+    size_t zeros = byte_offset, limit = SIZE_MAX;
+    off_t out_start = -1;
+    bool delay = false;
+    if (size != -1) {
+        zeros = MIN(byte_offset, size);
+        limit = size - zeros;
+    } else if (fsize(output) != -1 && fflush(output) == 0) {
+        out_start = ftello(output);
+    } else {
+        delay = true;
+    }
+    
+    error = no_error;
+    if (!delay && !writer_zero(&out, zeros)) {
+        error = create_error(BW_ERR_OUTPUT_WRITE);
+    }
+    
+    // The previous byte is kept at the start of window, starting with zero
+    size_t block = buf_size_for(input);
+    byte *window = buf_alloc(block + 1), *shifted = delay ? buf_alloc(block) : NULL;
+    if (!window || (delay && !shifted)) {
+        error = create_error(BW_ERR_MEMORY);
+    } else {
+        window[0] = 0;
+    }
+    byte_queue queue = {0};
+    size_t total = 0;
+    while (!error.type && total < limit) {
+        // Read from input after the previous byte
+        size_t n = MIN(block, limit - total);
+        byte *dst = delay ? shifted : writer_reserve(&out, &n);
+        size_t read = reader_read(&in, window + 1, n);
+        // Check error if nothing read, or stop if reached EOF
+        if (!read) {
+            if (in.error) {
+                error = create_error(BW_ERR_INPUT_READ);
+            }
+            break;
+        }
+        
+        bitshiftr(dst, window, read, bit_offset);
+        window[0] = window[read];
+        total += read;
+        
+        if (!delay) {
+            // Write to output
+            if (!writer_commit(&out, read)) {
+                error = create_error(BW_ERR_OUTPUT_WRITE);
+            }
+            continue;
+        }
+        
+        // Output as many bytes as we've read, zeros first then the oldest
+        // shifted bytes
+        if (!queue_push(&queue, shifted, read)) {
+            error = create_error(BW_ERR_MEMORY);
+            break;
+        }
+        
+        size_t zero_count = MIN(zeros, read);
+        zeros -= zero_count;
+        if (!writer_zero(&out, zero_count)) {
+            error = create_error(BW_ERR_OUTPUT_WRITE);
+            break;
+        }
+        
+        size_t remaining = read - zero_count;
+        while (remaining > 0 && !error.type) {
+            size_t chunk = remaining;
+            byte *dst = writer_reserve(&out, &chunk);
+            memcpy(dst, queue.buf + queue.start, chunk);
+            queue.start += chunk;
+            queue.size -= chunk;
+            remaining -= chunk;
+            
+            if (!writer_commit(&out, chunk)) {
+                error = create_error(BW_ERR_OUTPUT_WRITE);
+            }
+        }
+    }
+    
+    free(queue.buf);
+    buf_free(window);
+    buf_free(shifted);
+    error = io_close(&in, &out, error);
+    
+    // Trim the bytes which were shifted past the end
+    if (out_start != -1 && !error.type) {
+        off_t end = out_start + total;
+        if (fflush(output) != 0
+                || ftruncate(fileno(output), end) != 0
+                || fseeko(output, end, SEEK_SET) != 0) {
+            error = create_error(BW_ERR_OUTPUT_WRITE);
+        }
+    }
+    
+    return error;
 }
@@ -4,6 +4,12 @@
 #include <stdio.h>
 #include "utils.h"
 
+/*
+ * All functions read from `input` and write to `output` starting at their
+ * current positions. `output` may be the same FILE as `input`, opened for
+ * reading and writing, to write the output in place over the input.
+ */
+
 // Types
 
 /* Details on type of error (if any) in bitwise functions. */
@@ -22,8 +28,12 @@ typedef struct bw_error {
          * mode is EOF_LOOP and operand file is 0 bytes long.
          */
         BW_ERR_OPERAND_EOF,
-        /* EOF mode is EOF_LOOP and operand file cannot be seeked. */
+        /*
+         * EOF mode is EOF_LOOP and operand file cannot be seeked or cached.
+         */
         BW_ERR_OPERAND_SEEK,
+        /* A buffer could not be allocated. */
+        BW_ERR_MEMORY,
     } type;
     /* The errno of the error that occurred. */
     int error_number;
@@ -31,6 +41,20 @@ typedef struct bw_error {
 
 extern const bw_error no_error;
 
+// Tunables
+
+/* Default value of bw_loop_cache_limit. */
+#ifndef BW_LOOP_CACHE_LIMIT
+#define BW_LOOP_CACHE_LIMIT (64 * 1024 * 1024)
+#endif
+
+/*
+ * Maximum size of an operand file to cache in memory when using EOF_LOOP.
+ * Operand files which fit are only read once, and can be non-seekable. Larger
+ * operand files are seeked back to the start instead. 0 disables caching.
+ */
+extern size_t bw_loop_cache_limit;
+
 /* How to handle premature EOF of the operand file in '_file' functions. */
 typedef enum eof_mode {
     /* Close all files and exit with code ERROR_OPERAND_UNDERFLOW. */
@@ -42,7 +66,8 @@ typedef enum eof_mode {
     EOF_TRUNCATE,
     /*
      * Seek the operand file to the beginning and continue. Exit with code
-     * ERROR_OPERAND_NOT_SEEKABLE if operand file cannot be seeked.
+     * ERROR_OPERAND_NOT_SEEKABLE if operand file cannot be seeked. Operand
+     * files up to bw_loop_cache_limit are cached instead of being seeked.
      */
     EOF_LOOP,
     /*
@@ -57,6 +82,41 @@ typedef enum eof_mode {
     EOF_ONE,
 } eof_mode;
 
+/* Size of the table used to map bytes. */
+#define BW_MAP_SIZE 256
+
+/* Operators which can be used in an expression. */
+typedef enum bw_operator {
+    BW_OR,
+    BW_AND,
+    BW_XOR,
+    BW_NOT,
+    /* Replace each byte with its entry in a table of BW_MAP_SIZE bytes. */
+    BW_MAP,
+} bw_operator;
+
+/* A single step of an expression, applied to the result of the last step. */
+typedef struct bw_step {
+    bw_operator op;
+    /* Operand file, or NULL to use `pattern`. Unused by BW_NOT. */
+    FILE *operand;
+    /* How to handle `operand` being shorter than the input. */
+    eof_mode eof;
+    /*
+     * Pattern operand of `size` bytes if there's no operand file, or the
+     * table for BW_MAP.
+     */
+    const byte *pattern;
+    size_t size;
+} bw_step;
+
+/* A range of bytes of the input, from it's position when starting. */
+typedef struct bw_range {
+    off_t offset;
+    /* Number of bytes in the range, or -1 for the rest of the input. */
+    off_t length;
+} bw_range;
+
 // Byte functions
 
 /* Bitwise OR each byte from `input` with `operand` and write to `output`. */
@@ -68,6 +128,26 @@ bw_error and_byte(FILE *input, FILE *output, byte operand);
 /* Bitwise XOR each byte from `input` with `operand` and write to `output`. */
 bw_error xor_byte(FILE *input, FILE *output, byte operand);
 
+// Pattern functions
+
+/*
+ * Bitwise OR each byte from `input` with the `size` bytes of `pattern`,
+ * repeated for the length of `input`, and write to `output`.
+ */
+bw_error or_pattern(FILE *input, FILE *output, const byte *pattern, size_t size);
+
+/*
+ * Bitwise AND each byte from `input` with the `size` bytes of `pattern`,
+ * repeated for the length of `input`, and write to `output`.
+ */
+bw_error and_pattern(FILE *input, FILE *output, const byte *pattern, size_t size);
+
+/*
+ * Bitwise XOR each byte from `input` with the `size` bytes of `pattern`,
+ * repeated for the length of `input`, and write to `output`.
+ */
+bw_error xor_pattern(FILE *input, FILE *output, const byte *pattern, size_t size);
+
 // File functions
 
 /*
@@ -91,11 +171,130 @@ bw_error and_file(FILE *input, FILE *output, FILE *operand, eof_mode eof);
  */
 bw_error xor_file(FILE *input, FILE *output, FILE *operand, eof_mode eof);
 
+/*
+ * Bitwise OR each byte from `input` with each byte from all `count` files in
+ * `operands` and write to `output`, reading every file once. Each operand
+ * uses its own eof_mode from `eofs`, and output stops at the first operand to
+ * be truncated. If an error is caused by an operand, its index is put in
+ * `failed`. `count` must be at least 1.
+ */
+bw_error or_files(FILE *input, FILE *output, FILE *const *operands, const eof_mode *eofs, size_t count, size_t *failed);
+
+/*
+ * Bitwise AND each byte from `input` with each byte from all `count` files in
+ * `operands` and write to `output`, like or_files().
+ */
+bw_error and_files(FILE *input, FILE *output, FILE *const *operands, const eof_mode *eofs, size_t count, size_t *failed);
+
+/*
+ * Bitwise XOR each byte from `input` with each byte from all `count` files in
+ * `operands` and write to `output`, like or_files(). E.g. XORing a stripe of
+ * data files into their parity.
+ */
+bw_error xor_files(FILE *input, FILE *output, FILE *const *operands, const eof_mode *eofs, size_t count, size_t *failed);
+
 // NOT function
 
 /* Bitwise NOT each byte from `input` and write to `output`. */
 bw_error not(FILE *input, FILE *output);
 
+// Map function
+
+/*
+ * Replace each byte from `input` with its entry in `table`, which must be
+ * BW_MAP_SIZE bytes, and write to `output`.
+ */
+bw_error map(FILE *input, FILE *output, const byte *table);
+
+// Expression function
+
+/*
+ * Apply each of the `count` steps to each block from `input` in order, and
+ * write the final result to `output`, so input is only read once and output
+ * only written once. Operand files use their own EOF modes, and output stops
+ * at the first operand to be truncated. If an error is caused by a step, its
+ * index is put in `failed`.
+ * 
+ * Runs of steps with byte operands, NOT and BW_MAP are folded into a single
+ * table, or into an AND and XOR if every bit of the result only depends on the
+ * same bit of the input.
+ */
+bw_error expr(FILE *input, FILE *output, const bw_step *steps, size_t count, size_t *failed);
+
+/*
+ * Like expr(), but only apply the steps to the `nranges` `ranges` of `input`,
+ * which must be sorted and not overlap. Bytes outside the ranges are copied
+ * to `output` unchanged, without passing through user space where possible,
+ * or skipped if writing in place. Operands and patterns stay lined up with
+ * the input, as if the steps were applied to all of it.
+ */
+bw_error expr_ranges(FILE *input, FILE *output, const bw_step *steps, size_t count, const bw_range *ranges, size_t nranges, size_t *failed);
+
+// Stream functions
+
+/* An expression being applied to a stream of buffers. */
+typedef struct bw_stream bw_stream;
+
+/*
+ * Start applying the `count` steps to a stream of buffers, like expr(). Steps
+ * must stay valid until the stream is closed, and operand files are read from
+ * their current positions. Returns NULL and sets `error` on failure, putting
+ * the index of the step that failed in `failed` if caused by a step.
+ */
+bw_stream *bw_stream_open(const bw_step *steps, size_t count, bw_error *error, size_t *failed);
+
+/*
+ * Apply the steps of `s` to the next `n` bytes of `src` and put the result in
+ * `dst`, which may be the same as `src`. If an operand is truncated or fails,
+ * `n` is reduced to the number of bytes output and nothing more should be
+ * output. If an error is caused by a step, its index is put in `failed`.
+ */
+bw_error bw_stream_next(bw_stream *s, byte *dst, const byte *src, size_t *n, size_t *failed);
+
+/* Free `s`, without closing its operand files. */
+void bw_stream_close(bw_stream *s);
+
+// Reduction functions
+
+/*
+ * Count the set bits of `input` and put the total in `bits`, without writing
+ * any output. Holes in sparse files are skipped without being read.
+ */
+bw_error popcount(FILE *input, uint64_t *bits);
+
+/*
+ * Count the set bits of the result of applying the `count` steps to `input`
+ * and put the total in `bits`, like expr() but without writing any output. If
+ * an error is caused by a step, its index is put in `failed`.
+ */
+bw_error popcount_expr(FILE *input, const bw_step *steps, size_t count, uint64_t *bits, size_t *failed);
+
+/*
+ * Count the bits which differ between `input` and `operand`, i.e. their
+ * Hamming distance, and put the total in `bits`. If `operand` is smaller than
+ * `input`, then the specified eof_mode is used.
+ */
+bw_error hamming(FILE *input, FILE *operand, eof_mode eof, uint64_t *bits);
+
+/*
+ * Find the first byte of the result of applying the `count` steps to `input`
+ * which isn't zero, putting its offset from the start of `input` in `offset`
+ * and the index of its first set bit, from the most significant, in `bit`. If
+ * every byte is zero `offset` is -1. Stops reading as soon as one is found. If
+ * an error is caused by a step, its index is put in `failed`.
+ */
+bw_error cmp_expr(FILE *input, const bw_step *steps, size_t count, off_t *offset, int *bit, size_t *failed);
+
+/*
+ * Find the first bit which differs between `input` and `operand`, putting the
+ * offset of its byte in `offset` and its index in `bit`, or -1 in `offset` if
+ * they're the same. Stops reading as soon as a difference is found. If
+ * `operand` is smaller than `input`, then the specified eof_mode is used,
+ * except EOF_ERROR which treats either file being longer as a difference at
+ * the end of the other, with -1 in `bit`.
+ */
+bw_error cmp_file(FILE *input, FILE *operand, eof_mode eof, off_t *offset, int *bit);
+
 // Shift functions
 
 /* Shift the bits from 'in' left by `amount` and write to `output`. */
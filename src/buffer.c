@@ -0,0 +1,194 @@
+#include "buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "bitwise.h"
+#include "kernel.h"
+
+/* Size of the buffer short patterns are repeated into on the stack. */
+#define PATTERN_BUF_SIZE 4096
+
+// Buffer functions
+
+void bw_or_buf(byte *dst, const byte *src, const byte *op, size_t n) {
+    kernels()->or_mem(dst, src, op, n);
+}
+
+void bw_and_buf(byte *dst, const byte *src, const byte *op, size_t n) {
+    kernels()->and_mem(dst, src, op, n);
+}
+
+void bw_xor_buf(byte *dst, const byte *src, const byte *op, size_t n) {
+    kernels()->xor_mem(dst, src, op, n);
+}
+
+void bw_not_buf(byte *dst, const byte *src, size_t n) {
+    kernels()->not_byte(dst, src, 0, n);
+}
+
+void bw_map_buf(byte *dst, const byte *src, const byte *table, size_t n) {
+    kernels()->map(dst, src, table, n);
+}
+
+// Byte functions
+
+void bw_or_byte(byte *dst, const byte *src, byte op, size_t n) {
+    kernels()->or_byte(dst, src, op, n);
+}
+
+void bw_and_byte(byte *dst, const byte *src, byte op, size_t n) {
+    kernels()->and_byte(dst, src, op, n);
+}
+
+void bw_xor_byte(byte *dst, const byte *src, byte op, size_t n) {
+    kernels()->xor_byte(dst, src, op, n);
+}
+
+// Pattern functions
+
+/*
+ * Run `kernel` over `n` bytes of `src` with the `size` bytes of `pattern`
+ * repeated from `phase`. Returns the phase to continue from.
+ */
+static size_t pattern_apply(bw_kernel kernel, byte *dst, const byte *src, size_t n, const byte *pattern, size_t size, size_t phase) {
+    // Repeat short patterns so the kernel isn't run a few bytes at a time
+    byte buf[PATTERN_BUF_SIZE];
+    size_t period = size;
+    if (size * 2 <= PATTERN_BUF_SIZE && n > size) {
+        period = PATTERN_BUF_SIZE / size * size;
+        for (size_t i = 0; i < period; i += size) {
+            memcpy(buf + i, pattern, size);
+        }
+        pattern = buf;
+    }
+    
+    phase %= size;
+    for (size_t i = 0, chunk; i < n; i += chunk) {
+        chunk = MIN(period - phase, n - i);
+        kernel(dst + i, src + i, pattern + phase, chunk);
+        phase = (phase + chunk) % size;
+    }
+    
+    return phase;
+}
+
+size_t bw_or_pattern(byte *dst, const byte *src, size_t n, const byte *pattern, size_t size, size_t phase) {
+    return pattern_apply(kernels()->or_mem, dst, src, n, pattern, size, phase);
+}
+
+size_t bw_and_pattern(byte *dst, const byte *src, size_t n, const byte *pattern, size_t size, size_t phase) {
+    return pattern_apply(kernels()->and_mem, dst, src, n, pattern, size, phase);
+}
+
+size_t bw_xor_pattern(byte *dst, const byte *src, size_t n, const byte *pattern, size_t size, size_t phase) {
+    return pattern_apply(kernels()->xor_mem, dst, src, n, pattern, size, phase);
+}
+
+// Shift functions
+
+void bw_lshift_buf(byte *dst, const byte *src, size_t n, shift amount) {
+    size_t byte_offset = MIN(amount / BYTE_BIT, n);
+    shift bit_offset = amount % BYTE_BIT;
+    
+    // Zero bits are shifted in after the last byte
+    if (byte_offset < n) {
+        bitshiftl(dst, src + byte_offset, n - byte_offset - 1, bit_offset);
+        dst[n - byte_offset - 1] = src[n - 1] << bit_offset;
+    }
+    memset(dst + n - byte_offset, 0, byte_offset);
+}
+
+void bw_rshift_buf(byte *dst, const byte *src, size_t n, shift amount) {
+    size_t byte_offset = MIN(amount / BYTE_BIT, n);
+    shift bit_offset = amount % BYTE_BIT;
+    
+    // Zero bits are shifted in before the first byte
+    memset(dst, 0, byte_offset);
+    if (byte_offset < n) {
+        dst[byte_offset] = src[0] >> bit_offset;
+        bitshiftr(dst + byte_offset + 1, src, n - byte_offset - 1, bit_offset);
+    }
+}
+
+bool bw_shift_open(bw_shift_stream *s, bool left, shift amount) {
+    *s = (bw_shift_stream){
+        .left = left,
+        .byte_offset = amount / BYTE_BIT,
+        .bit_offset = amount % BYTE_BIT,
+        .skip = left ? amount / BYTE_BIT : 0,
+    };
+    
+    if (!left) {
+        s->history = calloc(s->byte_offset + 1, 1);
+        return s->history != NULL;
+    }
+    
+    return true;
+}
+
+size_t bw_shift_next(bw_shift_stream *s, byte *dst, const byte *src, size_t n) {
+    shift bits = s->bit_offset;
+    
+    if (s->left) {
+        // Drop the leading bytes, they're replaced by zeros at the end
+        size_t drop = MIN(s->skip, n);
+        s->skip -= drop;
+        src += drop;
+        n -= drop;
+        if (!n) {
+            return 0;
+        }
+        
+        // Each output byte needs the next input byte, so the last one is kept
+        size_t out = 0;
+        if (s->pending) {
+            dst[out++] = (s->last << bits) | (src[0] >> (BYTE_BIT - bits));
+        }
+        bitshiftl(dst + out, src, n - 1, bits);
+        s->last = src[n - 1];
+        s->pending = true;
+        
+        return out + n - 1;
+    }
+    
+    // Output is the history followed by src, delayed by byte_offset bytes
+    size_t offset = s->byte_offset, size = offset + 1;
+    bitshiftr(dst, s->history, MIN(n, offset), bits);
+    if (n > offset) {
+        dst[offset] = (s->history[offset] << (BYTE_BIT - bits)) | (src[0] >> bits);
+        bitshiftr(dst + size, src, n - size, bits);
+    }
+    
+    // Keep the last byte_offset + 1 bytes for the next buffer
+    if (n >= size) {
+        memcpy(s->history, src + n - size, size);
+    } else {
+        memmove(s->history, s->history + n, size - n);
+        memcpy(s->history + size - n, src, n);
+    }
+    
+    return n;
+}
+
+size_t bw_shift_finish(bw_shift_stream *s, byte *dst) {
+    if (!s->left) {
+        return 0;
+    }
+    
+    // Shift in zero bits after the last byte, then zero fill the dropped bytes
+    size_t out = 0;
+    if (s->pending) {
+        dst[out++] = s->last << s->bit_offset;
+        s->pending = false;
+    }
+    size_t zeros = s->byte_offset - s->skip;
+    memset(dst + out, 0, zeros);
+    s->skip = s->byte_offset;
+    
+    return out + zeros;
+}
+
+void bw_shift_close(bw_shift_stream *s) {
+    free(s->history);
+    s->history = NULL;
+}
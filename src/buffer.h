@@ -0,0 +1,120 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "utils.h"
+
+/*
+ * Buffer versions of the bitwise.h functions, for using bw on data already in
+ * memory without going through files. Unless stated otherwise, `dst` may be the
+ * same as `src`, otherwise they must not overlap. Nothing here uses any global
+ * state, so they can be used from any number of threads at once.
+ */
+
+// Buffer functions
+
+/* Bitwise OR each of the `n` bytes of `src` with those of `op` into `dst`. */
+void bw_or_buf(byte *dst, const byte *src, const byte *op, size_t n);
+
+/* Bitwise AND each of the `n` bytes of `src` with those of `op` into `dst`. */
+void bw_and_buf(byte *dst, const byte *src, const byte *op, size_t n);
+
+/* Bitwise XOR each of the `n` bytes of `src` with those of `op` into `dst`. */
+void bw_xor_buf(byte *dst, const byte *src, const byte *op, size_t n);
+
+/* Bitwise NOT each of the `n` bytes of `src` into `dst`. */
+void bw_not_buf(byte *dst, const byte *src, size_t n);
+
+/*
+ * Replace each of the `n` bytes of `src` with its entry in `table`, which must
+ * be BW_MAP_SIZE bytes, into `dst`.
+ */
+void bw_map_buf(byte *dst, const byte *src, const byte *table, size_t n);
+
+// Byte functions
+
+/* Bitwise OR each of the `n` bytes of `src` with `op` into `dst`. */
+void bw_or_byte(byte *dst, const byte *src, byte op, size_t n);
+
+/* Bitwise AND each of the `n` bytes of `src` with `op` into `dst`. */
+void bw_and_byte(byte *dst, const byte *src, byte op, size_t n);
+
+/* Bitwise XOR each of the `n` bytes of `src` with `op` into `dst`. */
+void bw_xor_byte(byte *dst, const byte *src, byte op, size_t n);
+
+// Pattern functions
+
+/*
+ * Bitwise OR each of the `n` bytes of `src` with the `size` bytes of `pattern`,
+ * repeated and starting `phase` bytes into it, into `dst`. Returns the phase
+ * to continue from with the next buffer. `size` must not be 0.
+ */
+size_t bw_or_pattern(byte *dst, const byte *src, size_t n, const byte *pattern, size_t size, size_t phase);
+
+/*
+ * Bitwise AND each of the `n` bytes of `src` with the `size` bytes of
+ * `pattern`, repeated and starting `phase` bytes into it, into `dst`. Returns
+ * the phase to continue from with the next buffer. `size` must not be 0.
+ */
+size_t bw_and_pattern(byte *dst, const byte *src, size_t n, const byte *pattern, size_t size, size_t phase);
+
+/*
+ * Bitwise XOR each of the `n` bytes of `src` with the `size` bytes of
+ * `pattern`, repeated and starting `phase` bytes into it, into `dst`. Returns
+ * the phase to continue from with the next buffer. `size` must not be 0.
+ */
+size_t bw_xor_pattern(byte *dst, const byte *src, size_t n, const byte *pattern, size_t size, size_t phase);
+
+// Shift functions
+
+/*
+ * Shift the bits of the `n` bytes of `src` left by `amount` into `dst`,
+ * shifting in zeros, like lshift(). `dst` and `src` must not overlap.
+ */
+void bw_lshift_buf(byte *dst, const byte *src, size_t n, shift amount);
+
+/*
+ * Shift the bits of the `n` bytes of `src` right by `amount` into `dst`,
+ * shifting in zeros, like rshift(). `dst` and `src` must not overlap.
+ */
+void bw_rshift_buf(byte *dst, const byte *src, size_t n, shift amount);
+
+/* State of a shift over a stream of buffers. */
+typedef struct bw_shift_stream {
+    bool left;
+    size_t byte_offset;
+    shift bit_offset;
+    /* Left: leading bytes still to be dropped, and the last byte read. */
+    size_t skip;
+    bool pending;
+    byte last;
+    /* Right: last byte_offset + 1 bytes read, oldest first, starting as 0. */
+    byte *history;
+} bw_shift_stream;
+
+/*
+ * Start shifting a stream left if `left`, otherwise right, by `amount`.
+ * Returns false if out of memory.
+ */
+bool bw_shift_open(bw_shift_stream *s, bool left, shift amount);
+
+/*
+ * Shift the next `n` bytes of the stream from `src` and put as much of the
+ * output as is known in `dst`, which must have room for `n` bytes. Returns the
+ * number of bytes put in `dst`. Right shifts always output `n` bytes, left
+ * shifts lag behind the input. `dst` and `src` must not overlap.
+ */
+size_t bw_shift_next(bw_shift_stream *s, byte *dst, const byte *src, size_t n);
+
+/*
+ * End the stream, putting the rest of the output in `dst`, which must have room
+ * for `amount / BYTE_BIT + 1` bytes. Returns the number of bytes put in `dst`,
+ * so that the whole output is the same size as the input.
+ */
+size_t bw_shift_finish(bw_shift_stream *s, byte *dst);
+
+/* Free the state of `s`. */
+void bw_shift_close(bw_shift_stream *s);
+
+#endif
@@ -1,10 +1,21 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <search.h>
 #include <argp.h>
 #include <error.h>
 #include "bitwise.h"
+#include "io.h"
+#include "parallel.h"
+#include "stats.h"
 #include "project.h"
 
 /* Exit code when called with incorrent usage. */
@@ -15,16 +26,29 @@
 #define EXIT_CANNOT_OPEN 3
 /* Exit code when a file cannot be closed. */
 #define EXIT_CANNOT_CLOSE 4
+/* Exit code from cmp when the input and operand differ. */
+#define EXIT_DIFFERENT 16
 /* Exit code when an unknown error occurred. */
 #define EXIT_UNKNOWN_ERROR -1
 /* Exit code from bw_error. */
 #define EXIT_BW_ERROR(e) (EXIT_CANNOT_CLOSE + (e).type)
 
-const char args_doc[] = "OPERATOR [OPERAND]";
+const char args_doc[] = "OPERATOR [OPERAND...]\n-x EXPRESSION\n--batch=MANIFEST";
 const char doc[] = "Perform bitwise operations on files and streams.\n"
 "\n"
 "OPERATOR is one of: |, o[r], &, a[nd], ^, x[or], ~, n[ot], <[<], l[shift], "
-">[>], r[shift]. OPERAND is a file or byte value."
+">[>], r[shift], m[ap], po[pcount], pa[rity], h[amming], c[mp]. OPERAND is a file, byte value or multi-byte pattern, "
+"or a file containing a 256 byte table for map. OR, AND and XOR can take "
+"several operands, e.g. 'xor a.bin b.bin c.bin', which are all applied in a "
+"single pass. popcount, parity and hamming print the number of set bits, "
+"whether it's odd, or the number of bits which differ from OPERAND, instead "
+"of any output. cmp prints where the input first differs from OPERAND, "
+"only comparing the bits set in MASK if given as a second operand, and exits "
+"with 16 if it does. "
+"EXPRESSION is a comma separated list of OPERATOR [OPERAND] steps, e.g. "
+"'xor key.bin, and 0x7f, not', which are applied in a single pass. Shifts "
+"can't be used in expressions. MANIFEST lists jobs to run in one process, "
+"each 'OPERATOR [OPERAND] INPUT OUTPUT'."
 "\v"
 "See " PROJECT_URL " for full documentation.";
 
@@ -35,33 +59,101 @@ typedef enum operator {
     OP_NOT,
     OP_LSHIFT,
     OP_RSHIFT,
+    OP_MAP,
+    // Reductions, which output a number
+    OP_POPCOUNT,
+    OP_PARITY,
+    OP_HAMMING,
+    OP_CMP,
+    // Steps given with --expression
+    OP_EXPRESSION,
 } operator;
 
+// Operand argument
+typedef struct operand_arg {
+    // Type
+    enum {
+        OPERAND_BYTE,
+        OPERAND_PATTERN,
+        OPERAND_SHIFT,
+        OPERAND_FILE,
+        OPERAND_TABLE,
+    } type;
+    // Value
+    union {
+        byte byte;
+        struct {
+            byte *bytes;
+            size_t size;
+        } pattern;
+        shift shift;
+        // File for OPERAND_FILE and OPERAND_TABLE
+        char *file;
+    };
+} operand_arg;
+
+// Expression step argument
+typedef struct step_arg {
+    operator operator;
+    operand_arg operand;
+    // Operand file once opened
+    FILE *file;
+    // Table once read
+    byte table[BW_MAP_SIZE];
+} step_arg;
+
 // Arguments struct
 typedef struct arguments {
     // Input/output files
     char *input, *output;
+    // Write output over input
+    bool in_place;
     // Operator
     operator operator;
     // Operand
-    struct {
-        // Type
-        enum {
-            OPERAND_BYTE,
-            OPERAND_SHIFT,
-            OPERAND_FILE,
-        } type;
-        // Value
-        union {
-            byte byte;
-            shift shift;
-            char *file;
-        };
-    } operand;
-    // EOF Mode
-    eof_mode eof;
+    operand_arg operand;
+    // Expression steps, used instead of operator and operand if any
+    step_arg *steps;
+    size_t nsteps;
+    // Ranges of input to apply to, or all of it if none
+    bw_range *ranges;
+    size_t nranges;
+    // Range given by --offset and --length
+    bw_range range;
+    bool has_range;
+    // Operands after the first, for operators which take more than one
+    operand_arg *operands;
+    size_t noperands;
+    // EOF mode of each operand file in order, the last one repeating
+    eof_mode *eofs;
+    size_t neofs;
+    // Only exit with the result of cmp
+    bool quiet;
+    // Manifest of jobs to run instead of an operator, and if it's NUL separated
+    char *batch;
+    bool batch_null;
 } arguments;
 
+// Keys for options without a short option
+enum {
+    OPT_LOOP_CACHE = 256,
+    OPT_NO_MMAP,
+    OPT_NO_ASYNC,
+    OPT_DIRECT,
+    OPT_NOCACHE,
+    OPT_VMSPLICE,
+    OPT_NO_SPARSE,
+    OPT_IN_PLACE,
+    OPT_THREADS,
+    OPT_OFFSET,
+    OPT_LENGTH,
+    OPT_RANGE,
+    OPT_BUFFER_SIZE,
+    OPT_STATS,
+    OPT_STATS_FILE,
+    OPT_BATCH,
+};
+
 // Argp options
 const char *argp_program_version = PROJECT_NAME " " PROJECT_VERSION;
 const char *argp_program_bug_address = PROJECT_BUGREPORT;
@@ -73,9 +165,64 @@ static struct argp_option options[] = {
         "File to read input from, or '-' to use stdin (default)"},
     {"output", 'o', "FILE", 0,
         "File to write output to, or '-' to use stdout (default)"},
+    {"in-place", OPT_IN_PLACE, 0, 0,
+        "Write output over the input file instead of to --output"},
+    {"expression", 'x', "EXPRESSION", 0,
+        "Apply each step of EXPRESSION in order instead of a single OPERATOR"},
     {"eof-mode", 'e', "EOF_MODE", 0,
         "How to handle the operand file being shorter than input. One of: "
-        "e[rror] (default), t[runcate], l[oop], z[ero], o[ne]"},
+        "e[rror] (default), t[runcate], l[oop], z[ero], o[ne]. A comma "
+        "separated list gives each operand file its own, the last repeating"},
+    {"loop-cache", OPT_LOOP_CACHE, "SIZE", 0,
+        "Maximum size of operand file to cache in memory with --eof-mode loop "
+        "(default 64M). Allows non-seekable operand files. 0 to disable"},
+    {"no-mmap", OPT_NO_MMAP, 0, 0,
+        "Don't memory map regular files"},
+    {"no-async", OPT_NO_ASYNC, 0, 0,
+        "Don't read and write regular files which aren't memory mapped "
+        "asynchronously, use stdio"},
+    {"direct", OPT_DIRECT, 0, 0,
+        "Read and write regular files asynchronously with O_DIRECT, bypassing "
+        "the page cache where the file system allows it. Files aren't split "
+        "between --threads"},
+    {"nocache", OPT_NOCACHE, 0, 0,
+        "Read and write regular files asynchronously, dropping them from the "
+        "page cache once done with so large files don't push out everything "
+        "else. Files aren't split between --threads"},
+    {"vmsplice", OPT_VMSPLICE, 0, 0,
+        "Give output to a pipe to the kernel with vmsplice() instead of copying "
+        "it"},
+    {"no-sparse", OPT_NO_SPARSE, 0, 0,
+        "Don't skip holes in regular files or leave holes where the output is "
+        "all zeros, read and write every byte"},
+    {"buffer-size", OPT_BUFFER_SIZE, "SIZE", 0,
+        "Size of the blocks to process data in, up to 16M (default chosen for "
+        "each file from it's preferred I/O size or pipe capacity)"},
+    {"offset", OPT_OFFSET, "OFFSET", 0,
+        "Only apply the operator from OFFSET bytes into the input, passing "
+        "bytes before it through unchanged"},
+    {"length", OPT_LENGTH, "LENGTH", 0,
+        "Only apply the operator to LENGTH bytes from --offset, passing bytes "
+        "after them through unchanged"},
+    {"range", OPT_RANGE, "OFFSET[:LENGTH]", 0,
+        "Only apply the operator to LENGTH bytes from OFFSET, or the rest of "
+        "the input if no LENGTH. Can be given multiple times"},
+    {"stats", OPT_STATS, "FORMAT", OPTION_ARG_OPTIONAL,
+        "Report bytes, calls and time spent reading, computing and writing on "
+        "exit. FORMAT is text (default) or json"},
+    {"stats-file", OPT_STATS_FILE, "FILE", 0,
+        "Write --stats to FILE instead of stderr"},
+    {"quiet", 'q', 0, 0,
+        "Don't print where cmp found a difference, only exit with its status"},
+    {"batch", OPT_BATCH, "MANIFEST", 0,
+        "Run each job in MANIFEST, or stdin if '-', one 'OPERATOR [OPERAND] "
+        "INPUT OUTPUT' per line with whitespace between fields. Up to --threads "
+        "jobs run at once, and output may be the same as input to run in place"},
+    {"null", 'z', 0, 0,
+        "End each field of --batch jobs with a NUL instead, for any file names"},
+    {"threads", OPT_THREADS, "N", 0,
+        "Number of threads to split large regular files between, or 0 for one "
+        "per CPU (default 1). Not used with --direct or --nocache"},
     {0}
 };
 
@@ -113,6 +260,178 @@ static eof_mode parse_eof_mode(char *arg) {
     return -1;
 }
 
+/* Parse a comma separated list of EOF modes, replacing those in `args`. */
+static void parse_eof_modes(char *arg, arguments *args) {
+    args->neofs = 0;
+    char *save;
+    for (char *str = strtok_r(arg, ",", &save); str; str = strtok_r(NULL, ",", &save)) {
+        args->eofs = realloc(args->eofs, (args->neofs + 1) * sizeof(eof_mode));
+        args->eofs[args->neofs++] = parse_eof_mode(str);
+    }
+    
+    if (!args->neofs) {
+        error(EXIT_ILLEGAL_ARGUMENT, 0, "Empty EOF mode");
+    }
+}
+
+/* Get the EOF mode of the `i`th operand file, repeating the last one given. */
+static eof_mode eof_for(const arguments *args, size_t i) {
+    return args->neofs ? args->eofs[MIN(i, args->neofs - 1)] : EOF_ERROR;
+}
+
+/*
+ * Parse a size in bytes with an optional K, M or G (binary) suffix. Exits with
+ * an error if `arg` isn't a valid size.
+ */
+static size_t parse_size(char *arg) {
+    char *end;
+    unsigned long long size = strtoull(arg, &end, 0);
+    
+    // Multiply by suffix
+    int shift = 0;
+    switch (toupper(*end)) {
+        case 'G': shift += 10; // Fall through
+        case 'M': shift += 10; // Fall through
+        case 'K': shift += 10;
+            end++;
+            break;
+    }
+    
+    if (end == arg || *end != '\0' || arg[0] == '-') {
+        error(EXIT_ILLEGAL_ARGUMENT, 0, "Invalid size '%s'", arg);
+    }
+    
+    return size << shift;
+}
+
+/*
+ * Parse a buffer size, which must be between 1 byte and BUF_SIZE_MAX. Exits
+ * with an error if `arg` isn't a valid buffer size.
+ */
+static size_t parse_buffer_size(char *arg) {
+    size_t size = parse_size(arg);
+    
+    if (size == 0 || size > BUF_SIZE_MAX) {
+        error(EXIT_ILLEGAL_ARGUMENT, 0, "Invalid buffer size '%s'", arg);
+    }
+    
+    return size;
+}
+
+// Where and how to report --stats, and when the run started
+static bool stats_json;
+static char *stats_file;
+static double stats_begin;
+
+/* Parse the format for --stats, exiting if it isn't text or json. */
+static bool parse_stats_format(char *arg) {
+    if (!arg || strcmp(arg, "text") == 0) {
+        return false;
+    } else if (strcmp(arg, "json") == 0) {
+        return true;
+    }
+    
+    error(EXIT_ILLEGAL_ARGUMENT, 0, "Unrecognised stats format '%s'", arg);
+    return false;
+}
+
+/* Report --stats, registered with atexit() so it's done on errors as well. */
+static void report_stats() {
+    double elapsed = stats_start() - stats_begin;
+    
+    FILE *f = stats_file ? fopen(stats_file, "w") : stderr;
+    if (!f) {
+        // Don't call error() from an exit handler
+        fprintf(stderr, PROJECT_NAME ": %s: %s\n", stats_file, strerror(errno));
+        return;
+    }
+    
+    stats_print(f, stats_json, elapsed);
+    if (f != stderr) {
+        fclose(f);
+    }
+}
+
+/*
+ * Parse a number of threads, where 0 means one per online CPU. Exits with an
+ * error if `arg` isn't a valid number.
+ */
+static unsigned parse_threads(char *arg) {
+    char *end;
+    unsigned long threads = strtoul(arg, &end, 10);
+    
+    if (end == arg || *end != '\0' || arg[0] == '-' || threads > 1024) {
+        error(EXIT_ILLEGAL_ARGUMENT, 0, "Invalid number of threads '%s'", arg);
+    }
+    
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+    
+    return threads;
+}
+
+/* Append a range to the ranges in `args`. */
+static void add_range(arguments *args, bw_range range) {
+    args->ranges = realloc(args->ranges, (args->nranges + 1) * sizeof(bw_range));
+    args->ranges[args->nranges++] = range;
+}
+
+/*
+ * Parse a range of OFFSET[:LENGTH] sizes, where no LENGTH means the rest of
+ * the input. Exits with an error if `arg` isn't a valid range.
+ */
+static bw_range parse_range(char *arg) {
+    bw_range range = {.length = -1};
+    
+    char *length = strchr(arg, ':');
+    if (length) {
+        *length++ = '\0';
+        range.length = parse_size(length);
+    }
+    range.offset = parse_size(arg);
+    
+    return range;
+}
+
+static int compare_ranges(const void *a, const void *b) {
+    off_t offset_a = ((const bw_range *)a)->offset, offset_b = ((const bw_range *)b)->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+/* Sort the ranges in `args`, merging any which overlap or touch. */
+static void merge_ranges(arguments *args) {
+    qsort(args->ranges, args->nranges, sizeof(bw_range), compare_ranges);
+    
+    size_t merged = 0;
+    for (size_t i = 0; i < args->nranges; i++) {
+        bw_range range = args->ranges[i];
+        bw_range *last = merged ? &args->ranges[merged - 1] : NULL;
+        
+        if (last && (last->length == -1 || last->offset + last->length >= range.offset)) {
+            // Extend the last range to cover this one
+            if (last->length != -1) {
+                last->length = range.length == -1 ? -1 : MAX(last->length, range.offset + range.length - last->offset);
+            }
+        } else {
+            args->ranges[merged++] = range;
+        }
+    }
+    
+    args->nranges = merged;
+}
+
+/* Check if `operator` is a reduction, which outputs a result instead of data. */
+static bool is_reduction(operator operator) {
+    return operator == OP_POPCOUNT || operator == OP_PARITY || operator == OP_HAMMING || operator == OP_CMP;
+}
+
+/* Check if `operator` needs an operand. */
+static bool takes_operand(operator operator) {
+    return operator != OP_NOT && operator != OP_POPCOUNT && operator != OP_PARITY;
+}
+
 static operator parse_operator(char *arg) {
     if (matches_option(arg, "|") || matches_option(arg, "or")) {
         return OP_OR;
@@ -126,6 +445,16 @@ static operator parse_operator(char *arg) {
         return OP_LSHIFT;
     } else if (matches_option(arg, ">>") || matches_option(arg, "rshift")) {
         return OP_RSHIFT;
+    } else if (matches_option(arg, "map")) {
+        return OP_MAP;
+    } else if (matches_option(arg, "popcount")) {
+        return OP_POPCOUNT;
+    } else if (matches_option(arg, "parity")) {
+        return OP_PARITY;
+    } else if (matches_option(arg, "hamming")) {
+        return OP_HAMMING;
+    } else if (matches_option(arg, "cmp")) {
+        return OP_CMP;
     }
     
     error(EXIT_ILLEGAL_ARGUMENT, 0, "Unrecognised operator '%s'", arg);
@@ -154,27 +483,150 @@ static int parse_byte(char *str, byte *b) {
     return sscanf(str, "%hhi", b);
 }
 
-static void parse_operand(operator operator, arguments *args, char *arg) {
+/*
+ * Parse a multi-byte pattern: hex preceded by "0x" with more than 2 digits,
+ * binary preceded by "0b" with more than 8 digits, or a string preceded by
+ * "s:". Hex and binary which aren't a whole number of bytes are numbers, left
+ * to parse_byte() if they fit in a byte and otherwise padded with zeros at the
+ * start. Returns the size of the pattern and puts the allocated bytes in
+ * `pattern`, or returns 0 if `str` isn't a pattern.
+ */
+static size_t parse_pattern(char *str, byte **pattern) {
+    size_t len = strlen(str);
+    
+    // String
+    if (strncmp(str, "s:", 2) == 0) {
+        if (len == 2) {
+            error(EXIT_ILLEGAL_ARGUMENT, 0, "Empty pattern '%s'", str);
+        }
+        
+        *pattern = (byte *) strdup(str + 2);
+        return len - 2;
+    }
+    
+    // Hex or binary
+    int digit_bits;
+    if (strncasecmp(str, "0x", 2) == 0) {
+        digit_bits = 4;
+    } else if (strncasecmp(str, "0b", 2) == 0) {
+        digit_bits = 1;
+    } else {
+        return 0;
+    }
+    
+    // Check all digits are valid
+    char *digits = str + 2;
+    size_t ndigits = len - 2;
+    for (size_t i = 0; i < ndigits; i++) {
+        if (digit_bits == 4 ? !isxdigit(digits[i]) : (digits[i] != '0' && digits[i] != '1')) {
+            return 0;
+        }
+    }
+    
+    // Leave single bytes to parse_byte, including numbers like 0x0ff which
+    // only have leading zeros past the first byte
+    size_t bits = ndigits * digit_bits;
+    if (bits % BYTE_BIT != 0) {
+        for (; ndigits > 0 && digits[0] == '0'; digits++, ndigits--);
+        int leading = ndigits ? strtol((char[]){digits[0], '\0'}, NULL, 16) : 0;
+        size_t value_bits = ndigits ? (ndigits - 1) * digit_bits : 0;
+        for (; leading; leading >>= 1, value_bits++);
+        if (value_bits <= BYTE_BIT) {
+            return 0;
+        }
+        bits = ndigits * digit_bits;
+    } else if (bits <= BYTE_BIT) {
+        return 0;
+    }
+    
+    // Convert digits, most significant first, padding numbers to whole bytes
+    size_t size = (bits + BYTE_BIT - 1) / BYTE_BIT;
+    size_t padding = size * BYTE_BIT - bits;
+    *pattern = calloc(size, 1);
+    for (size_t i = 0; i < ndigits; i++) {
+        char digit[] = {digits[i], '\0'};
+        size_t bit = padding + i * digit_bits;
+        (*pattern)[bit / BYTE_BIT] |= strtol(digit, NULL, 16) << (BYTE_BIT - digit_bits - bit % BYTE_BIT);
+    }
+    
+    return size;
+}
+
+static void parse_operand(operator operator, operand_arg *operand, char *arg) {
     switch (operator) {
-        case OP_OR: case OP_AND: case OP_XOR:
-            // Parse as byte if possible, otherwise assume file
-            args->operand.type = OPERAND_BYTE;
-            if (!parse_byte(arg, &args->operand.byte)) {
-                args->operand.type = OPERAND_FILE;
-                args->operand.file = arg;
+        case OP_OR: case OP_AND: case OP_XOR: case OP_HAMMING: case OP_CMP:
+            // Parse as pattern or byte if possible, otherwise assume file
+            operand->type = OPERAND_PATTERN;
+            operand->pattern.size = parse_pattern(arg, &operand->pattern.bytes);
+            if (operand->pattern.size) {
+                break;
+            }
+            
+            operand->type = OPERAND_BYTE;
+            if (!parse_byte(arg, &operand->byte)) {
+                operand->type = OPERAND_FILE;
+                operand->file = arg;
             }
             break;
         case OP_LSHIFT: case OP_RSHIFT:
-            args->operand.type = OPERAND_SHIFT;
-            if (sscanf(arg, "%zu", &args->operand.shift) != 1) {
+            operand->type = OPERAND_SHIFT;
+            if (sscanf(arg, "%zu", &operand->shift) != 1) {
                 error(EXIT_ILLEGAL_ARGUMENT, 0, "Invalid shift amount '%s'", arg);
             }
             break;
+        case OP_MAP:
+            operand->type = OPERAND_TABLE;
+            operand->file = arg;
+            break;
         default:
             error(EXIT_INCORRECT_USAGE, 0, "Operator does not take an operand");
     }
 }
 
+/*
+ * Parse a comma separated list of steps, each an operator and an optional
+ * operand separated by whitespace, and append them to the steps in `args`.
+ */
+static void parse_expression(char *arg, arguments *args) {
+    const char *space = " \t\n";
+    char *step_save;
+    for (char *str = strtok_r(arg, ",", &step_save); str; str = strtok_r(NULL, ",", &step_save)) {
+        step_arg step = {0};
+        
+        char *save;
+        char *op_str = strtok_r(str, space, &save);
+        if (!op_str) {
+            error(EXIT_ILLEGAL_ARGUMENT, 0, "Empty step in expression");
+        }
+        
+        step.operator = parse_operator(op_str);
+        if (step.operator == OP_LSHIFT || step.operator == OP_RSHIFT) {
+            error(EXIT_ILLEGAL_ARGUMENT, 0, "Shifts can't be used in expressions");
+        } else if (is_reduction(step.operator)) {
+            error(EXIT_ILLEGAL_ARGUMENT, 0, "Reductions can't be used in expressions");
+        }
+        
+        char *operand_str = strtok_r(NULL, space, &save);
+        if (operand_str) {
+            parse_operand(step.operator, &step.operand, operand_str);
+        } else if (takes_operand(step.operator)) {
+            error(EXIT_INCORRECT_USAGE, 0, "Operator '%s' requires an operand", op_str);
+        }
+        
+        char *extra = strtok_r(NULL, space, &save);
+        if (extra) {
+            error(EXIT_ILLEGAL_ARGUMENT, 0, "Unexpected '%s' in expression", extra);
+        }
+        
+        args->steps = realloc(args->steps, (args->nsteps + 1) * sizeof(step_arg));
+        args->steps[args->nsteps++] = step;
+    }
+    
+    if (!args->nsteps) {
+        error(EXIT_ILLEGAL_ARGUMENT, 0, "Empty expression");
+    }
+}
+
 // Argp parser
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     arguments *args = state->input;
@@ -186,8 +638,70 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 'o':
             args->output = arg;
             break;
+        case 'x':
+            args->operator = OP_EXPRESSION;
+            parse_expression(arg, args);
+            break;
         case 'e':
-            args->eof = parse_eof_mode(arg);
+            parse_eof_modes(arg, args);
+            break;
+        case 'q':
+            args->quiet = true;
+            break;
+        case 'z':
+            args->batch_null = true;
+            break;
+        case OPT_BATCH:
+            args->batch = arg;
+            break;
+        case OPT_LOOP_CACHE:
+            bw_loop_cache_limit = parse_size(arg);
+            break;
+        case OPT_NO_MMAP:
+            io_use_mmap = false;
+            break;
+        case OPT_NO_ASYNC:
+            io_use_async = false;
+            break;
+        case OPT_DIRECT:
+            io_direct = true;
+            break;
+        case OPT_NOCACHE:
+            io_nocache = true;
+            break;
+        case OPT_VMSPLICE:
+            io_vmsplice = true;
+            break;
+        case OPT_NO_SPARSE:
+            use_sparse = false;
+            break;
+        case OPT_BUFFER_SIZE:
+            buf_size = parse_buffer_size(arg);
+            break;
+        case OPT_STATS:
+            stats_json = parse_stats_format(arg);
+            stats_enabled = true;
+            break;
+        case OPT_STATS_FILE:
+            stats_file = arg;
+            stats_enabled = true;
+            break;
+        case OPT_IN_PLACE:
+            args->in_place = true;
+            break;
+        case OPT_THREADS:
+            parallel_threads = parse_threads(arg);
+            break;
+        case OPT_OFFSET:
+            args->range.offset = parse_size(arg);
+            args->has_range = true;
+            break;
+        case OPT_LENGTH:
+            args->range.length = parse_size(arg);
+            args->has_range = true;
+            break;
+        case OPT_RANGE:
+            add_range(args, parse_range(arg));
             break;
         case ARGP_KEY_ARG:
             if (state->arg_num == 0) {
@@ -195,17 +709,76 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
                 args->operator = parse_operator(arg);
             } else if (state->arg_num == 1) {
                 // Operand
-                parse_operand(args->operator, args, arg);
+                parse_operand(args->operator, &args->operand, arg);
+            } else if (args->operator == OP_OR || args->operator == OP_AND || args->operator == OP_XOR) {
+                // More operands, combined in the same pass
+                args->operands = realloc(args->operands, (args->noperands + 1) * sizeof(operand_arg));
+                parse_operand(args->operator, &args->operands[args->noperands++], arg);
+            } else if (args->operator == OP_CMP && !args->noperands) {
+                // Mask
+                args->operands = malloc(sizeof(operand_arg));
+                parse_operand(args->operator, &args->operands[args->noperands++], arg);
+            } else {
+                error(EXIT_INCORRECT_USAGE, 0, "Operator only takes one operand");
             }
             
             break;
         case ARGP_KEY_END:
-            if (state->arg_num == 0) {
+            if (args->batch) {
+                if (state->arg_num > 0 || args->nsteps) {
+                    error(EXIT_INCORRECT_USAGE, 0, "--batch can't be used with an operator");
+                } else if (args->input || args->output || args->in_place) {
+                    error(EXIT_INCORRECT_USAGE, 0, "--batch can't be used with --input, --output or --in-place");
+                } else if (args->nranges || args->has_range) {
+                    error(EXIT_INCORRECT_USAGE, 0, "--batch can't be used with ranges");
+                }
+                break;
+            } else if (args->nsteps) {
+                if (state->arg_num > 0) {
+                    error(EXIT_INCORRECT_USAGE, 0, "--expression can't be used with an operator");
+                }
+            } else if (state->arg_num == 0) {
                 argp_usage(state);
-            } else if (state->arg_num == 1 && args->operator != OP_NOT) {
+            } else if (state->arg_num == 1 && takes_operand(args->operator)) {
                 error(EXIT_INCORRECT_USAGE, 0, "Operator requires an operand");
             }
             
+            if (args->in_place && is_reduction(args->operator)) {
+                error(EXIT_INCORRECT_USAGE, 0, "--in-place can't be used with reductions");
+            } else if (args->in_place && (!args->input || strcmp(args->input, "-") == 0)) {
+                error(EXIT_INCORRECT_USAGE, 0, "--in-place requires an input file");
+            } else if (args->in_place && args->output) {
+                error(EXIT_INCORRECT_USAGE, 0, "--in-place can't be used with --output");
+            }
+            
+            if (args->has_range) {
+                add_range(args, args->range);
+            }
+            if (args->nranges) {
+                merge_ranges(args);
+                
+                if (args->operator == OP_LSHIFT || args->operator == OP_RSHIFT) {
+                    error(EXIT_INCORRECT_USAGE, 0, "Shifts can't be used with ranges");
+                } else if (is_reduction(args->operator)) {
+                    error(EXIT_INCORRECT_USAGE, 0, "Reductions can't be used with ranges");
+                }
+            }
+            
+            // Run a lone operator as an expression, with a step for each operand
+            if ((args->nranges || args->noperands) && !args->nsteps && args->operator != OP_CMP) {
+                args->steps = malloc((args->noperands + 1) * sizeof(step_arg));
+                args->steps[args->nsteps++] = (step_arg){ .operator = args->operator, .operand = args->operand };
+                for (size_t i = 0; i < args->noperands; i++) {
+                    args->steps[args->nsteps++] = (step_arg){ .operator = args->operator, .operand = args->operands[i] };
+                }
+                
+                free(args->operands);
+                args->operands = NULL;
+                args->noperands = 0;
+                args->operator = OP_EXPRESSION;
+                args->operand = (operand_arg){0};
+            }
+            
             break;
         default:
             return ARGP_ERR_UNKNOWN;
@@ -217,109 +790,801 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 // Argp struct
 static const struct argp argp = { options, parse_opt, args_doc, doc };
 
-int main(int argc, char *argv[]) {
-    // Default options
-    arguments args = {
-        .eof = EOF_ERROR,
-    };
+// Expression operators for each operator that can be used in an expression
+static const bw_operator expr_operators[] = {
+    [OP_OR] = BW_OR,
+    [OP_AND] = BW_AND,
+    [OP_XOR] = BW_XOR,
+    [OP_NOT] = BW_NOT,
+    [OP_MAP] = BW_MAP,
+};
+
+/*
+ * Read the table for map from `file`. Returns EXIT_SUCCESS, or the status to
+ * exit with if it can't be read or isn't BW_MAP_SIZE bytes, with the error
+ * number in `error_number` and a message to follow the file name, or NULL.
+ */
+static int read_table(const char *file, byte *table, int *error_number, const char **message) {
+    *error_number = 0;
+    *message = NULL;
+    FILE *f = fopen(file, "rb");
+    if (!f) {
+        *error_number = errno;
+        return EXIT_CANNOT_OPEN;
+    }
     
-    argp_parse(&argp, argc, argv, 0, NULL, &args);
+    // Read an extra byte to check it's not too long
+    byte buf[BW_MAP_SIZE + 1];
+    size_t read = fread(buf, 1, sizeof(buf), f);
+    int status = EXIT_SUCCESS;
+    if (ferror(f)) {
+        *error_number = errno;
+        status = EXIT_BW_ERROR((bw_error){ .type = BW_ERR_OPERAND_READ });
+    } else if (read != BW_MAP_SIZE) {
+        *message = "Map table must be " STRINGIFY(BW_MAP_SIZE) " bytes";
+        status = EXIT_ILLEGAL_ARGUMENT;
+    } else {
+        memcpy(table, buf, BW_MAP_SIZE);
+    }
     
-    FILE *input = stdin;
-    if (args.input && strcmp(args.input, "-") != 0) {
-        input = fopen(args.input, "rb");
-        
-        if (!input) {
-            error(EXIT_CANNOT_OPEN, errno, "%s", args.input);
-        }
+    fclose(f);
+    return status;
+}
+
+/* Read the table for map from `file` with read_table(), exiting if it can't. */
+static void load_table(const char *file, byte *table) {
+    int error_number;
+    const char *message;
+    int status = read_table(file, table, &error_number, &message);
+    if (status) {
+        error(status, error_number, "%s%s%s", file, message ? ": " : "", message ? message : "");
+    }
+}
+
+/*
+ * Stop stdio reading ahead of `input` if it's a pipe or otherwise unseekable,
+ * so fcopy() can splice what's passed through from it. It's read in blocks as
+ * big as the pipe anyway.
+ */
+static void unbuffer_input(FILE *input) {
+    int e = errno;
+    if (ftello(input) == -1) {
+        setvbuf(input, NULL, _IONBF, 0);
+    }
+    errno = e;
+}
+
+/* Create a step applying `op` with `operand`, or `file` if it's an operand file. */
+static bw_step create_step(bw_operator op, operand_arg *operand, FILE *file, eof_mode eof) {
+    bw_step step = { .op = op };
+    if (file) {
+        step.operand = file;
+        step.eof = eof;
+    } else if (operand->type == OPERAND_PATTERN) {
+        step.pattern = operand->pattern.bytes;
+        step.size = operand->pattern.size;
+    } else {
+        // Bytes are single byte patterns
+        step.pattern = &operand->byte;
+        step.size = 1;
     }
     
-    FILE *output = stdout;
-    if (args.output && strcmp(args.output, "-") != 0) {
-        output = fopen(args.output, "wb");
+    return step;
+}
+
+/*
+ * Compare `input` with `operand` only where bits are set in the mask operand
+ * of `args`, or with a byte or pattern operand, putting the first difference
+ * in `offset` and `bit` like cmp_expr(). If an error is caused by the mask
+ * file, its name is put in `operand_file`.
+ */
+static bw_error cmp_masked(arguments *args, FILE *input, FILE *operand, off_t *offset, int *bit, char **operand_file) {
+    operand_arg *mask_arg = args->noperands ? &args->operands[0] : NULL;
+    FILE *mask = NULL;
+    if (mask_arg && mask_arg->type == OPERAND_FILE && !(mask = fopen(mask_arg->file, "rb"))) {
+        error(EXIT_CANNOT_OPEN, errno, "%s", mask_arg->file);
+    }
+    
+    // Differences are the bits set in (input ^ operand) & mask
+    bw_step steps[2] = { create_step(BW_XOR, &args->operand, operand, eof_for(args, 0)) };
+    if (mask_arg) {
+        steps[1] = create_step(BW_AND, mask_arg, mask, eof_for(args, operand ? 1 : 0));
+    }
+    
+    size_t failed = 0;
+    bw_error e = cmp_expr(input, steps, args->noperands + 1, offset, bit, &failed);
+    if (failed) {
+        *operand_file = mask_arg->file;
+    }
+    
+    if (mask && fclose(mask)) {
+        error(EXIT_CANNOT_CLOSE, errno, "%s", mask_arg->file);
+    } else if (mask_arg && mask_arg->type == OPERAND_PATTERN) {
+        free(mask_arg->pattern.bytes);
+    }
+    
+    free(args->operands);
+    return e;
+}
+
+/*
+ * Open the operand files of the expression in `args` and run it. If an error
+ * is caused by a step with an operand file, its name is put in `operand_file`.
+ */
+static bw_error run_expression(arguments *args, FILE *input, FILE *output, char **operand_file) {
+    bw_step steps[args->nsteps];
+    size_t nfiles = 0;
+    for (size_t i = 0; i < args->nsteps; i++) {
+        step_arg *step = &args->steps[i];
+        steps[i] = (bw_step){
+            .op = expr_operators[step->operator],
+        };
         
-        if (!output) {
-            error(EXIT_CANNOT_OPEN, errno, "%s", args.output);
+        switch (step->operand.type) {
+            case OPERAND_FILE:
+                steps[i].eof = eof_for(args, nfiles++);
+                steps[i].operand = step->file = fopen(step->operand.file, "rb");
+                if (!step->file) {
+                    error(EXIT_CANNOT_OPEN, errno, "%s", step->operand.file);
+                }
+                break;
+            case OPERAND_PATTERN:
+                steps[i].pattern = step->operand.pattern.bytes;
+                steps[i].size = step->operand.pattern.size;
+                break;
+            case OPERAND_TABLE:
+                load_table(step->operand.file, step->table);
+                steps[i].pattern = step->table;
+                steps[i].size = BW_MAP_SIZE;
+                break;
+            default:
+                // Bytes are single byte patterns
+                steps[i].pattern = &step->operand.byte;
+                steps[i].size = 1;
         }
     }
     
-    FILE *operand = NULL;
-    if (args.operand.type == OPERAND_FILE) {
-        operand = fopen(args.operand.file, "rb");
-        
-        if (!operand) {
-            error(EXIT_CANNOT_OPEN, errno, "%s", args.operand.file);
+    size_t failed = 0;
+    bw_error e;
+    if (args->nranges) {
+        e = expr_ranges(input, output, steps, args->nsteps, args->ranges, args->nranges, &failed);
+    } else {
+        e = expr(input, output, steps, args->nsteps, &failed);
+    }
+    if (args->steps[failed].file) {
+        *operand_file = args->steps[failed].operand.file;
+    }
+    
+    // Close operand files
+    for (size_t i = 0; i < args->nsteps; i++) {
+        step_arg *step = &args->steps[i];
+        if (step->file && fclose(step->file)) {
+            error(EXIT_CANNOT_CLOSE, errno, "%s", step->operand.file);
+        } else if (step->operand.type == OPERAND_PATTERN) {
+            free(step->operand.pattern.bytes);
         }
     }
     
+    free(args->steps);
+    free(args->ranges);
+    return e;
+}
+
+/*
+ * Run the operator in `args` from `input` to `output`, with `operand` opened
+ * if it's a file and the `table` for map. Reductions print their result to
+ * `output`, and cmp puts the offset where the input differs in `diff`. If an
+ * error is caused by an operand file, its name is put in `operand_file`.
+ */
+static bw_error run_operator(arguments *args, FILE *input, FILE *output, FILE *operand, const byte *table, off_t *diff, char **operand_file) {
     bw_error e = no_error;
-    switch (args.operator) {
+    uint64_t bits = 0;
+    int bit;
+    
+    switch (args->operator) {
         case OP_OR:
             if (operand) {
-                e = or_file(input, output, operand, args.eof);
+                e = or_file(input, output, operand, eof_for(args, 0));
+            } else if (args->operand.type == OPERAND_PATTERN) {
+                e = or_pattern(input, output, args->operand.pattern.bytes, args->operand.pattern.size);
             } else {
-                e = or_byte(input, output, args.operand.byte);
+                e = or_byte(input, output, args->operand.byte);
             }
             break;
         case OP_AND:
             if (operand) {
-                e = and_file(input, output, operand, args.eof);
+                e = and_file(input, output, operand, eof_for(args, 0));
+            } else if (args->operand.type == OPERAND_PATTERN) {
+                e = and_pattern(input, output, args->operand.pattern.bytes, args->operand.pattern.size);
             } else {
-                e = and_byte(input, output, args.operand.byte);
+                e = and_byte(input, output, args->operand.byte);
             }
             break;
         case OP_XOR:
             if (operand) {
-                e = xor_file(input, output, operand, args.eof);
+                e = xor_file(input, output, operand, eof_for(args, 0));
+            } else if (args->operand.type == OPERAND_PATTERN) {
+                e = xor_pattern(input, output, args->operand.pattern.bytes, args->operand.pattern.size);
             } else {
-                e = xor_byte(input, output, args.operand.byte);
+                e = xor_byte(input, output, args->operand.byte);
             }
             break;
         case OP_NOT:
             e = not(input, output);
             break;
         case OP_LSHIFT:
-            e = lshift(input, output, args.operand.shift);
+            e = lshift(input, output, args->operand.shift);
             break;
         case OP_RSHIFT:
-            e = rshift(input, output, args.operand.shift);
+            e = rshift(input, output, args->operand.shift);
+            break;
+        case OP_MAP:
+            e = map(input, output, table);
+            break;
+        case OP_POPCOUNT:
+        case OP_PARITY:
+            e = popcount(input, &bits);
+            break;
+        case OP_HAMMING:
+            if (operand) {
+                e = hamming(input, operand, eof_for(args, 0), &bits);
+            } else {
+                bw_step step = create_step(BW_XOR, &args->operand, NULL, EOF_ERROR);
+                size_t failed;
+                e = popcount_expr(input, &step, 1, &bits, &failed);
+            }
+            break;
+        case OP_CMP:
+            if (operand && !args->noperands) {
+                e = cmp_file(input, operand, eof_for(args, 0), diff, &bit);
+            } else {
+                e = cmp_masked(args, input, operand, diff, &bit, operand_file);
+            }
+            break;
+        case OP_EXPRESSION:
+            e = run_expression(args, input, output, operand_file);
+            break;
+    }
+    
+    // Reductions print their result instead of any output, cmp only if the
+    // input differs
+    if (!e.type && args->operator == OP_CMP) {
+        int printed = 0;
+        if (*diff != -1 && !args->quiet && bit != -1) {
+            printed = fprintf(output, "differ: byte %jd, bit %d\n", (intmax_t)*diff, bit);
+        } else if (*diff != -1 && !args->quiet) {
+            printed = fprintf(output, "differ: EOF at byte %jd\n", (intmax_t)*diff);
+        }
+        
+        if (printed < 0) {
+            e = (bw_error){ .type = BW_ERR_OUTPUT_WRITE, .error_number = errno };
+        }
+    } else if (!e.type && is_reduction(args->operator)) {
+        uint64_t result = args->operator == OP_PARITY ? bits & 1 : bits;
+        if (fprintf(output, "%" PRIu64 "\n", result) < 0) {
+            e = (bw_error){ .type = BW_ERR_OUTPUT_WRITE, .error_number = errno };
+        }
+    }
+    
+    
+    return e;
+}
+
+/*
+ * Print the message for `e` from running an operator, like error() but prefixed
+ * with `manifest` and `line` if `manifest` isn't NULL, and return the status
+ * to exit with.
+ */
+static int report_error(bw_error e, const char *input, const char *output, const char *operand_file, const char *manifest, unsigned line) {
+    const char *file = NULL, *message = NULL;
+    int status = EXIT_BW_ERROR(e), error_number = e.error_number;
+    switch (e.type) {
+        case BW_ERR_INPUT_READ:
+            file = input;
+            break;
+        case BW_ERR_OUTPUT_WRITE:
+            file = output;
+            break;
+        case BW_ERR_OPERAND_READ:
+        case BW_ERR_OPERAND_SEEK:
+            file = operand_file;
+            break;
+        // Special cases
+        case BW_ERR_OPERAND_EOF:
+            file = operand_file;
+            message = "Operand file too short";
+            error_number = 0;
+            break;
+        case BW_ERR_MEMORY:
+            message = "Cannot allocate buffer";
+            break;
+        default:
+            message = "Unknown error";
+            status = EXIT_UNKNOWN_ERROR;
+            error_number = 0;
+    }
+    
+    const char *separator = file && message ? ": " : "";
+    file = file ? file : "";
+    message = message ? message : "";
+    if (manifest) {
+        error_at_line(0, error_number, manifest, line, "%s%s%s", file, separator, message);
+    } else {
+        error(0, error_number, "%s%s%s", file, separator, message);
+    }
+    
+    return status;
+}
+
+// Batch
+
+/* Largest operand file read once and shared by the --batch jobs using it. */
+#define BATCH_OPERAND_MAX (1024 * 1024)
+
+/* Operand file or map table of --batch jobs, read once if it's worth it. */
+typedef struct batch_operand {
+    const char *file;
+    /* Number of jobs using it. */
+    size_t jobs;
+    /* Contents once read, or NULL. */
+    byte *data;
+    size_t size;
+    /* Status, error number and message for the jobs using it if it's a map table which can't be read. */
+    int status, error_number;
+    const char *message;
+} batch_operand;
+
+/* Job from a --batch manifest. */
+typedef struct batch_job {
+    operator operator;
+    operand_arg operand;
+    char *input, *output;
+    /* Operand file or map table, or NULL. */
+    batch_operand *shared;
+    /* Line of the manifest, or number of the job if NUL separated. */
+    unsigned line;
+    /* Status the job would have exited with on it's own. */
+    int status;
+} batch_job;
+
+/* Jobs of a --batch run, shared between worker threads. */
+typedef struct batch {
+    const arguments *args;
+    const char *manifest;
+    batch_job *jobs;
+    size_t njobs;
+    /* Tree of operands by file name, for tsearch(). */
+    void *operands;
+    /* Index of the next job to be claimed. */
+    atomic_size_t next;
+    /* Thread which started the run, and the counters of the rest. */
+    pthread_t caller;
+    bw_stats counts;
+    pthread_mutex_t lock;
+} batch;
+
+// Manifest and line being parsed, for error messages
+static const char *batch_manifest;
+static unsigned batch_line;
+
+/* Print the manifest and line being parsed for error(), like error_at_line(). */
+static void print_batch_line() {
+    fprintf(stderr, "%s:%s:%u: ", program_invocation_name, batch_manifest, batch_line);
+}
+
+/* Compare batch operands by file name, for tsearch(). */
+static int compare_operands(const void *a, const void *b) {
+    return strcmp(((const batch_operand *)a)->file, ((const batch_operand *)b)->file);
+}
+
+/* Free a batch operand, for tdestroy(). */
+static void free_operand(void *node) {
+    batch_operand *operand = node;
+    free(operand->data);
+    free(operand);
+}
+
+/* Get the operand of `b` for `file`, adding it if it's the first job to use it. */
+static batch_operand *share_operand(batch *b, const char *file) {
+    batch_operand key = { .file = file }, *operand = malloc(sizeof(batch_operand));
+    if (!operand) {
+        error(EXIT_BW_ERROR((bw_error){ .type = BW_ERR_MEMORY }), errno, "Cannot allocate job");
+    }
+    *operand = key;
+    
+    batch_operand **found = tsearch(operand, &b->operands, compare_operands);
+    if (!found) {
+        error(EXIT_BW_ERROR((bw_error){ .type = BW_ERR_MEMORY }), errno, "Cannot allocate job");
+    } else if (*found != operand) {
+        free(operand);
+    }
+    
+    (*found)->jobs++;
+    return *found;
+}
+
+/* Add a job to `b` from the `nfields` fields of it's line in the manifest. */
+static void add_job(batch *b, char **fields, size_t nfields) {
+    batch_job job = { .operator = parse_operator(fields[0]), .line = batch_line };
+    size_t expected = takes_operand(job.operator) ? 4 : 3;
+    if (nfields != expected) {
+        error(EXIT_INCORRECT_USAGE, 0, "Expected OPERATOR %sINPUT OUTPUT", expected == 4 ? "OPERAND " : "");
+    }
+    
+    if (expected == 4) {
+        parse_operand(job.operator, &job.operand, fields[1]);
+        if (job.operand.type == OPERAND_FILE || job.operand.type == OPERAND_TABLE) {
+            job.shared = share_operand(b, job.operand.file);
+        }
+    }
+    job.input = fields[nfields - 2];
+    job.output = fields[nfields - 1];
+    
+    if (!(b->jobs = realloc(b->jobs, (b->njobs + 1) * sizeof(batch_job)))) {
+        error(EXIT_BW_ERROR((bw_error){ .type = BW_ERR_MEMORY }), errno, "Cannot allocate job");
+    }
+    b->jobs[b->njobs++] = job;
+}
+
+/*
+ * Parse the jobs in the `size` bytes of `text`, which must be followed by a
+ * NUL, and add them to `b`. Lines are split into fields by whitespace, or if
+ * `null` every field ends with a NUL and the operator of each job decides how
+ * many fields follow it. Blank lines and lines starting with '#' are skipped.
+ */
+static void parse_manifest(batch *b, char *text, size_t size, bool null) {
+    const char *space = " \t\r";
+    char *fields[5];
+    char *end = text + size;
+    
+    for (char *line = text, *next; line && line < end; line = next) {
+        batch_line++;
+        size_t nfields = 0;
+        if (null) {
+            fields[nfields++] = line;
+            next = line + strlen(line) + 1;
+            
+            size_t expected = takes_operand(parse_operator(line)) ? 4 : 3;
+            for (; nfields < expected && next < end; next += strlen(next) + 1) {
+                fields[nfields++] = next;
+            }
+        } else {
+            if ((next = strchr(line, '\n'))) {
+                *next++ = '\0';
+            }
+            
+            char *save;
+            for (char *field = strtok_r(line, space, &save); field && nfields < 5; field = strtok_r(NULL, space, &save)) {
+                fields[nfields++] = field;
+            }
+            
+            if (!nfields || fields[0][0] == '#') {
+                continue;
+            }
+        }
+        
+        add_job(b, fields, nfields);
+    }
+}
+
+/*
+ * Read the operand of `job` for every job using it, if it's a map table or
+ * a small file used by more than one job. Files which can't be read are left
+ * for each job to open and report, and map tables which can't be read fail
+ * every job using them.
+ */
+static void read_shared(batch_job *job) {
+    batch_operand *operand = job->shared;
+    if (job->operator == OP_MAP) {
+        if (operand->data || operand->status) {
+            return;
+        } else if (!(operand->data = malloc(BW_MAP_SIZE))) {
+            operand->status = EXIT_BW_ERROR((bw_error){ .type = BW_ERR_MEMORY });
+            operand->error_number = errno;
+            operand->message = "Cannot allocate buffer";
+            return;
+        }
+        
+        operand->size = BW_MAP_SIZE;
+        operand->status = read_table(operand->file, operand->data, &operand->error_number, &operand->message);
+        if (operand->status) {
+            free(operand->data);
+            operand->data = NULL;
+        }
+        return;
+    } else if (operand->data || operand->jobs < 2 || operand->size == (size_t)-1) {
+        return;
+    }
+    
+    // Don't try again if it can't be read
+    operand->size = -1;
+    FILE *f = fopen(operand->file, "rb");
+    if (!f) {
+        return;
+    }
+    
+    off_t size = fsize(f);
+    if (size > 0 && size <= BATCH_OPERAND_MAX) {
+        size_t read;
+        operand->data = freadall(1, &read, f);
+        if (operand->data && read == size) {
+            operand->size = read;
+        } else {
+            free(operand->data);
+            operand->data = NULL;
+        }
+    }
+    fclose(f);
+}
+
+/*
+ * Check if `job` can use the contents of it's shared operand as a pattern
+ * instead of reading the file, with the same result for `input` and `eof`.
+ */
+static bool use_shared(const batch_job *job, FILE *input, eof_mode eof) {
+    const batch_operand *operand = job->shared;
+    if (!operand || !operand->data) {
+        return false;
+    } else if (job->operator == OP_MAP || eof == EOF_LOOP) {
+        return true;
+    }
+    
+    // The EOF mode only matters if the input reaches the end of the operand,
+    // or for cmp if the input ends first
+    off_t size = fsize(input);
+    return size == operand->size
+        || (size != -1 && size < operand->size && (job->operator != OP_CMP || eof != EOF_ERROR));
+}
+
+/*
+ * Run `job` with the options in `args`, reporting any errors against it's line
+ * of `manifest`. Returns the status it would have exited with on it's own.
+ */
+static int run_job(const arguments *args, batch_job *job, const char *manifest) {
+    // Output over the input if they're the same file
+    bool in_place = strcmp(job->input, job->output) == 0;
+    FILE *input = fopen(job->input, in_place ? "rb+" : "rb");
+    if (!input) {
+        error_at_line(0, errno, manifest, job->line, "%s", job->input);
+        return EXIT_CANNOT_OPEN;
+    }
+    unbuffer_input(input);
+    
+    FILE *output = in_place ? input : fopen(job->output, "wb+");
+    if (!output) {
+        error_at_line(0, errno, manifest, job->line, "%s", job->output);
+        fclose(input);
+        return EXIT_CANNOT_OPEN;
+    }
+    
+    arguments job_args = *args;
+    job_args.operator = job->operator;
+    job_args.operand = job->operand;
+    
+    int status = EXIT_SUCCESS;
+    FILE *operand = NULL;
+    const byte *table = NULL;
+    if (job->shared && job->shared->status) {
+        const batch_operand *shared = job->shared;
+        error_at_line(0, shared->error_number, manifest, job->line, "%s%s%s", shared->file, shared->message ? ": " : "", shared->message ? shared->message : "");
+        status = shared->status;
+    } else if (use_shared(job, input, eof_for(args, 0))) {
+        table = job->shared->data;
+        if (job->operator != OP_MAP) {
+            job_args.operand = (operand_arg){
+                .type = OPERAND_PATTERN,
+                .pattern = { .bytes = job->shared->data, .size = job->shared->size },
+            };
+        }
+    } else if (job->operand.type == OPERAND_FILE && !(operand = fopen(job->operand.file, "rb"))) {
+        error_at_line(0, errno, manifest, job->line, "%s", job->operand.file);
+        status = EXIT_CANNOT_OPEN;
+    }
+    
+    off_t diff = -1;
+    char *operand_file = job->operand.file;
+    bw_error e = no_error;
+    if (status == EXIT_SUCCESS) {
+        e = run_operator(&job_args, input, output, operand, table, &diff, &operand_file);
+    }
+    
+    // Close files
+    if (fclose(input) && !status) {
+        error_at_line(0, errno, manifest, job->line, "%s", job->input);
+        status = EXIT_CANNOT_CLOSE;
+    }
+    if (output != input && fclose(output) && !status) {
+        error_at_line(0, errno, manifest, job->line, "%s", job->output);
+        status = EXIT_CANNOT_CLOSE;
+    }
+    if (operand && fclose(operand) && !status) {
+        error_at_line(0, errno, manifest, job->line, "%s", job->operand.file);
+        status = EXIT_CANNOT_CLOSE;
+    }
+    
+    if (e.type) {
+        status = report_error(e, job->input, job->output, operand_file, manifest, job->line);
+    } else if (!status && diff != -1) {
+        status = EXIT_DIFFERENT;
+    }
+    
+    return status;
+}
+
+/* Run jobs from `b` until there are none left. */
+static void *batch_worker(void *arg) {
+    batch *b = arg;
+    double began = stats_start(), waited = stats_waiting(&stats);
+    for (size_t i; (i = atomic_fetch_add(&b->next, 1)) < b->njobs;) {
+        b->jobs[i].status = run_job(b->args, &b->jobs[i], b->manifest);
+    }
+    
+    buf_release();
+    stats_thread(&stats, began, waited);
+    if (!pthread_equal(pthread_self(), b->caller)) {
+        pthread_mutex_lock(&b->lock);
+        stats_add(&b->counts, &stats);
+        pthread_mutex_unlock(&b->lock);
+    }
+    
+    return NULL;
+}
+
+/*
+ * Run the jobs in the --batch manifest of `args` on parallel_threads worker
+ * threads, each job running on one thread. The manifest is read and checked
+ * before any job runs. Returns the status of the first job in the manifest
+ * which failed, or EXIT_SUCCESS.
+ */
+static int run_batch(const arguments *args) {
+    bool use_stdin = strcmp(args->batch, "-") == 0;
+    batch b = {
+        .args = args,
+        .manifest = use_stdin ? "stdin" : args->batch,
+        .caller = pthread_self(),
+    };
+    
+    FILE *f = use_stdin ? stdin : fopen(args->batch, "rb");
+    if (!f) {
+        error(EXIT_CANNOT_OPEN, errno, "%s", args->batch);
+    }
+    
+    size_t size;
+    char *text = freadall(1, &size, f);
+    if (ferror(f)) {
+        error(EXIT_BW_ERROR((bw_error){ .type = BW_ERR_INPUT_READ }), errno, "%s", args->batch);
+    } else if (!(text = realloc(text, size + 1))) {
+        error(EXIT_BW_ERROR((bw_error){ .type = BW_ERR_MEMORY }), errno, "Cannot allocate buffer");
+    }
+    text[size] = '\0';
+    if (f != stdin) {
+        fclose(f);
+    }
+    
+    // Errors in the manifest are reported against their line
+    batch_manifest = b.manifest;
+    error_print_progname = print_batch_line;
+    parse_manifest(&b, text, size, args->batch_null);
+    error_print_progname = NULL;
+    
+    for (size_t i = 0; i < b.njobs; i++) {
+        if (b.jobs[i].shared) {
+            read_shared(&b.jobs[i]);
+        }
+    }
+    
+    // Each job runs on one thread, with buffers reused from the last job
+    unsigned workers = MIN(parallel_threads, MAX(b.njobs, 1));
+    parallel_threads = 1;
+    buf_reuse = true;
+    
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_t threads[workers];
+    size_t started;
+    for (started = 0; started < workers - 1; started++) {
+        if (pthread_create(&threads[started], NULL, batch_worker, &b) != 0) {
             break;
+        }
+    }
+    batch_worker(&b);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&b.lock);
+    b.counts.threads = started + 1;
+    stats_add(&stats, &b.counts);
+    
+    int status = EXIT_SUCCESS;
+    for (size_t i = 0; i < b.njobs; i++) {
+        if (!status) {
+            status = b.jobs[i].status;
+        }
+        if (b.jobs[i].operand.type == OPERAND_PATTERN) {
+            free(b.jobs[i].operand.pattern.bytes);
+        }
     }
     
+    tdestroy(b.operands, free_operand);
+    free(b.jobs);
+    free(text);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    // Default options
+    arguments args = {
+        .range = { .offset = 0, .length = -1 },
+    };
+    
+    argp_parse(&argp, argc, argv, 0, NULL, &args);
+    
+    if (stats_enabled) {
+        stats_begin = stats_start();
+        atexit(report_stats);
+    }
+    
+    if (args.batch) {
+        return run_batch(&args);
+    }
+    
+    FILE *input = stdin;
+    if (args.input && strcmp(args.input, "-") != 0) {
+        input = fopen(args.input, args.in_place ? "rb+" : "rb");
+        
+        if (!input) {
+            error(EXIT_CANNOT_OPEN, errno, "%s", args.input);
+        }
+    }
+    unbuffer_input(input);
+    
+    FILE *output = stdout;
+    if (args.in_place) {
+        output = input;
+        args.output = args.input;
+    } else if (args.output && strcmp(args.output, "-") != 0) {
+        output = fopen(args.output, "wb+");
+        
+        if (!output) {
+            error(EXIT_CANNOT_OPEN, errno, "%s", args.output);
+        }
+    }
+    
+    FILE *operand = NULL;
+    if (args.operand.type == OPERAND_FILE) {
+        operand = fopen(args.operand.file, "rb");
+        
+        if (!operand) {
+            error(EXIT_CANNOT_OPEN, errno, "%s", args.operand.file);
+        }
+    }
+    
+    byte table[BW_MAP_SIZE];
+    if (args.operator == OP_MAP) {
+        load_table(args.operand.file, table);
+    }
+    
+    off_t diff = -1;
+    char *operand_file = args.operand.file;
+    bw_error e = run_operator(&args, input, output, operand, table, &diff, &operand_file);
+    
     // Close files
     if (input != stdin && fclose(input)) {
         error(EXIT_CANNOT_CLOSE, errno, "%s", args.input);
     }
-    if (output != stdout && fclose(output)) {
+    if (output != stdout && output != input && fclose(output)) {
         error(EXIT_CANNOT_CLOSE, errno, "%s", args.output);
     }
     if (operand && fclose(operand)) {
         error(EXIT_CANNOT_CLOSE, errno, "%s", args.operand.file);
     }
+    if (args.operand.type == OPERAND_PATTERN) {
+        free(args.operand.pattern.bytes);
+    }
     
     // Handle errors
     if (e.type) {
-        char *file;
-        switch (e.type) {
-            case BW_ERR_INPUT_READ:
-                file = args.input;
-                break;
-            case BW_ERR_OUTPUT_WRITE:
-                file = args.output;
-                break;
-            case BW_ERR_OPERAND_READ:
-            case BW_ERR_OPERAND_SEEK:
-                file = args.operand.file;
-                break;
-            // Special cases
-            case BW_ERR_OPERAND_EOF:
-                error(EXIT_BW_ERROR(e), 0, "%s: Operand file too short", args.operand.file);
-            default:
-                error(EXIT_UNKNOWN_ERROR, 0, "Unknown error");
-        }
-        
-        error(EXIT_BW_ERROR(e), e.error_number, "%s", file);
+        return report_error(e, args.input, args.output, operand_file, NULL, 0);
     }
     
-    return EXIT_SUCCESS;
+    return diff != -1 ? EXIT_DIFFERENT : EXIT_SUCCESS;
 }
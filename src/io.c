@@ -0,0 +1,712 @@
+#define _GNU_SOURCE
+
+#include "io.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+
+bool io_use_mmap = true;
+bool io_use_async = true;
+bool io_direct = false;
+bool io_nocache = false;
+bool io_vmsplice = false;
+
+// Utils
+
+/* Get the AIO_* flags for io_direct and io_nocache. */
+static int aio_flags() {
+    return (io_direct ? AIO_DIRECT : 0) | (io_nocache ? AIO_NOCACHE : 0);
+}
+
+/*
+ * Advise the kernel about how a mapping of `size` bytes will be used, backing
+ * it with huge pages if `huge`. Writing to a huge page writes all of it, so
+ * they shouldn't be used where holes are left.
+ */
+static void advise_map(void *map, size_t size, bool huge) {
+    // Errors are harmless, they just mean the advice is ignored
+    int e = errno;
+    madvise(map, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    if (huge && size >= HUGEPAGE_SIZE) {
+        madvise(map, size, MADV_HUGEPAGE);
+    }
+#endif
+    errno = e;
+}
+
+// Reader
+
+/* Map the whole of `r`, starting at `pos`. Returns false if it can't be. */
+static bool reader_map(bw_reader *r, off_t size, off_t pos) {
+    int e = errno;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(r->f), 0);
+    if (map == MAP_FAILED) {
+        errno = e;
+        return false;
+    }
+    
+    advise_map(map, size, true);
+    r->map = map;
+    r->size = size;
+    r->pos = pos;
+    return true;
+}
+
+/*
+ * Restart the async reader `r` from `pos`, or fall back to stdio if it can't
+ * be. Returns false if the FILE couldn't be seeked.
+ */
+static bool reader_seek_async(bw_reader *r, off_t pos) {
+    aio_close(r->aio);
+    r->aio = aio_open_read(fileno(r->f), pos, r->aio_flags);
+    r->block_size = r->block_pos = 0;
+    r->pos = pos;
+    
+    return r->aio || fseeko(r->f, pos, SEEK_SET) == 0;
+}
+
+void reader_open(bw_reader *r, FILE *f) {
+    *r = (bw_reader){ .f = f, .limit = SIZE_MAX, .stats = &stats.input };
+    
+    // Only regular files can be mapped or read ahead, and only if not empty
+    off_t size = fsize(f);
+    off_t pos = ftello(f);
+    if (size <= 0 || pos < 0 || pos > size || size > SIZE_MAX) {
+        return;
+    }
+    
+    if (io_nocache) {
+        int e = errno;
+        posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+        errno = e;
+    }
+    
+    // Fallback to reading ahead, then to stdio. Mapping goes through the page
+    // cache, so isn't used if it's being avoided.
+    r->aio_flags = aio_flags();
+    bool map = io_use_mmap && !r->aio_flags;
+    if ((!map || !reader_map(r, size, pos)) && (io_use_async || r->aio_flags)) {
+        r->aio = aio_open_read(fileno(f), pos, r->aio_flags);
+        r->pos = pos;
+    }
+}
+
+/* Get up to `n` bytes from the async reader `r`, see reader_next(). */
+static const byte *reader_next_async(bw_reader *r, byte *buf, size_t n, size_t *read) {
+    size_t limited = MIN(n, r->limit);
+    const byte *next = buf;
+    *read = 0;
+    
+    // Use the block directly if it has enough, otherwise copy from each block
+    while (*read < limited) {
+        if (r->block_pos == r->block_size) {
+            double start = stats_start();
+            ssize_t block_size = aio_read(r->aio, &r->block);
+            stats_count(r->stats, MAX(block_size, 0), start);
+            r->block_size = r->block_pos = 0;
+            if (block_size <= 0) {
+                r->error |= block_size == -1;
+                break;
+            }
+            
+            r->block_size = block_size;
+        }
+        
+        size_t chunk = MIN(limited - *read, r->block_size - r->block_pos);
+        if (chunk == limited) {
+            next = r->block + r->block_pos;
+        } else {
+            memcpy(buf + *read, r->block + r->block_pos, chunk);
+        }
+        
+        r->block_pos += chunk;
+        *read += chunk;
+    }
+    
+    r->eof = *read < n && !r->error;
+    r->limit -= *read;
+    r->pos += *read;
+    return next;
+}
+
+void reader_limit(bw_reader *r, size_t n) {
+    r->limit = n;
+}
+
+const byte *reader_next(bw_reader *r, byte *buf, size_t n, size_t *read) {
+    if (r->aio) {
+        return reader_next_async(r, buf, n, read);
+    } else if (!r->map) {
+        *read = reader_read(r, buf, n);
+        return buf;
+    }
+    
+    *read = MIN(MIN(n, r->limit), r->size - r->pos);
+    r->eof = *read < n;
+    r->limit -= *read;
+    stats_count(r->stats, *read, 0);
+    
+    const byte *next = r->map + r->pos;
+    r->pos += *read;
+    return next;
+}
+
+size_t reader_read(bw_reader *r, byte *buf, size_t n) {
+    if (r->map || r->aio) {
+        size_t read;
+        const byte *next = reader_next(r, buf, n, &read);
+        if (next != buf) {
+            memcpy(buf, next, read);
+        }
+        return read;
+    }
+    
+    double start = stats_start();
+    size_t read = fread(buf, 1, MIN(n, r->limit), r->f);
+    stats_count(r->stats, read, start);
+    r->eof = feof(r->f) || (read < n && read == r->limit);
+    r->error = ferror(r->f);
+    r->limit -= read;
+    return read;
+}
+
+off_t reader_remaining(bw_reader *r) {
+    if (r->map) {
+        return MIN(r->size - r->pos, r->limit);
+    }
+    
+    off_t size = fsize(r->f), pos = reader_tell(r);
+    return size != -1 && pos != -1 && pos <= size ? (off_t)MIN((size_t)(size - pos), r->limit) : -1;
+}
+
+off_t reader_tell(bw_reader *r) {
+    return r->map || r->aio ? (off_t)r->pos : ftello(r->f);
+}
+
+bool reader_rewind(bw_reader *r) {
+    r->eof = false;
+    
+    if (r->map) {
+        r->pos = 0;
+        return true;
+    } else if (r->aio) {
+        return reader_seek_async(r, 0);
+    }
+    
+    return fseek(r->f, 0, SEEK_SET) == 0;
+}
+
+size_t reader_skip(bw_reader *r, size_t n) {
+    if (r->aio) {
+        // Skip within the current block, or start reading again after it
+        off_t remaining = reader_remaining(r);
+        size_t skipped = remaining == -1 ? 0 : MIN(n, (size_t)remaining);
+        if (skipped <= r->block_size - r->block_pos) {
+            r->block_pos += skipped;
+            r->pos += skipped;
+        } else {
+            r->error = !reader_seek_async(r, r->pos + skipped);
+        }
+        
+        r->eof = skipped < n;
+        r->limit -= skipped;
+        return skipped;
+    } else if (!r->map) {
+        size_t skipped = fskip(r->f, MIN(n, r->limit));
+        r->eof = skipped < n;
+        r->error = ferror(r->f);
+        r->limit -= skipped;
+        return skipped;
+    }
+    
+    size_t skipped = MIN(MIN(n, r->limit), r->size - r->pos);
+    r->eof = skipped < n;
+    r->limit -= skipped;
+    r->pos += skipped;
+    return skipped;
+}
+
+size_t reader_extent(bw_reader *r, bool *hole) {
+    off_t pos = reader_tell(r);
+    *hole = false;
+    if (!use_sparse || pos == -1) {
+        return 0;
+    }
+    
+    // Only look for the next extent once past the last one
+    if (pos < r->extent_start || pos >= r->extent_end) {
+        r->extent_start = pos;
+        r->extent_end = fextent(r->f, pos, &r->extent_hole);
+        if (r->extent_end == -1) {
+            r->extent_end = pos;
+            return 0;
+        }
+    }
+    
+    *hole = r->extent_hole;
+    return MIN((size_t)(r->extent_end - pos), r->limit);
+}
+
+void reader_close(bw_reader *r) {
+    if (r->aio) {
+        // Drop what was read ahead
+        int e = errno;
+        aio_close(r->aio);
+        fseeko(r->f, r->pos, SEEK_SET);
+        errno = e;
+        r->aio = NULL;
+    } else if (r->map) {
+        int e = errno;
+        munmap(r->map, r->size);
+        fseeko(r->f, r->pos, SEEK_SET);
+        errno = e;
+    }
+    
+    r->map = NULL;
+}
+
+// Writer
+
+/* Open `w` to write in place over what is read by `in`. */
+static void writer_open_in_place(bw_writer *w, bw_reader *in) {
+    w->in_place = in;
+    w->map_start = reader_tell(in);
+    
+    // Make the mapping writable, or fall back to stdio for both
+    int e = errno;
+    if (in->map && mprotect(in->map, in->size, PROT_READ | PROT_WRITE) != 0) {
+        reader_close(in);
+    }
+#ifdef MADV_NOHUGEPAGE
+    // Huge pages would fill in the holes around anything written
+    if (in->map && use_sparse && fsparse(w->f)) {
+        madvise(in->map, in->size, MADV_NOHUGEPAGE);
+    }
+#endif
+    errno = e;
+}
+
+/*
+ * Pre-size and map `size` bytes of `w` from the current position of the FILE.
+ * Blocks are only allocated up front if not `sparse`. Returns false if it
+ * can't be mapped.
+ */
+static bool writer_map(bw_writer *w, off_t size, bool sparse) {
+    // Flush anything already written so we know where to start
+    int e = errno;
+    off_t start;
+    if (fflush(w->f) != 0 || (start = ftello(w->f)) == -1) {
+        errno = e;
+        return false;
+    }
+    
+    // Mappings must start at a page boundary
+    long page_size = sysconf(_SC_PAGESIZE);
+    w->map_start = start / page_size * page_size;
+    w->map_offset = start - w->map_start;
+    
+    // Pre-size the output, allocating blocks now if possible so running out
+    // of space is an error here rather than a SIGBUS later. Holes which will
+    // be left in sparse output are left unallocated.
+    int fd = fileno(w->f);
+#ifdef __linux__
+    if (!sparse && fallocate(fd, 0, start, size) != 0 && errno != EOPNOTSUPP) {
+        errno = e;
+        return false;
+    }
+#endif
+    if (ftruncate(fd, start + size) != 0) {
+        errno = e;
+        return false;
+    }
+    
+    // Fails if the FILE wasn't opened for reading as well as writing
+    void *map = mmap(NULL, w->map_offset + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, w->map_start);
+    if (map == MAP_FAILED) {
+        ftruncate(fd, start);
+        errno = e;
+        return false;
+    }
+    
+    advise_map(map, w->map_offset + size, !sparse);
+    w->map = map;
+    w->size = size;
+    errno = e;
+    return true;
+}
+
+/* Open `w` to write asynchronously from the current position of the FILE. */
+static void writer_open_async(bw_writer *w) {
+    int e = errno;
+    off_t start;
+    if (fflush(w->f) == 0 && (start = ftello(w->f)) != -1) {
+        w->aio = aio_open_write(fileno(w->f), start, aio_flags());
+        w->map_start = start;
+    }
+    errno = e;
+}
+
+/*
+ * Open `w` to give blocks as big as the pipe it's writing to with vmsplice().
+ * Returns false if the FILE isn't a pipe.
+ */
+static bool writer_open_splice(bw_writer *w) {
+#if defined(__linux__) && defined(F_GETPIPE_SZ)
+    int e = errno;
+    struct stat st;
+    int capacity;
+    if (fflush(w->f) != 0 || fstat(fileno(w->f), &st) != 0 || !S_ISFIFO(st.st_mode)
+            || (capacity = fcntl(fileno(w->f), F_GETPIPE_SZ)) <= 0) {
+        errno = e;
+        return false;
+    }
+    
+    // Pages are given to the pipe whole, and mapped so it keeps them even
+    // after they're dropped from the mapping
+    long page_size = sysconf(_SC_PAGESIZE);
+    w->gift_size = (capacity + page_size - 1) / page_size * page_size;
+    void *gift = mmap(NULL, w->gift_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    errno = e;
+    if (gift == MAP_FAILED) {
+        return false;
+    }
+    
+    w->gift = gift;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void writer_open(bw_writer *w, FILE *f, off_t size, bw_reader *in) {
+    w->f = f;
+    w->in_place = NULL;
+    w->map = NULL;
+    w->size = w->pos = 0;
+    w->aio = NULL;
+    w->block = NULL;
+    w->block_pos = 0;
+    w->gift = NULL;
+    w->buf = NULL;
+    w->error = false;
+    
+    if (in && in->f == f) {
+        writer_open_in_place(w, in);
+        return;
+    }
+    
+    // Only map regular files when the size is known, and write other regular
+    // files asynchronously
+    if (fsize(f) == -1) {
+        if (io_vmsplice) {
+            writer_open_splice(w);
+        }
+        return;
+    }
+    
+    // Appends go to the end of the file wherever they were meant to, so only
+    // stdio keeps them in order. Mappings also have to be able to read it.
+    int flags = fcntl(fileno(f), F_GETFL);
+    if (flags == -1 || (flags & O_APPEND)) {
+        return;
+    }
+    
+    bool sparse = in && use_sparse && fsparse(in->f);
+    bool map = io_use_mmap && !aio_flags() && (flags & O_ACCMODE) == O_RDWR;
+    if (map && size > 0 && size <= SIZE_MAX && writer_map(w, size, sparse)) {
+        return;
+    } else if (io_use_async || aio_flags()) {
+        writer_open_async(w);
+    }
+}
+
+/* Get the buffer for blocks written through stdio, allocating it if needed. */
+static byte *writer_buf(bw_writer *w) {
+    if (!w->buf) {
+        w->buf_size = buf_size_for(w->f);
+        if (!(w->buf = buf_alloc(w->buf_size))) {
+            w->buf = w->spare;
+            w->buf_size = sizeof(w->spare);
+            w->error = true;
+        }
+    }
+    
+    return w->buf;
+}
+
+byte *writer_reserve(bw_writer *w, size_t *n) {
+    if (w->gift) {
+        *n = MIN(*n, w->gift_size - w->block_pos);
+        return w->gift + w->block_pos;
+    }
+    
+    if (w->aio && !w->error) {
+        // Wait for the next block to be free
+        if (!w->block) {
+            double start = stats_start();
+            w->block = aio_reserve(w->aio);
+            stats_wait(&stats.output, start);
+        }
+        if (w->block) {
+            *n = MIN(*n, AIO_BLOCK - w->block_pos);
+            return w->block + w->block_pos;
+        }
+        
+        w->error = true;
+    }
+    
+    // Blocks written in place need to be kept separate from what was read
+    if (!w->map || w->in_place) {
+        byte *buf = writer_buf(w);
+        *n = MIN(*n, w->buf_size);
+        return buf;
+    }
+    
+    // Fall back to stdio if we were wrong about the size
+    if (w->pos == w->size) {
+        writer_close(w);
+        return writer_reserve(w, n);
+    }
+    
+    *n = MIN(*n, w->size - w->pos);
+    return w->map + w->map_offset + w->pos;
+}
+
+/* Write a block in place at the current position of `w`. */
+static bool writer_commit_in_place(bw_writer *w, size_t n) {
+    bw_reader *in = w->in_place;
+    off_t offset = w->map_start + w->pos;
+    
+    if (in->map) {
+        // Only copy pages which changed so unchanged pages aren't dirtied
+        byte *orig = in->map + offset;
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        for (size_t i = 0, chunk; i < n; i += chunk) {
+            chunk = MIN(n - i, page_size - (offset + i) % page_size);
+            if (memcmp(orig + i, w->buf + i, chunk) != 0) {
+                memcpy(orig + i, w->buf + i, chunk);
+            }
+        }
+        stats_count(&stats.output, n, 0);
+    } else {
+        // Seek back to overwrite the block and return to where reading was
+        double start = stats_start();
+        off_t pos = ftello(w->f);
+        if (pos == -1
+                || fseeko(w->f, offset, SEEK_SET) != 0
+                || fwrite(w->buf, 1, n, w->f) != n
+                || fseeko(w->f, pos, SEEK_SET) != 0) {
+            w->error = true;
+        }
+        stats_count(&stats.output, n, start);
+    }
+    
+    w->pos += n;
+    return !w->error;
+}
+
+/* Give the block being filled to the pipe and start the next in fresh pages. */
+static bool writer_splice(bw_writer *w) {
+#ifdef __linux__
+    struct iovec iov = {w->gift, w->block_pos};
+    double start = stats_start();
+    while (iov.iov_len > 0) {
+        ssize_t given = vmsplice(fileno(w->f), &iov, 1, SPLICE_F_GIFT);
+        if (given == -1 && errno == EINTR) {
+            continue;
+        } else if (given <= 0) {
+            w->error = true;
+            break;
+        }
+        
+        iov.iov_base = (byte *)iov.iov_base + given;
+        iov.iov_len -= given;
+    }
+    stats_count(&stats.output, w->block_pos - iov.iov_len, start);
+    
+    // The pipe, or wherever it's spliced on to, is left as the only user of
+    // the pages given to it. The next block faults in new ones.
+    if (madvise(w->gift, w->gift_size, MADV_DONTNEED) != 0) {
+        w->error = true;
+    }
+#endif
+
+    w->block_pos = 0;
+    return !w->error;
+}
+
+bool writer_commit(bw_writer *w, size_t n) {
+    // Nothing is written after an error, which may have left `buf` unusable
+    if (w->error) {
+        return false;
+    }
+    
+    if (w->in_place) {
+        return writer_commit_in_place(w, n);
+    }
+    
+    if (w->gift) {
+        // Give full blocks to the pipe
+        w->block_pos += n;
+        w->pos += n;
+        return w->block_pos < w->gift_size || writer_splice(w);
+    }
+    
+    if (w->aio) {
+        // Start writing full blocks while the next is filled
+        w->block_pos += n;
+        w->pos += n;
+        if (w->block_pos == AIO_BLOCK) {
+            aio_write(w->aio, AIO_BLOCK);
+            stats_count(&stats.output, AIO_BLOCK, 0);
+            w->block = NULL;
+            w->block_pos = 0;
+        }
+        
+        return true;
+    }
+    
+    if (w->map) {
+        w->pos += n;
+        stats_count(&stats.output, n, 0);
+        return true;
+    }
+    
+    double start = stats_start();
+    if (fwrite(w->buf, 1, n, w->f) != n) {
+        w->error = true;
+    }
+    stats_count(&stats.output, n, start);
+    
+    return !w->error;
+}
+
+/*
+ * Leave a hole of `n` bytes at the current position of `w`, if it's big
+ * enough and inside a file which can have holes punched. Returns false if the
+ * zeros need to be written instead.
+ */
+static bool writer_hole(bw_writer *w, size_t n) {
+    if (!use_sparse || n < HOLE_MIN || w->error) {
+        return false;
+    }
+    
+    if (w->in_place || w->map) {
+        // Mapped output is already zero unless it's being written in place
+        off_t offset = w->map_start + (w->in_place ? 0 : w->map_offset) + w->pos;
+        if ((!w->in_place && n > w->size - w->pos) || !fpunch(w->f, offset, n)) {
+            return false;
+        }
+    } else if (w->aio) {
+        // Finish writing up to the hole and start again after it
+        if (w->block_pos) {
+            aio_write(w->aio, w->block_pos);
+            stats_count(&stats.output, w->block_pos, 0);
+        }
+        bool closed = aio_close(w->aio);
+        w->aio = NULL;
+        w->block = NULL;
+        w->block_pos = 0;
+        
+        off_t offset = w->map_start + w->pos;
+        if (!closed || fseeko(w->f, offset, SEEK_SET) != 0 || fzero(w->f, n) != n) {
+            w->error = true;
+            return true;
+        }
+        w->aio = aio_open_write(fileno(w->f), offset + n, aio_flags());
+    } else {
+        return false;
+    }
+    
+    w->pos += n;
+    return true;
+}
+
+bool writer_zero(bw_writer *w, size_t n) {
+    // Let fzero write straight to the FILE
+    if (!w->map && !w->in_place && !w->aio && !w->gift) {
+        double start = stats_start();
+        if (fzero(w->f, n) != n) {
+            w->error = true;
+        }
+        stats_count(&stats.output, n, start);
+        
+        return !w->error;
+    }
+    
+    if (writer_hole(w, n)) {
+        return !w->error;
+    }
+    
+    while (n > 0 && !w->error) {
+        size_t reserved = n;
+        byte *dst = writer_reserve(w, &reserved);
+        memset(dst, 0, reserved);
+        writer_commit(w, reserved);
+        n -= reserved;
+    }
+    
+    return !w->error;
+}
+
+bool writer_close(bw_writer *w) {
+    double start = stats_start();
+    if (w->in_place) {
+        // Trim anything read but not written over, e.g. when truncating
+        off_t end = w->map_start + w->pos;
+        bool trim = reader_tell(w->in_place) > end && fsize(w->f) > end;
+        if (fflush(w->f) != 0
+                || (trim && ftruncate(fileno(w->f), end) != 0)
+                || fseeko(w->f, end, SEEK_SET) != 0) {
+            w->error = true;
+        }
+        
+        w->in_place = NULL;
+    } else if (w->aio) {
+        // Write the last block and continue after the output
+        if (w->block_pos) {
+            aio_write(w->aio, w->block_pos);
+            stats_count(&stats.output, w->block_pos, 0);
+        }
+        if (!aio_close(w->aio) || fseeko(w->f, w->map_start + w->pos, SEEK_SET) != 0) {
+            w->error = true;
+        }
+        
+        w->aio = NULL;
+        w->block = NULL;
+        w->block_pos = 0;
+    } else if (w->gift) {
+        // Give the pipe the last block, it keeps the pages once unmapped
+        if (w->block_pos && !w->error) {
+            writer_splice(w);
+        }
+        munmap(w->gift, w->gift_size);
+        
+        w->gift = NULL;
+        w->block_pos = 0;
+    } else if (w->map) {
+        // Trim the output to what was actually written and continue after it
+        off_t end = w->map_start + w->map_offset + w->pos;
+        if (munmap(w->map, w->map_offset + w->size) != 0
+                || ftruncate(fileno(w->f), end) != 0
+                || fseeko(w->f, end, SEEK_SET) != 0) {
+            w->error = true;
+        }
+    }
+    
+    stats_wait(&stats.output, start);
+    
+    w->map = NULL;
+    if (w->buf != w->spare) {
+        buf_free(w->buf);
+    }
+    w->buf = NULL;
+    
+    return !w->error;
+}
@@ -0,0 +1,210 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "utils.h"
+#include "aio.h"
+#include "stats.h"
+
+// Tunables
+
+/* Preferred block size when reading or writing mapped files. */
+#ifndef MAP_BLOCK
+#define MAP_BLOCK (1024 * 1024)
+#endif
+
+/*
+ * Whether regular files should be memory mapped instead of using stdio.
+ * Defaults to true.
+ */
+extern bool io_use_mmap;
+
+/*
+ * Whether regular files which aren't memory mapped should be read and written
+ * asynchronously with bw_aio instead of using stdio. Defaults to true.
+ */
+extern bool io_use_async;
+
+/*
+ * Whether regular files should bypass the page cache with O_DIRECT where the
+ * file system allows it, rather than being memory mapped. They're read and
+ * written asynchronously instead, even if io_use_async isn't set. Defaults to
+ * false.
+ */
+extern bool io_direct;
+
+/*
+ * Whether regular files should be read sequentially and dropped from the page
+ * cache as they're read and written, rather than being memory mapped. They're
+ * read and written asynchronously instead, even if io_use_async isn't set.
+ * Defaults to false.
+ */
+extern bool io_nocache;
+
+/*
+ * Whether output to pipes should be given to the kernel with vmsplice()
+ * instead of being copied into them. Each block is written to fresh pages
+ * which are left to the pipe, so it's safe whatever reads the pipe does with
+ * them. Defaults to false.
+ */
+extern bool io_vmsplice;
+
+// Reader
+
+/*
+ * Reads blocks from a FILE. Regular files are memory mapped so blocks can be
+ * used directly without copying, or read ahead asynchronously if they can't
+ * be mapped. Other files are read through stdio.
+ */
+typedef struct bw_reader {
+    FILE *f;
+    /* Mapping of the whole file, or NULL if not mapped. */
+    byte *map;
+    /* Size of the mapping and current position in it. */
+    size_t size, pos;
+    /*
+     * Async reader if not mapped, in which case `pos` is the file offset.
+     * Blocks from it are used up to `block_size` starting at `block_pos`.
+     */
+    bw_aio *aio;
+    byte *block;
+    size_t block_size, block_pos;
+    /* AIO_* flags the async reader is opened with. */
+    int aio_flags;
+    /* Number of bytes left before the reader stops, see reader_limit(). */
+    size_t limit;
+    /* Counters for what is read, `stats.input` unless changed. */
+    stats_io *stats;
+    /* Hole or data last found by reader_extent(), from `extent_start`. */
+    off_t extent_start, extent_end;
+    bool extent_hole;
+    /* Set when EOF is reached or a read error occurs. */
+    bool eof, error;
+} bw_reader;
+
+/* Open a reader for `f`, starting at the current position of `f`. */
+void reader_open(bw_reader *r, FILE *f);
+
+/*
+ * Stop `r` after the next `n` bytes, as if the file ended there. Rewinding
+ * doesn't reset the limit.
+ */
+void reader_limit(bw_reader *r, size_t n);
+
+/*
+ * Get up to `n` bytes from `r`. Returns a pointer to the bytes, which will
+ * either be in the mapping or `buf`, and puts the number of bytes in `read`.
+ * Less than `n` bytes will only be returned at EOF or on error.
+ */
+const byte *reader_next(bw_reader *r, byte *buf, size_t n, size_t *read);
+
+/* Read up to `n` bytes from `r` into `buf`. Returns the number of bytes read. */
+size_t reader_read(bw_reader *r, byte *buf, size_t n);
+
+/* Get the number of bytes remaining in `r`, or -1 if unknown. */
+off_t reader_remaining(bw_reader *r);
+
+/* Get the current position of `r`, or -1 if unknown. */
+off_t reader_tell(bw_reader *r);
+
+/* Return to the start of the file. Returns false if `r` can't be seeked. */
+bool reader_rewind(bw_reader *r);
+
+/* Skip up to `n` bytes of `r`. Returns the number of bytes skipped. */
+size_t reader_skip(bw_reader *r, size_t n);
+
+/*
+ * Get the number of bytes from the current position of `r` until the hole or
+ * data it's in ends, setting `hole` if it's a hole. Returns 0 if unknown, e.g.
+ * if `r` isn't reading a regular file or use_sparse isn't set.
+ */
+size_t reader_extent(bw_reader *r, bool *hole);
+
+/*
+ * Close `r`, leaving the position of the FILE after the last byte read. Does
+ * not close the FILE itself.
+ */
+void reader_close(bw_reader *r);
+
+// Writer
+
+/*
+ * Writes blocks to a FILE. If the size of the output is known and the FILE is
+ * a regular file opened for reading and writing, it will be pre-sized and
+ * memory mapped so blocks can be written directly. Other regular files are
+ * written asynchronously, pipes can be given blocks with vmsplice(), and
+ * anything else is written through stdio.
+ * 
+ * A writer can also write in place over the blocks read by a reader of the
+ * same FILE, in which case only pages which actually changed are written back
+ * if the reader is mapped.
+ */
+typedef struct bw_writer {
+    FILE *f;
+    /* Reader being written over in place, or NULL. */
+    bw_reader *in_place;
+    /* Mapping of the output, or NULL if using stdio. */
+    byte *map;
+    /* Offset of the start of the output in `map`. */
+    size_t map_offset;
+    /* File offset of the start of `map`, or of the output if in place. */
+    off_t map_start;
+    /* Size of the output and current position in it. */
+    size_t size, pos;
+    /*
+     * Async writer if not mapped, in which case `map_start` is the file offset
+     * of the output. The current block is filled up to `block_pos`.
+     */
+    bw_aio *aio;
+    byte *block;
+    size_t block_pos;
+    /*
+     * Mapping of `gift_size` bytes to be given to a pipe with vmsplice() once
+     * filled up to `block_pos`, or NULL.
+     */
+    byte *gift;
+    size_t gift_size;
+    /* Set when a write error occurs. */
+    bool error;
+    /* Buffer for blocks written through stdio, allocated when needed. */
+    byte *buf;
+    size_t buf_size;
+    /* Used as `buf` if it couldn't be allocated, so writing fails cleanly. */
+    byte spare[VEC_ALIGN];
+} bw_writer;
+
+/*
+ * Open a writer for `f`, starting at the current position of `f`. `size` is
+ * the expected size of the output, or -1 if unknown. If `in` is reading from
+ * the same FILE, output will be written in place over the blocks read from
+ * `in`, in which case `f` must be opened for reading and writing.
+ */
+void writer_open(bw_writer *w, FILE *f, off_t size, bw_reader *in);
+
+/*
+ * Reserve space for the next block of up to `n` bytes. Returns a pointer to
+ * the space and puts the number of bytes available in `n`. The pointer is
+ * valid until the next call to writer_commit().
+ */
+byte *writer_reserve(bw_writer *w, size_t *n);
+
+/* Write the first `n` bytes of the reserved block. Returns false on error. */
+bool writer_commit(bw_writer *w, size_t n);
+
+/*
+ * Write `n` zero bytes. Runs of at least HOLE_MIN zeros are left as a hole in
+ * regular files if use_sparse is set. Returns false on error.
+ */
+bool writer_zero(bw_writer *w, size_t n);
+
+/*
+ * Close `w`, truncating the output to what was written and leaving the
+ * position of the FILE at the end of it. When writing in place, the output is
+ * only truncated if less was written than was read. Does not close the FILE itself.
+ * Returns false on error.
+ */
+bool writer_close(bw_writer *w);
+
+#endif
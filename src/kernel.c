@@ -0,0 +1,364 @@
+#include "kernel.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// Vector types
+
+/*
+ * Unaligned vector types. The bitwise operators work element-wise on these so
+ * the same OP macros can be used for bytes and vectors.
+ */
+typedef uint64_t word __attribute__((aligned(1), may_alias));
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNEL_X86
+#include <immintrin.h>
+
+typedef byte vec16 __attribute__((vector_size(16), aligned(1), may_alias));
+typedef byte vec32 __attribute__((vector_size(32), aligned(1), may_alias));
+typedef byte vec64 __attribute__((vector_size(64), aligned(1), may_alias));
+
+/* The same vectors split into 64-bit lanes, for shifting. */
+typedef uint64_t lanes16 __attribute__((vector_size(16), aligned(1), may_alias));
+typedef uint64_t lanes32 __attribute__((vector_size(32), aligned(1), may_alias));
+typedef uint64_t lanes64 __attribute__((vector_size(64), aligned(1), may_alias));
+#endif
+
+// Map kernels
+
+/* Portable map kernel using plain table lookups. */
+static void map_scalar(byte *dst, const byte *src, const byte *table, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = table[src[i]];
+    }
+}
+
+#ifdef KERNEL_X86
+
+/*
+ * Map 32 bytes at a time by looking up the low nibble of each byte in each of
+ * the 16 rows of the table with vpshufb. Each row is only kept for bytes with
+ * a matching high nibble by counting it down to zero, and saturating it so any
+ * other value sets the top bit, which makes vpshufb give zero instead.
+ */
+static __attribute__((target("avx2"))) void map_avx2(byte *dst, const byte *src, const byte *table, size_t n) {
+    const __m256i row_size = _mm256_set1_epi8(0x10);
+    const __m256i saturate = _mm256_set1_epi8(0x70);
+    size_t i = 0;
+    
+    // Whole vectors
+    for (; i + sizeof(__m256i) <= n; i += sizeof(__m256i)) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i result = _mm256_setzero_si256();
+        
+        #pragma GCC unroll 16
+        for (int h = 0; h < 16; h++) {
+            __m256i row = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(table + h * 16)));
+            __m256i index = _mm256_adds_epu8(a, saturate);
+            result = _mm256_or_si256(result, _mm256_shuffle_epi8(row, index));
+            a = _mm256_sub_epi8(a, row_size);
+        }
+        
+        _mm256_storeu_si256((__m256i *)(dst + i), result);
+    }
+    
+    // Remaining bytes
+    map_scalar(dst + i, src + i, table, n - i);
+}
+
+/*
+ * Map 64 bytes at a time using vpermi2b to look up the low 7 bits of each byte
+ * in each half of the table, and keeping the half matching the high bit.
+ */
+static __attribute__((target("avx512f,avx512bw,avx512vbmi"))) void map_avx512_vbmi(byte *dst, const byte *src, const byte *table, size_t n) {
+    __m512i t0 = _mm512_loadu_si512(table);
+    __m512i t1 = _mm512_loadu_si512(table + 64);
+    __m512i t2 = _mm512_loadu_si512(table + 128);
+    __m512i t3 = _mm512_loadu_si512(table + 192);
+    size_t i = 0;
+    
+    // Whole vectors
+    for (; i + sizeof(__m512i) <= n; i += sizeof(__m512i)) {
+        __m512i a = _mm512_loadu_si512(src + i);
+        __m512i lo = _mm512_permutex2var_epi8(t0, a, t1);
+        __m512i hi = _mm512_permutex2var_epi8(t2, a, t3);
+        _mm512_storeu_si512(dst + i, _mm512_mask_blend_epi8(_mm512_movepi8_mask(a), lo, hi));
+    }
+    
+    // Remaining bytes
+    map_scalar(dst + i, src + i, table, n - i);
+}
+
+/* AVX-512 map kernel, vpermi2b needs VBMI as well as the rest of the set. */
+static void map_avx512(byte *dst, const byte *src, const byte *table, size_t n) {
+    if (__builtin_cpu_supports("avx512vbmi")) {
+        map_avx512_vbmi(dst, src, table, n);
+    } else {
+        map_avx2(dst, src, table, n);
+    }
+}
+
+#endif
+
+// Popcount kernels
+
+/* Count the bits of `n` bytes of `src` a word at a time, for any target. */
+static inline __attribute__((always_inline)) uint64_t popcount_words(const byte *src, size_t n) {
+    uint64_t count = 0;
+    size_t i = 0;
+    
+    // Whole words
+    for (; i + sizeof(word) <= n; i += sizeof(word)) {
+        count += __builtin_popcountll(*(const word *)(src + i));
+    }
+    
+    // Remaining bytes
+    for (; i < n; i++) {
+        count += __builtin_popcount(src[i]);
+    }
+    
+    return count;
+}
+
+/* Portable popcount kernel. */
+static uint64_t popcount_scalar(const byte *src, size_t n) {
+    return popcount_words(src, n);
+}
+
+#ifdef KERNEL_X86
+
+/* Popcount kernel using POPCNT on each word. */
+static __attribute__((target("popcnt"))) uint64_t popcount_popcnt(const byte *src, size_t n) {
+    return popcount_words(src, n);
+}
+
+/* SSE2 popcount kernel, POPCNT isn't part of SSE2 so may not be supported. */
+static uint64_t popcount_sse2(const byte *src, size_t n) {
+    if (__builtin_cpu_supports("popcnt")) {
+        return popcount_popcnt(src, n);
+    } else {
+        return popcount_scalar(src, n);
+    }
+}
+
+/*
+ * Count bits 32 bytes at a time by looking up the count of each nibble with
+ * vpshufb. Counts are added up per byte for up to 31 vectors before they could
+ * overflow, then summed into 64-bit lanes with vpsadbw.
+ */
+static __attribute__((target("avx2,popcnt"))) uint64_t popcount_avx2(const byte *src, size_t n) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    
+    // Whole vectors
+    while (i + sizeof(__m256i) <= n) {
+        __m256i counts = _mm256_setzero_si256();
+        for (int j = 0; j < 31 && i + sizeof(__m256i) <= n; j++, i += sizeof(__m256i)) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+            __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(a, nibble));
+            __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(a, 4), nibble));
+            counts = _mm256_add_epi8(counts, _mm256_add_epi8(lo, hi));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+    }
+    
+    // Remaining bytes
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, total);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + popcount_words(src + i, n - i);
+}
+
+/* Count bits 64 bytes at a time with vpopcntq. */
+static __attribute__((target("avx512f,avx512vpopcntdq,popcnt"))) uint64_t popcount_avx512_vpopcntdq(const byte *src, size_t n) {
+    __m512i total = _mm512_setzero_si512();
+    size_t i = 0;
+    
+    // Whole vectors
+    for (; i + sizeof(__m512i) <= n; i += sizeof(__m512i)) {
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(_mm512_loadu_si512(src + i)));
+    }
+    
+    // Remaining bytes
+    return _mm512_reduce_add_epi64(total) + popcount_words(src + i, n - i);
+}
+
+/* AVX-512 popcount kernel, vpopcntq needs VPOPCNTDQ as well as the rest of the set. */
+static uint64_t popcount_avx512(const byte *src, size_t n) {
+    if (__builtin_cpu_supports("avx512vpopcntdq")) {
+        return popcount_avx512_vpopcntdq(src, n);
+    } else {
+        return popcount_avx2(src, n);
+    }
+}
+
+#endif
+
+// Nonzero kernels
+
+/* Find the first nonzero byte from `i` in `n` bytes of `src` one at a time. */
+static inline __attribute__((always_inline)) size_t nonzero_bytes(const byte *src, size_t i, size_t n) {
+    while (i < n && !src[i]) {
+        i++;
+    }
+    
+    return i;
+}
+
+/* Portable nonzero kernel, skipping zero words and then finding the byte. */
+static size_t nonzero_scalar(const byte *src, size_t n) {
+    size_t i = 0;
+    while (i + sizeof(word) <= n && !*(const word *)(src + i)) {
+        i += sizeof(word);
+    }
+    
+    return nonzero_bytes(src, i, n);
+}
+
+#ifdef KERNEL_X86
+
+/* Compare 16 bytes at a time with zero and find the first that isn't with pmovmskb. */
+static __attribute__((target("sse2"))) size_t nonzero_sse2(const byte *src, size_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    
+    // Whole vectors
+    for (; i + sizeof(__m128i) <= n; i += sizeof(__m128i)) {
+        unsigned zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(src + i)), zero));
+        if (zeros != 0xffff) {
+            return i + __builtin_ctz(~zeros);
+        }
+    }
+    
+    // Remaining bytes
+    return nonzero_bytes(src, i, n);
+}
+
+/* Compare 32 bytes at a time with zero and find the first that isn't with vpmovmskb. */
+static __attribute__((target("avx2"))) size_t nonzero_avx2(const byte *src, size_t n) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    
+    // Whole vectors
+    for (; i + sizeof(__m256i) <= n; i += sizeof(__m256i)) {
+        unsigned zeros = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(src + i)), zero));
+        if (zeros != 0xffffffff) {
+            return i + __builtin_ctz(~zeros);
+        }
+    }
+    
+    // Remaining bytes
+    return nonzero_bytes(src, i, n);
+}
+
+/* Test 64 bytes at a time into a mask of which aren't zero with vptestmb. */
+static __attribute__((target("avx512f,avx512bw"))) size_t nonzero_avx512(const byte *src, size_t n) {
+    size_t i = 0;
+    
+    // Whole vectors
+    for (; i + sizeof(__m512i) <= n; i += sizeof(__m512i)) {
+        __m512i a = _mm512_loadu_si512(src + i);
+        __mmask64 nonzero = _mm512_test_epi8_mask(a, a);
+        if (nonzero) {
+            return i + __builtin_ctzll(nonzero);
+        }
+    }
+    
+    // Remaining bytes
+    return nonzero_bytes(src, i, n);
+}
+
+#endif
+
+// Kernel sets
+
+#ifdef KERNEL_X86
+
+#define ISA avx512
+#define VEC vec64
+#define LANES lanes64
+#define BROADCAST(b) ((vec64){0} + (b))
+#define SUPPORTED __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+#define TARGET __attribute__((target("avx512f,avx512bw")))
+#define MAP_KERNEL map_avx512
+#define POPCOUNT_KERNEL popcount_avx512
+#define NONZERO_KERNEL nonzero_avx512
+#include "kernel_template.inc"
+
+#define ISA avx2
+#define VEC vec32
+#define LANES lanes32
+#define BROADCAST(b) ((vec32){0} + (b))
+#define SUPPORTED __builtin_cpu_supports("avx2")
+#define TARGET __attribute__((target("avx2")))
+#define MAP_KERNEL map_avx2
+#define POPCOUNT_KERNEL popcount_avx2
+#define NONZERO_KERNEL nonzero_avx2
+#include "kernel_template.inc"
+
+#define ISA sse2
+#define VEC vec16
+#define LANES lanes16
+#define BROADCAST(b) ((vec16){0} + (b))
+#define SUPPORTED __builtin_cpu_supports("sse2")
+#define TARGET __attribute__((target("sse2")))
+#define POPCOUNT_KERNEL popcount_sse2
+#define NONZERO_KERNEL nonzero_sse2
+#include "kernel_template.inc"
+
+#endif
+
+// Portable fallback using 64-bit words
+#define ISA scalar
+#define VEC word
+#define BROADCAST(b) ((word)(b) * UINT64_C(0x0101010101010101))
+#define SUPPORTED true
+#include "kernel_template.inc"
+
+const kernel_set *const kernel_sets[] = {
+#ifdef KERNEL_X86
+    &kernels_avx512,
+    &kernels_avx2,
+    &kernels_sse2,
+#endif
+    &kernels_scalar,
+    NULL
+};
+
+// Selection
+
+/* Select the best supported kernel set, or the one named by $BW_KERNEL. */
+static const kernel_set *select_kernels(void) {
+#ifdef KERNEL_X86
+    __builtin_cpu_init();
+#endif
+
+    const char *name = getenv("BW_KERNEL");
+    for (const kernel_set *const *set = kernel_sets; *set; set++) {
+        if ((!name || strcmp(name, (*set)->name) == 0) && (*set)->supported()) {
+            return *set;
+        }
+    }
+    
+    // Unknown or unsupported $BW_KERNEL
+    return &kernels_scalar;
+}
+
+/* Kernel set from select_kernels(), only set once by select_once(). */
+static const kernel_set *selected;
+static pthread_once_t selected_once = PTHREAD_ONCE_INIT;
+
+static void select_once(void) {
+    selected = select_kernels();
+}
+
+const kernel_set *kernels(void) {
+    // Threads can all call this at once, e.g. with --threads or --batch
+    pthread_once(&selected_once, select_once);
+    return selected;
+}
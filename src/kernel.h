@@ -0,0 +1,76 @@
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "utils.h"
+
+// Types
+
+/*
+ * Combine each byte of `src` with the corresponding byte of `op` and store the
+ * result in `dst`. `dst` may be the same as `src`, otherwise they must not
+ * overlap.
+ */
+typedef void (*bw_kernel)(byte *dst, const byte *src, const byte *op, size_t n);
+
+/*
+ * Combine each byte of `src` with `op` and store the result in `dst`. `dst` may
+ * be the same as `src`, otherwise they must not overlap.
+ */
+typedef void (*bw_kernel_byte)(byte *dst, const byte *src, byte op, size_t n);
+
+/*
+ * Replace each byte of `src` with its entry in the 256 byte `table` and store
+ * the result in `dst`. `dst` may be the same as `src`, otherwise they must not
+ * overlap.
+ */
+typedef void (*bw_kernel_map)(byte *dst, const byte *src, const byte *table, size_t n);
+
+/*
+ * Shift the bits of `n` + 1 bytes from `src` by `bits` bits, where `bits` <
+ * BYTE_BIT, and store `n` bytes in `dst`, like bitshiftl() and bitshiftr().
+ */
+typedef void (*bw_kernel_shift)(byte *dst, const byte *src, size_t n, shift bits);
+
+/* Count the set bits in the `n` bytes of `src`. */
+typedef uint64_t (*bw_kernel_count)(const byte *src, size_t n);
+
+/* Find the first byte of the `n` bytes of `src` which isn't zero, or `n` if none. */
+typedef size_t (*bw_kernel_find)(const byte *src, size_t n);
+
+/* Set of kernels for every operator targeting a single instruction set. */
+typedef struct kernel_set {
+    /* Name of the instruction set, e.g. "avx2". */
+    const char *name;
+    /* Width of a single vector in bytes. */
+    size_t width;
+    /* Returns true if the CPU supports this instruction set. */
+    bool (*supported)(void);
+    
+    bw_kernel or_mem, and_mem, xor_mem;
+    /* NOT kernel ignores its operand. */
+    bw_kernel_byte or_byte, and_byte, xor_byte, not_byte;
+    bw_kernel_map map;
+    /* Left shifts may have `dst` before `src`, right shifts after. */
+    bw_kernel_shift shiftl, shiftr;
+    bw_kernel_count popcount;
+    bw_kernel_find nonzero;
+} kernel_set;
+
+// Functions
+
+/*
+ * All kernel sets compiled into this build, best first and terminated by NULL.
+ * The last set is always the portable scalar set.
+ */
+extern const kernel_set *const kernel_sets[];
+
+/*
+ * Get the best kernel set supported by the CPU. The set is selected on the
+ * first call and cached. Safe to call from any thread.
+ */
+const kernel_set *kernels(void);
+
+#endif
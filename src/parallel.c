@@ -0,0 +1,409 @@
+#include "parallel.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "stats.h"
+#include "io.h"
+
+unsigned parallel_threads = 1;
+
+// Utils
+
+/* Shared state of a running job. */
+typedef struct parallel_ctx {
+    const parallel_job *job;
+    int in_fd, out_fd, op_fd;
+    off_t in_start, out_start, op_start;
+    bool in_place;
+    /* Number of bytes to process. */
+    size_t length;
+    
+    /* Expanded pattern (or cached operand) and it's period, or NULL. */
+    byte *pat_buf;
+    size_t period;
+    /* Number of operand bytes available from op_start. */
+    size_t op_avail;
+    
+    /* Offset of the next chunk to be claimed. */
+    atomic_size_t next;
+    /* Counters of all workers, added to the caller's when done. */
+    bw_stats counts;
+    /* First error to occur, stops all workers. */
+    pthread_mutex_t lock;
+    atomic_bool failed;
+    int error_type, error_number;
+} parallel_ctx;
+
+/* Record an error of `type` from errno, unless one has already occurred. */
+static void fail(parallel_ctx *ctx, int type) {
+    int e = errno;
+    pthread_mutex_lock(&ctx->lock);
+    if (!ctx->failed) {
+        ctx->error_type = type;
+        ctx->error_number = e;
+        ctx->failed = true;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Read up to `n` bytes at `offset`, retrying short reads until EOF. */
+static size_t pread_full(int fd, byte *buf, size_t n, off_t offset) {
+    size_t total = 0;
+    while (total < n) {
+        ssize_t read = pread(fd, buf + total, n - total, offset + total);
+        if (read < 0 && errno == EINTR) {
+            continue;
+        } else if (read <= 0) {
+            break;
+        }
+        
+        total += read;
+    }
+    
+    return total;
+}
+
+/* Write `n` bytes at `offset`. Returns false on error. */
+static bool pwrite_full(int fd, const byte *buf, size_t n, off_t offset) {
+    while (n > 0) {
+        ssize_t written = pwrite(fd, buf, n, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written < 0) {
+            return false;
+        }
+        
+        buf += written;
+        offset += written;
+        n -= written;
+    }
+    
+    return true;
+}
+
+/*
+ * Write `n` bytes of `dst` over `orig` at `offset` in place, skipping pages
+ * which didn't change so they aren't dirtied.
+ */
+static bool pwrite_changed(int fd, const byte *dst, const byte *orig, size_t n, off_t offset) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t start = 0, end = 0;
+    for (size_t i = 0, chunk; i < n; i += chunk) {
+        chunk = MIN(n - i, page_size - (offset + i) % page_size);
+        if (memcmp(orig + i, dst + i, chunk) == 0) {
+            // Write the run of changed pages before this one
+            if (end > start && !pwrite_full(fd, dst + start, end - start, offset + start)) {
+                return false;
+            }
+            start = end = i + chunk;
+        } else {
+            end = i + chunk;
+        }
+    }
+    
+    return end == start || pwrite_full(fd, dst + start, end - start, offset + start);
+}
+
+/*
+ * Read `n` bytes of the operand file for the chunk at `offset` into `buf`,
+ * wrapping around or filling according to the EOF mode, and count the reads
+ * in `counts`.
+ */
+static bool read_operand(parallel_ctx *ctx, byte *buf, size_t n, size_t offset, bw_stats *counts) {
+    if (ctx->job->eof == EOF_LOOP) {
+        for (size_t pos = offset % ctx->op_avail, chunk; n > 0; pos = 0) {
+            chunk = MIN(n, ctx->op_avail - pos);
+            double start = stats_start();
+            if (pread_full(ctx->op_fd, buf, chunk, ctx->op_start + pos) != chunk) {
+                return false;
+            }
+            stats_count(&counts->operand, chunk, start);
+            
+            // Count starting from the beginning again, like a serial rewind
+            counts->rewinds += pos == 0 && offset > 0;
+            
+            buf += chunk;
+            offset += chunk;
+            n -= chunk;
+        }
+        
+        return true;
+    }
+    
+    // Fill anything after the end of the operand, only reached with EOF_ZERO
+    // or EOF_ONE since length is limited otherwise
+    size_t have = offset < ctx->op_avail ? MIN(n, ctx->op_avail - offset) : 0;
+    double start = stats_start();
+    if (pread_full(ctx->op_fd, buf, have, ctx->op_start + offset) != have) {
+        return false;
+    }
+    stats_count(&counts->operand, have, start);
+    memset(buf + have, ctx->job->eof == EOF_ONE ? ~0 : 0, n - have);
+    
+    return true;
+}
+
+/*
+ * Perform the operation on a chunk of `n` bytes at `offset`, counting operand
+ * reads in `counts`.
+ */
+static bool run_chunk(parallel_ctx *ctx, byte *dst, const byte *src, byte *op_buf, size_t n, size_t offset, bw_stats *counts) {
+    const parallel_job *job = ctx->job;
+    
+    if (job->byte_kernel) {
+        job->byte_kernel(dst, src, job->byte_operand, n);
+    } else if (job->map_kernel) {
+        job->map_kernel(dst, src, job->table, n);
+    } else if (ctx->pat_buf) {
+        // Use the pattern at the phase of each part of the chunk, in parts no
+        // larger than the expanded pattern
+        for (size_t i = 0, part; i < n; i += part) {
+            part = MIN(BUF_SIZE, n - i);
+            job->mem_kernel(dst + i, src + i, ctx->pat_buf + (offset + i) % ctx->period, part);
+        }
+    } else {
+        if (!read_operand(ctx, op_buf, n, offset, counts)) {
+            fail(ctx, BW_ERR_OPERAND_READ);
+            return false;
+        }
+        job->mem_kernel(dst, src, op_buf, n);
+    }
+    
+    return true;
+}
+
+/* Claim and process chunks until there are none left or an error occurs. */
+static void *worker(void *arg) {
+    parallel_ctx *ctx = arg;
+    
+    // Results are kept separate from the input in place so they can be
+    // compared, otherwise the input buffer is reused
+    byte *in_buf = aligned_alloc(VEC_ALIGN, PARALLEL_CHUNK);
+    byte *out_buf = ctx->in_place ? aligned_alloc(VEC_ALIGN, PARALLEL_CHUNK) : in_buf;
+    byte *op_buf = ctx->op_fd != -1 && !ctx->pat_buf ? aligned_alloc(VEC_ALIGN, PARALLEL_CHUNK) : NULL;
+    if (!in_buf || !out_buf || (ctx->op_fd != -1 && !ctx->pat_buf && !op_buf)) {
+        fail(ctx, BW_ERR_MEMORY);
+    }
+    
+    // Counted separately and added at the end so workers don't contend
+    bw_stats counts = {0};
+    double began = stats_start();
+    while (!ctx->failed) {
+        size_t offset = atomic_fetch_add(&ctx->next, PARALLEL_CHUNK);
+        if (offset >= ctx->length) {
+            break;
+        }
+        
+        size_t n = MIN(PARALLEL_CHUNK, ctx->length - offset);
+        double start = stats_start();
+        if (pread_full(ctx->in_fd, in_buf, n, ctx->in_start + offset) != n) {
+            fail(ctx, BW_ERR_INPUT_READ);
+            break;
+        }
+        stats_count(&counts.input, n, start);
+        
+        if (!run_chunk(ctx, out_buf, in_buf, op_buf, n, offset, &counts)) {
+            break;
+        }
+        
+        off_t out_offset = ctx->out_start + offset;
+        start = stats_start();
+        if (ctx->in_place
+                ? !pwrite_changed(ctx->out_fd, out_buf, in_buf, n, out_offset)
+                : !pwrite_full(ctx->out_fd, out_buf, n, out_offset)) {
+            fail(ctx, BW_ERR_OUTPUT_WRITE);
+            break;
+        }
+        stats_count(&counts.output, n, start);
+    }
+    
+    stats_thread(&counts, began, 0);
+    pthread_mutex_lock(&ctx->lock);
+    stats_add(&ctx->counts, &counts);
+    pthread_mutex_unlock(&ctx->lock);
+    
+    if (out_buf != in_buf) {
+        free(out_buf);
+    }
+    free(in_buf);
+    free(op_buf);
+    return NULL;
+}
+
+/*
+ * Prepare the operand of `job` in `ctx`, limiting the length to process
+ * according to the EOF mode. Returns PARALLEL_UNSUPPORTED if the operand
+ * isn't a regular file, or the error type if the job can't run.
+ */
+static int prepare_operand(parallel_ctx *ctx) {
+    const parallel_job *job = ctx->job;
+    
+    if (!job->operand) {
+        if (job->pattern_size == 0) {
+            return BW_ERR_OPERAND_EOF;
+        }
+        
+        size_t pat_size;
+        ctx->pat_buf = mempattern(job->pattern, job->pattern_size, BUF_SIZE, &pat_size);
+        ctx->period = job->pattern_size;
+        return ctx->pat_buf ? BW_ERR_NONE : BW_ERR_MEMORY;
+    }
+    
+    off_t op_size = fsize(job->operand);
+    ctx->op_start = ftello(job->operand);
+    ctx->op_fd = fileno(job->operand);
+    if (op_size == -1 || ctx->op_start == -1) {
+        return PARALLEL_UNSUPPORTED;
+    }
+    ctx->op_avail = ctx->op_start < op_size ? op_size - ctx->op_start : 0;
+    
+    switch (job->eof) {
+        case EOF_ERROR: case EOF_TRUNCATE:
+            ctx->length = MIN(ctx->length, ctx->op_avail);
+            break;
+        case EOF_LOOP:
+            // Looping always restarts from the beginning of the operand
+            if (ctx->op_start != 0) {
+                return PARALLEL_UNSUPPORTED;
+            } else if (ctx->op_avail == 0) {
+                return BW_ERR_OPERAND_EOF;
+            }
+            
+            // Use a small enough operand like a pattern
+            if (ctx->op_avail <= bw_loop_cache_limit) {
+                byte *cache = malloc(ctx->op_avail);
+                if (!cache) {
+                    return BW_ERR_MEMORY;
+                }
+                
+                double start = stats_start();
+                if (pread_full(ctx->op_fd, cache, ctx->op_avail, 0) != ctx->op_avail) {
+                    free(cache);
+                    return BW_ERR_OPERAND_READ;
+                }
+                stats_count(&stats.operand, ctx->op_avail, start);
+                
+                size_t pat_size;
+                ctx->pat_buf = mempattern(cache, ctx->op_avail, BUF_SIZE, &pat_size);
+                ctx->period = ctx->op_avail;
+                free(cache);
+                return ctx->pat_buf ? BW_ERR_NONE : BW_ERR_MEMORY;
+            }
+            break;
+        default:
+            break;
+    }
+    
+    return BW_ERR_NONE;
+}
+
+/*
+ * Leave the FILEs of `job` positioned after what was processed, truncating
+ * the output to match.
+ */
+static bool finish(parallel_ctx *ctx) {
+    const parallel_job *job = ctx->job;
+    off_t out_end = ctx->out_start + ctx->length;
+    
+    if (job->operand) {
+        // A cached operand has been read to the end, like when serial
+        off_t op_end = job->eof != EOF_LOOP
+            ? ctx->op_start + MIN(ctx->length, ctx->op_avail)
+            : ctx->pat_buf ? ctx->op_avail : ctx->length % ctx->op_avail;
+        fseeko(job->operand, op_end, SEEK_SET);
+    }
+    
+    if (!ctx->in_place) {
+        fseeko(job->input, ctx->in_start + ctx->length, SEEK_SET);
+    }
+    
+    return (fsize(job->output) <= out_end || ftruncate(ctx->out_fd, out_end) == 0)
+        && fseeko(job->output, out_end, SEEK_SET) == 0;
+}
+
+// Functions
+
+int parallel_run(const parallel_job *job) {
+    // Workers read and write through the page cache, so leave files which
+    // should bypass or be dropped from it to the async reader and writer
+    if (parallel_threads <= 1 || io_direct || io_nocache) {
+        return PARALLEL_UNSUPPORTED;
+    }
+    
+    parallel_ctx ctx = {
+        .job = job,
+        .op_fd = -1,
+        .in_place = job->input == job->output
+    };
+    
+    // Input and output must both be regular files with known positions, and
+    // the output can't be appended to as chunks would go in any order
+    off_t in_size = fsize(job->input);
+    ctx.in_start = ftello(job->input);
+    int out_flags = fcntl(fileno(job->output), F_GETFL);
+    if (in_size == -1 || ctx.in_start == -1 || ctx.in_start > in_size
+            || out_flags == -1 || (out_flags & O_APPEND)
+            || fflush(job->output) != 0 || fsize(job->output) == -1
+            || (ctx.out_start = ftello(job->output)) == -1) {
+        return PARALLEL_UNSUPPORTED;
+    }
+    ctx.length = in_size - ctx.in_start;
+    
+    // Not worth starting threads for less than a couple of chunks each
+    if (ctx.length < 2 * PARALLEL_CHUNK) {
+        return PARALLEL_UNSUPPORTED;
+    }
+    
+    ctx.in_fd = fileno(job->input);
+    ctx.out_fd = fileno(job->output);
+    
+    int type = job->byte_kernel || job->map_kernel ? BW_ERR_NONE : prepare_operand(&ctx);
+    if (type != BW_ERR_NONE) {
+        free(ctx.pat_buf);
+        return type;
+    }
+    
+    // Pre-size the output so chunks can be written in any order
+    if (!ctx.in_place && ftruncate(ctx.out_fd, ctx.out_start + ctx.length) != 0) {
+        free(ctx.pat_buf);
+        return BW_ERR_OUTPUT_WRITE;
+    }
+    
+    // Start workers, the calling thread is one of them
+    pthread_mutex_init(&ctx.lock, NULL);
+    size_t chunks = (ctx.length + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+    size_t count = chunks > 1 ? MIN(parallel_threads, chunks) - 1 : 0, started;
+    pthread_t threads[parallel_threads];
+    for (started = 0; started < count; started++) {
+        if (pthread_create(&threads[started], NULL, worker, &ctx) != 0) {
+            break;
+        }
+    }
+    worker(&ctx);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&ctx.lock);
+    ctx.counts.threads = started + 1;
+    stats_add(&stats, &ctx.counts);
+    
+    if (ctx.failed) {
+        type = ctx.error_type;
+        errno = ctx.error_number;
+    } else if (!finish(&ctx)) {
+        type = BW_ERR_OUTPUT_WRITE;
+    } else if (job->operand && job->eof == EOF_ERROR && ctx.length < in_size - ctx.in_start) {
+        type = BW_ERR_OPERAND_EOF;
+    }
+    
+    int e = errno;
+    free(ctx.pat_buf);
+    errno = e;
+    return type;
+}
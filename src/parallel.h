@@ -0,0 +1,66 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdio.h>
+#include "bitwise.h"
+#include "kernel.h"
+
+// Tunables
+
+/* Size of the chunks of input given to each worker thread. */
+#ifndef PARALLEL_CHUNK
+#define PARALLEL_CHUNK (4 * 1024 * 1024)
+#endif
+
+/*
+ * Number of worker threads to use for byte, map, pattern and file operations
+ * on regular files. Defaults to 1, which disables parallel execution.
+ */
+extern unsigned parallel_threads;
+
+// Types
+
+/* Returned by parallel_run() when a job can't be run in parallel. */
+#define PARALLEL_UNSUPPORTED -1
+
+/*
+ * A byte, map, pattern or file operation to run in parallel. Exactly one of
+ * `byte_kernel`, `map_kernel`, `pattern` or `operand` should be used.
+ */
+typedef struct parallel_job {
+    FILE *input, *output;
+    
+    /* Kernel and operand for byte operations. */
+    bw_kernel_byte byte_kernel;
+    byte byte_operand;
+    
+    /* Kernel and table for map operations. */
+    bw_kernel_map map_kernel;
+    const byte *table;
+    
+    /* Kernel for pattern and file operations. */
+    bw_kernel mem_kernel;
+    /* Pattern and it's size for pattern operations. */
+    const byte *pattern;
+    size_t pattern_size;
+    /* Operand file and EOF mode for file operations. */
+    FILE *operand;
+    eof_mode eof;
+} parallel_job;
+
+// Functions
+
+/*
+ * Run `job` on parallel_threads threads, splitting the input into chunks of
+ * PARALLEL_CHUNK bytes which are read with pread() and written with pwrite()
+ * at matching offsets. Input, output and operand must be regular files, and
+ * output may be the same FILE as input but can't be opened for appending.
+ *
+ * Returns PARALLEL_UNSUPPORTED without doing anything if the job can't or
+ * shouldn't be run in parallel, including when io_direct or io_nocache is set. Otherwise returns the bw_error type, with
+ * errno set to the error number, and leaves all FILEs positioned after what
+ * was processed like the serial functions.
+ */
+int parallel_run(const parallel_job *job);
+
+#endif
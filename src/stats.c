@@ -0,0 +1,99 @@
+#include "stats.h"
+
+#include <time.h>
+
+bool stats_enabled = false;
+_Thread_local bw_stats stats;
+
+// Functions
+
+double stats_start() {
+    if (!stats_enabled) {
+        return 0;
+    }
+    
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void stats_count(stats_io *io, size_t bytes, double start) {
+    io->bytes += bytes;
+    io->calls++;
+    stats_wait(io, start);
+}
+
+void stats_wait(stats_io *io, double start) {
+    if (start) {
+        io->seconds += stats_start() - start;
+    }
+}
+
+double stats_waiting(const bw_stats *s) {
+    return s->input.seconds + s->operand.seconds + s->output.seconds;
+}
+
+void stats_thread(bw_stats *s, double start, double waited) {
+    if (start) {
+        s->compute_seconds += stats_start() - start - (stats_waiting(s) - waited);
+    }
+}
+
+/* Add the counters for one kind of file in `from` to `to`. */
+static void stats_io_add(stats_io *to, const stats_io *from) {
+    to->bytes += from->bytes;
+    to->calls += from->calls;
+    to->seconds += from->seconds;
+}
+
+void stats_add(bw_stats *to, const bw_stats *from) {
+    stats_io_add(&to->input, &from->input);
+    stats_io_add(&to->operand, &from->operand);
+    stats_io_add(&to->output, &from->output);
+    to->rewinds += from->rewinds;
+    if (from->freadall_peak > to->freadall_peak) {
+        to->freadall_peak = from->freadall_peak;
+    }
+    to->compute_seconds += from->compute_seconds;
+    if (from->threads > to->threads) {
+        to->threads = from->threads;
+    }
+}
+
+void stats_print(FILE *f, bool json, double elapsed) {
+    // Threads sharing work can spend longer waiting in total than has actually
+    // elapsed, so they count their own compute time
+    double waiting = stats_waiting(&stats);
+    double compute = stats.threads ? stats.compute_seconds : elapsed > waiting ? elapsed - waiting : 0;
+    double gbps = elapsed > 0 ? stats.input.bytes / elapsed / 1e9 : 0;
+    
+    const char *names[] = {"input", "operand", "output"};
+    const stats_io *ios[] = {&stats.input, &stats.operand, &stats.output};
+    
+    if (json) {
+        fprintf(f, "{");
+        for (int i = 0; i < 3; i++) {
+            fprintf(f, "\"%s\": {\"bytes\": %llu, \"calls\": %llu, \"seconds\": %.6f}, ",
+                    names[i], (unsigned long long)ios[i]->bytes, (unsigned long long)ios[i]->calls, ios[i]->seconds);
+        }
+        fprintf(f, "\"compute_seconds\": %.6f, \"seconds\": %.6f, \"gbps\": %.3f, "
+                "\"operand_rewinds\": %llu, \"freadall_peak\": %zu, \"threads\": %u}\n",
+                compute, elapsed, gbps, (unsigned long long)stats.rewinds, stats.freadall_peak, stats.threads ? stats.threads : 1);
+        return;
+    }
+    
+    fprintf(f, "%-8s %14s %10s %10s\n", "", "bytes", "calls", "seconds");
+    for (int i = 0; i < 3; i++) {
+        fprintf(f, "%-8s %14llu %10llu %10.6f\n",
+                names[i], (unsigned long long)ios[i]->bytes, (unsigned long long)ios[i]->calls, ios[i]->seconds);
+    }
+    fprintf(f, "%-8s %14s %10s %10.6f\n", "compute", "", "", compute);
+    fprintf(f, "%-8s %14llu %10s %10.6f (%.3f GB/s)\n", "total", (unsigned long long)stats.input.bytes, "", elapsed, gbps);
+    if (stats.threads > 1) {
+        fprintf(f, "input, operand, output and compute seconds are summed over %u threads\n", stats.threads);
+    }
+    fprintf(f, "operand rewinds: %llu\n", (unsigned long long)stats.rewinds);
+    if (stats.freadall_peak) {
+        fprintf(f, "freadall peak memory: %zu bytes\n", stats.freadall_peak);
+    }
+}
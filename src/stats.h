@@ -0,0 +1,83 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Types
+
+/* Counters for reading or writing one kind of file. */
+typedef struct stats_io {
+    /* Number of bytes read or written. */
+    uint64_t bytes;
+    /* Number of blocks read or written. */
+    uint64_t calls;
+    /* Time spent waiting for reads or writes, in seconds. */
+    double seconds;
+} stats_io;
+
+typedef struct bw_stats {
+    stats_io input, operand, output;
+    /* Number of times an operand file was rewound by EOF_LOOP. */
+    uint64_t rewinds;
+    /* Most memory held at once by freadall(), in bytes. */
+    size_t freadall_peak;
+    /*
+     * Time spent computing by threads sharing work, counted by each with
+     * stats_thread(), and the most threads which shared it, or 0 if none did.
+     */
+    double compute_seconds;
+    unsigned threads;
+} bw_stats;
+
+// Globals
+
+/*
+ * Whether time spent reading and writing is measured. Other counters are
+ * always kept. Defaults to false.
+ */
+extern bool stats_enabled;
+
+/*
+ * Counters for everything done so far by the calling thread. Threads doing
+ * work for another add their counters to that thread's with stats_add().
+ */
+extern _Thread_local bw_stats stats;
+
+// Functions
+
+/* Get the current time to measure from, or 0 if stats aren't enabled. */
+double stats_start();
+
+/*
+ * Count a block of `bytes` read or written in `io`, adding the time since
+ * `start` from stats_start().
+ */
+void stats_count(stats_io *io, size_t bytes, double start);
+
+/* Add the time since `start` from stats_start() to `io` without a block. */
+void stats_wait(stats_io *io, double start);
+
+/* Get the time spent reading and writing in `s`, in seconds. */
+double stats_waiting(const bw_stats *s);
+
+/*
+ * Count the time since `start` from stats_start() as compute time in `s`, for
+ * a thread sharing work with others, less the time it spent reading and
+ * writing beyond the `waited` seconds already in `s` when it started.
+ */
+void stats_thread(bw_stats *s, double start, double waited);
+
+/* Add the counters in `from` to `to`. */
+void stats_add(bw_stats *to, const bw_stats *from);
+
+/*
+ * Print `stats` to `f`, as JSON if `json`, with `elapsed` seconds as the
+ * total time. Time not spent reading or writing is counted as compute, unless
+ * threads shared the work, in which case times are summed over the threads.
+ */
+void stats_print(FILE *f, bool json, double elapsed);
+
+#endif
@@ -1,11 +1,170 @@
+#define _GNU_SOURCE
+
 #include "utils.h"
 
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdio_ext.h>
+#include "stats.h"
+#include "kernel.h"
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+size_t buf_size = 0;
+bool use_sparse = true;
+bool buf_reuse = false;
+
+/* Header kept before each buffer from buf_alloc(), padded to keep alignment. */
+typedef union buf_header {
+    struct {
+        /* Total size of the allocation, including the header. */
+        size_t size;
+        /* Whether allocated with mmap() rather than aligned_alloc(). */
+        bool mapped;
+    };
+    byte align[VEC_ALIGN];
+} buf_header;
+
+/* Buffers freed by this thread which are kept for reuse, or NULL. */
+static _Thread_local buf_header *buf_kept[BUF_KEEP];
+
+size_t buf_size_for(FILE *f) {
+    if (buf_size) {
+        return buf_size;
+    }
+    
+    int e = errno;
+    struct stat st;
+    size_t size = BUF_SIZE_DEFAULT;
+    if (fstat(fileno(f), &st) == 0) {
+#ifdef F_GETPIPE_SZ
+        // Read or write as much as the pipe can hold at once
+        int capacity = S_ISFIFO(st.st_mode) ? fcntl(fileno(f), F_GETPIPE_SZ) : -1;
+        if (capacity > 0) {
+            size = capacity;
+        } else
+#endif
+        if (st.st_blksize > 0) {
+            size = (size + st.st_blksize - 1) / st.st_blksize * st.st_blksize;
+        }
+    }
+    errno = e;
+    
+    return MIN(MAX(size, BUF_SIZE), BUF_SIZE_MAX);
+}
+
+byte *buf_alloc(size_t size) {
+    buf_header *header = NULL;
+    size_t total = sizeof(buf_header) + size;
+    
+    // Reuse the first kept buffer which is big enough
+    for (size_t i = 0; buf_reuse && i < BUF_KEEP; i++) {
+        if (buf_kept[i] && buf_kept[i]->size >= total) {
+            header = buf_kept[i];
+            buf_kept[i] = NULL;
+            return (byte *)(header + 1);
+        }
+    }
+
+#ifdef __linux__
+    // Use whole huge pages for large buffers, falling back to asking for
+    // transparent huge pages if none are reserved
+    if (total >= HUGEPAGE_SIZE) {
+        int e = errno;
+        total = (total + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+        void *map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map == MAP_FAILED) {
+            map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+            if (map != MAP_FAILED) {
+                madvise(map, total, MADV_HUGEPAGE);
+            }
+#endif
+        }
+        errno = e;
+        
+        if (map != MAP_FAILED) {
+            header = map;
+            header->mapped = true;
+        }
+    }
+#endif
+
+    if (!header) {
+        total = (total + VEC_ALIGN - 1) / VEC_ALIGN * VEC_ALIGN;
+        if (!(header = aligned_alloc(VEC_ALIGN, total))) {
+            return NULL;
+        }
+        header->mapped = false;
+    }
+    
+    header->size = total;
+    return (byte *)(header + 1);
+}
+
+/* Give the buffer with `header` back to the system. */
+static void buf_destroy(buf_header *header) {
+    if (header->mapped) {
+        munmap(header, header->size);
+    } else {
+        free(header);
+    }
+}
+
+void buf_free(byte *buf) {
+    if (!buf) {
+        return;
+    }
+    
+    buf_header *header = (buf_header *)buf - 1;
+    for (size_t i = 0; buf_reuse && i < BUF_KEEP; i++) {
+        if (!buf_kept[i]) {
+            buf_kept[i] = header;
+            return;
+        }
+    }
+    
+    buf_destroy(header);
+}
+
+void buf_release() {
+    for (size_t i = 0; i < BUF_KEEP; i++) {
+        if (buf_kept[i]) {
+            buf_destroy(buf_kept[i]);
+            buf_kept[i] = NULL;
+        }
+    }
+}
+
+/*
+ * Allocate a buffer for blocks of `f` and put it's size in `size`, or use the
+ * BUFSIZ bytes of `fallback` if one couldn't be allocated.
+ */
+static byte *file_buf(FILE *f, byte *fallback, size_t *size) {
+    *size = buf_size_for(f);
+    byte *buf = buf_alloc(*size);
+    if (!buf) {
+        *size = BUFSIZ;
+        return fallback;
+    }
+    
+    return buf;
+}
+
+/* Free a buffer from file_buf(). */
+static void file_buf_free(byte *buf, byte *fallback) {
+    if (buf != fallback) {
+        buf_free(buf);
+    }
+}
 
 off_t fsize(FILE *f) {
     struct stat st;
@@ -35,32 +194,228 @@ size_t fskip(FILE *f, size_t count) {
     }
     
     // Fallback to consuming bytes
-    byte buf[BUF_SIZE];
-    size_t total = 0, read;
+    byte fallback[BUFSIZ], *buf;
+    size_t buf_len, total = 0, read;
+    buf = file_buf(f, fallback, &buf_len);
+    do {
+        // Read up to buf_len or remaining bytes to skip
+        read = fread(buf, sizeof(byte), MIN(buf_len, count - total), f);
+        total += read;
+    } while (total < count && read > 0);
+    
+    file_buf_free(buf, fallback);
+    return total;
+}
+
+/* Largest amount to ask the kernel to copy at once. */
+#define FCOPY_CHUNK (1 << 30)
+
+/*
+ * Check stdio can't have read ahead of the position of `f`, as it's unbuffered
+ * or hasn't allocated a buffer to read into yet. Unbuffered streams have a
+ * buffer of at most one byte, which stdio only fills when it's asked for.
+ */
+static bool fnoreadahead(FILE *f) {
+    return __fbufsize(f) <= 1;
+}
+
+off_t fcopy(FILE *in, FILE *out, off_t count) {
+    off_t total = 0;
+
+#ifdef __linux__
+    // Let the kernel copy from seekable inputs, flushing output first so it
+    // stays in order with what was already written through stdio
+    int e = errno;
+    off_t in_pos = ftello(in);
+    if (in_pos != -1 && fflush(out) == 0) {
+        // copy_file_range() needs both to be files, sendfile() can write to
+        // anything at the current position of `out`
+        off_t out_pos = ftello(out);
+        bool use_range = out_pos != -1;
+        ssize_t copied = 0;
+        while (total < count) {
+            size_t chunk = MIN(count - total, FCOPY_CHUNK);
+            off_t in_off = in_pos + total, out_off = out_pos + total;
+            if (use_range) {
+                copied = copy_file_range(fileno(in), &in_off, fileno(out), &out_off, chunk, 0);
+                
+                // Not supported between these files, use sendfile from here
+                use_range = copied != -1;
+                if (!use_range && lseek(fileno(out), out_off, SEEK_SET) == -1) {
+                    break;
+                }
+            }
+            if (!use_range) {
+                copied = sendfile(fileno(out), fileno(in), &in_off, chunk);
+            }
+            
+            if (copied <= 0) {
+                break;
+            }
+            total += copied;
+        }
+        
+        // Continue after what was copied, copying the rest through stdio if
+        // the kernel couldn't copy it
+        fseeko(in, in_pos + total, SEEK_SET);
+        if (out_pos != -1) {
+            fseeko(out, out_pos + total, SEEK_SET);
+        }
+        errno = e;
+        
+        if (total == count || copied == 0) {
+            return total;
+        }
+    }
+    
+    // Otherwise splice from pipes, unless stdio has read ahead of them
+    if (in_pos == -1 && fnoreadahead(in) && fflush(out) == 0) {
+        // Writes to files go to the current offset, which stdio has to follow
+        off_t out_pos = ftello(out);
+        ssize_t moved = 0;
+        while (total < count) {
+            moved = splice(fileno(in), NULL, fileno(out), NULL, MIN(count - total, FCOPY_CHUNK), SPLICE_F_MOVE);
+            if (moved <= 0) {
+                break;
+            }
+            total += moved;
+        }
+        
+        if (out_pos != -1) {
+            fseeko(out, out_pos + total, SEEK_SET);
+        }
+        errno = e;
+        
+        if (total == count || moved == 0) {
+            return total;
+        }
+    }
+    errno = e;
+#endif
+
+    // Copy manually
+    byte fallback[BUFSIZ], *buf;
+    size_t size, read;
+    buf = file_buf(in, fallback, &size);
     do {
-        // Read up to BUF_SIZE or remaining bytes to skip
-        read = fread(buf, sizeof(byte), MIN(BUF_SIZE, count - total), f);
+        // Read up to size or remaining bytes to copy
+        read = fread(buf, sizeof(byte), MIN(size, count - total), in);
+        if (fwrite(buf, sizeof(byte), read, out) != read) {
+            break;
+        }
         total += read;
     } while (total < count && read > 0);
     
+    file_buf_free(buf, fallback);
     return total;
 }
 
 size_t fzero(FILE *f, size_t count) {
-    // TODO: Try using fseek to extend file
+    // Leave a hole in regular files instead of writing zeros, unless they're
+    // appended to, which always writes at the end
+    int e = errno, flags;
+    off_t file_size, pos;
+    if (use_sparse && count >= HOLE_MIN && (file_size = fsize(f)) != -1
+            && (flags = fcntl(fileno(f), F_GETFL)) != -1 && !(flags & O_APPEND)
+            && fflush(f) == 0 && (pos = ftello(f)) != -1) {
+        off_t end = pos + count;
+        if ((pos >= file_size || fpunch(f, pos, MIN(end, file_size) - pos))
+                && (end <= file_size || ftruncate(fileno(f), end) == 0)
+                && fseeko(f, end, SEEK_SET) == 0) {
+            errno = e;
+            return count;
+        }
+    }
+    errno = e;
     
     // Write zero bytes manually
-    byte buf[BUF_SIZE] = {0};
-    size_t total = 0, written;
+    byte fallback[BUFSIZ], *buf;
+    size_t size, total = 0, written;
+    buf = file_buf(f, fallback, &size);
+    memset(buf, 0, MIN(size, count));
     do {
-        // Write up to BUF_SIZE or remaining bytes to zero
-        written = fwrite(buf, sizeof(byte), MIN(BUF_SIZE, count - total), f);
+        // Write up to size or remaining bytes to zero
+        written = fwrite(buf, sizeof(byte), MIN(size, count - total), f);
         total += written;
     } while (total < count && written > 0);
     
+    file_buf_free(buf, fallback);
     return total;
 }
 
+off_t fextent(FILE *f, off_t pos, bool *hole) {
+    off_t size = fsize(f);
+    *hole = false;
+    if (size == -1 || pos < 0 || pos >= size) {
+        return -1;
+    }
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    // Seeking moves the file offset, which stdio relies on
+    int fd = fileno(f), e = errno;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    off_t data = lseek(fd, pos, SEEK_DATA), end = size;
+    if (data == -1 && errno == ENXIO) {
+        // Hole to the end of the file
+        *hole = true;
+    } else if (data > pos) {
+        *hole = true;
+        end = data;
+    } else if (data == pos) {
+        off_t next = lseek(fd, pos, SEEK_HOLE);
+        end = next > pos ? MIN(next, size) : size;
+    }
+    
+    lseek(fd, offset, SEEK_SET);
+    errno = e;
+    return end;
+#else
+    return size;
+#endif
+}
+
+bool fsparse(FILE *f) {
+    off_t pos = ftello(f);
+    bool hole;
+    
+    // Either there's a hole here or data up to one before the end
+    off_t end = fextent(f, pos, &hole);
+    return end != -1 && (hole || end < fsize(f));
+}
+
+bool fpunch(FILE *f, off_t offset, off_t length) {
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    int e = errno;
+    bool punched = length == 0 || fallocate(fileno(f), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0;
+    errno = e;
+    return punched;
+#else
+    return false;
+#endif
+}
+
+bool fcollapse(FILE *f, off_t offset, off_t length) {
+#if defined(__linux__) && defined(FALLOC_FL_COLLAPSE_RANGE)
+    int e = errno;
+    bool collapsed = length == 0 || fallocate(fileno(f), FALLOC_FL_COLLAPSE_RANGE, offset, length) == 0;
+    errno = e;
+    return collapsed;
+#else
+    return false;
+#endif
+}
+
+bool finsert(FILE *f, off_t offset, off_t length) {
+#if defined(__linux__) && defined(FALLOC_FL_INSERT_RANGE)
+    int e = errno;
+    bool inserted = length == 0 || fallocate(fileno(f), FALLOC_FL_INSERT_RANGE, offset, length) == 0;
+    errno = e;
+    return inserted;
+#else
+    return false;
+#endif
+}
+
 void *freadall(size_t item_size, size_t *total_items, FILE *f) {
     // Initalise `total_items` to 0
     *total_items = 0;
@@ -71,8 +426,11 @@ void *freadall(size_t item_size, size_t *total_items, FILE *f) {
     }
     
     // Reading buffer
-    size_t read_buf_items = MAX(BUF_SIZE / item_size, 1);
-    byte read_buf[read_buf_items * item_size];
+    size_t read_buf_items = MAX(buf_size_for(f) / item_size, 1);
+    byte *read_buf = buf_alloc(read_buf_items * item_size);
+    if (!read_buf) {
+        return NULL;
+    }
     
     // Output buffer
     size_t out_buf_items = 0;
@@ -87,9 +445,11 @@ void *freadall(size_t item_size, size_t *total_items, FILE *f) {
         
         // Check malloc succeeded
         if (!out_buf) {
+            buf_free(read_buf);
             return NULL;
         }
     }
+    stats.freadall_peak = MAX(stats.freadall_peak, (read_buf_items + out_buf_items) * item_size);
     
     while (true) {
         // Read read_buf_items into read_buf
@@ -109,6 +469,7 @@ void *freadall(size_t item_size, size_t *total_items, FILE *f) {
             }
             
             out_buf = new_out_buf;
+            stats.freadall_peak = MAX(stats.freadall_peak, (read_buf_items + out_buf_items) * item_size);
         }
         
         // Copy items from read_buf to out_buf
@@ -117,12 +478,45 @@ void *freadall(size_t item_size, size_t *total_items, FILE *f) {
         *total_items += read_items;
     }
     
+    buf_free(read_buf);
     return out_buf;
 }
 
+byte *mempattern(const byte *pattern, size_t size, size_t min_size, size_t *total) {
+    if (size == 0) {
+        return NULL;
+    }
+    
+    // Round up to a whole number of aligned blocks
+    *total = min_size + size - 1;
+    byte *buf = aligned_alloc(VEC_ALIGN, (*total + VEC_ALIGN - 1) / VEC_ALIGN * VEC_ALIGN);
+    if (!buf) {
+        return NULL;
+    }
+    
+    // Copy the pattern once then keep doubling what we have
+    size_t filled = MIN(size, *total);
+    memcpy(buf, pattern, filled);
+    while (filled < *total) {
+        size_t copy = MIN(filled, *total - filled);
+        memcpy(buf + filled, buf, copy);
+        filled += copy;
+    }
+    
+    return buf;
+}
+
+void bitshiftl(byte *dst, const byte *src, size_t n, shift bits) {
+    kernels()->shiftl(dst, src, n, bits);
+}
+
+void bitshiftr(byte *dst, const byte *src, size_t n, shift bits) {
+    kernels()->shiftr(dst, src, n, bits);
+}
+
 void memshiftl(byte *buf, size_t size, shift amount) {
     // Check args
-    assert(amount < size * BYTE_BIT);
+    assert(amount <= size * BYTE_BIT);
     if (size == 0 || amount == 0) {
         return;
     }
@@ -131,28 +525,23 @@ void memshiftl(byte *buf, size_t size, shift amount) {
     size_t byte_offset = MIN(amount / BYTE_BIT, size);
     shift bit_offset = amount % BYTE_BIT;
     
-    // Shift left bytes by byte_offset bytes and bit_offset bits
-    for (size_t i = 0; i < size - byte_offset - 1; i++) {
-        // Lower bits of buf[i + byte_offset]
-        byte left = buf[i + byte_offset] << bit_offset;
-        // Upper bits of buf[i + byte_offset + 1]
-        byte right = buf[i + byte_offset + 1] >> (BYTE_BIT - bit_offset);
-        
-        buf[i] = left | right;
+    // Shift the bytes and bits down in one pass, reading ahead of writing
+    if (byte_offset < size) {
+        if (bit_offset) {
+            bitshiftl(buf, buf + byte_offset, size - byte_offset - 1, bit_offset);
+            buf[size - byte_offset - 1] = buf[size - 1] << bit_offset;
+        } else {
+            memmove(buf, buf + byte_offset, size - byte_offset);
+        }
     }
     
-    // Shift last byte by byte_offset bytes and bit_offset bits
-    buf[size - byte_offset - 1] = buf[size - 1] << bit_offset;
-    
     // Zero fill remaining bytes (if there are any)
-    if (byte_offset > 0) {
-        memset(&buf[size - byte_offset], 0, byte_offset);
-    }
+    memset(buf + size - byte_offset, 0, byte_offset);
 }
 
 void memshiftr(byte *buf, size_t size, shift amount) {
     // Check args
-    assert(amount < size * BYTE_BIT);
+    assert(amount <= size * BYTE_BIT);
     if (size == 0 || amount == 0) {
         return;
     }
@@ -161,21 +550,16 @@ void memshiftr(byte *buf, size_t size, shift amount) {
     size_t byte_offset = MIN(amount / BYTE_BIT, size);
     shift bit_offset = amount % BYTE_BIT;
     
-    // Shift right bytes by byte_offset bytes and bit_offset bits
-    for (size_t i = size - 1; i > byte_offset; i--) {
-        // Lower bits of buf[i - byte_offset - 1]
-        byte left = buf[i - byte_offset - 1] << (BYTE_BIT - amount);
-        // Upper bits of buf[i - byte_offset]
-        byte right = buf[i - byte_offset] >> amount;
-        
-        buf[i] = left | right;
+    // Shift the bytes and bits up in one pass, backwards so reads stay ahead
+    if (byte_offset < size) {
+        if (bit_offset) {
+            bitshiftr(buf + byte_offset + 1, buf, size - byte_offset - 1, bit_offset);
+            buf[byte_offset] = buf[0] >> bit_offset;
+        } else {
+            memmove(buf + byte_offset, buf, size - byte_offset);
+        }
     }
     
-    // Shift last byte by byte_offset bytes and bit_offset bits
-    buf[byte_offset] = buf[0] << bit_offset;
-    
     // Zero fill remaining bytes (if there are any)
-    if (byte_offset > 0) {
-        memset(buf, 0, byte_offset);
-    }
+    memset(buf, 0, byte_offset);
 }
@@ -4,20 +4,54 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <limits.h>
+#include <stdbool.h>
 
-// Global application buf size
+// Smallest buffer size chosen by buf_size_for()
 #ifndef BUF_SIZE
 #define BUF_SIZE BUFSIZ
 #endif
 
+// Buffer size chosen by buf_size_for() for files without a larger preference
+#ifndef BUF_SIZE_DEFAULT
+#define BUF_SIZE_DEFAULT (64 * 1024)
+#endif
+
+// Largest buffer size chosen by buf_size_for()
+#ifndef BUF_SIZE_MAX
+#define BUF_SIZE_MAX (16 * 1024 * 1024)
+#endif
+
+// Smallest run of zeros left as a hole in regular files
+#ifndef HOLE_MIN
+#define HOLE_MIN 4096
+#endif
+
+// Number of freed buffers each thread keeps for reuse when buf_reuse is set
+#ifndef BUF_KEEP
+#define BUF_KEEP 8
+#endif
+
+// Size above which memory is advised or allocated to use huge pages
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+// Alignment of buffers used with vector kernels
+#define VEC_ALIGN 64
+
 // Min/max macros
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+// Largest value of off_t
+#define OFF_MAX ((off_t)(UINT64_MAX >> (65 - sizeof(off_t) * CHAR_BIT)))
+
 // Concat macro (works with other macros)
 #define CONCAT(a, b) _CONCAT(a, b)
 #define _CONCAT(a, b) a##b
 
+// Stringify macro (works with other macros)
+#define STRINGIFY(a) _STRINGIFY(a)
+#define _STRINGIFY(a) #a
+
 // Typedef for byte
 #define BYTE_BIT CHAR_BIT
 typedef unsigned char byte;
@@ -26,15 +60,106 @@ _Static_assert(sizeof(byte) == 1, "Byte size is not 1");
 /* Typedef for bit-shift amount. */
 typedef size_t shift;
 
+/*
+ * Size of the buffers used for blocks of data, or 0 to choose a size for each
+ * file with buf_size_for(). Defaults to 0.
+ */
+extern size_t buf_size;
+
+/*
+ * Whether holes in regular files are skipped instead of being read, and runs
+ * of zeros are left as holes instead of being written. Defaults to true.
+ */
+extern bool use_sparse;
+
+/*
+ * Whether buffers freed with buf_free() are kept for reuse by later calls to
+ * buf_alloc() on the same thread, up to BUF_KEEP per thread, instead of being
+ * given back to the system. Saves allocating and faulting in buffers for each
+ * of many small files. Defaults to false.
+ */
+extern bool buf_reuse;
+
+/*
+ * Get the size of buffer to use for blocks of `f`. This is buf_size if it's
+ * set, otherwise the capacity of `f` if it's a pipe, or BUF_SIZE_DEFAULT
+ * rounded up to a multiple of the preferred I/O size of `f`, between BUF_SIZE
+ * and BUF_SIZE_MAX.
+ */
+size_t buf_size_for(FILE *f);
+
+/*
+ * Allocate a buffer of `size` bytes aligned to VEC_ALIGN. Buffers of at least
+ * HUGEPAGE_SIZE are backed by huge pages where possible. Returns NULL if the
+ * buffer couldn't be allocated. The buffer must be freed with buf_free().
+ */
+byte *buf_alloc(size_t size);
+
+/* Free a buffer from buf_alloc(). Does nothing if `buf` is NULL. */
+void buf_free(byte *buf);
+
+/* Free the buffers kept for reuse by the calling thread. */
+void buf_release();
+
 /* Get the total size of `f` if `f` is a regular file, -1 otherwise. */
 off_t fsize(FILE *f);
 
 /* Skip `count` bytes of `f`. Returns the amount of bytes skipped */
 size_t fskip(FILE *f, size_t count);
 
-/* Fill `count` bytes of `f` with zeroes. Returns the amount of bytes zeroed. */
+/*
+ * Copy up to `count` bytes from `in` to `out`. Returns the amount of bytes
+ * copied, which is less than `count` at EOF of `in` or on error, in which case
+ * ferror() will be set on the FILE which failed.
+ * 
+ * If `in` is seekable the copy is done by the kernel with copy_file_range() or
+ * sendfile() where possible, so the data doesn't pass through user space and
+ * may share blocks with `in` on filesystems which support it. Pipes are
+ * spliced from with splice() instead if stdio can't have read ahead of them,
+ * i.e. they're unbuffered or haven't been read from yet.
+ */
+off_t fcopy(FILE *in, FILE *out, off_t count);
+
+/*
+ * Fill `count` bytes of `f` with zeroes. Returns the amount of bytes zeroed.
+ * If use_sparse is set, runs of at least HOLE_MIN zeros in regular files are
+ * left as a hole, by punching out what's already there and extending the
+ * file past its end, instead of being written.
+ */
 size_t fzero(FILE *f, size_t count);
 
+/*
+ * Find the end of the hole or data at offset `pos` of regular file `f`,
+ * setting `hole` if it's a hole. Returns -1 if `f` isn't a regular file or
+ * `pos` is past the end of it. Files on filesystems which don't report holes
+ * are all data.
+ */
+off_t fextent(FILE *f, off_t pos, bool *hole);
+
+/* Returns true if regular file `f` has any holes after its current position. */
+bool fsparse(FILE *f);
+
+/*
+ * Deallocate `length` bytes of regular file `f` from `offset`, so they read as
+ * zeros, without changing its size. Returns false if not supported.
+ */
+bool fpunch(FILE *f, off_t offset, off_t length);
+
+/*
+ * Remove `length` bytes of regular file `f` from `offset`, moving the rest of
+ * the file down without copying it. Returns false if not supported, e.g. if the
+ * range isn't aligned to the filesystem's blocks or reaches the end of `f`.
+ */
+bool fcollapse(FILE *f, off_t offset, off_t length);
+
+/*
+ * Insert a hole of `length` bytes into regular file `f` at `offset`, moving the
+ * rest of the file up without copying it. Returns false if not supported, e.g.
+ * if the range isn't aligned to the filesystem's blocks or `offset` is past the
+ * end of `f`.
+ */
+bool finsert(FILE *f, off_t offset, off_t length);
+
 /*
  * Read as many items of `size` bytes from `f` into a dynamically allocated
  * buffer as possible and return the buffer. The number of items read will be
@@ -46,10 +171,43 @@ size_t fzero(FILE *f, size_t count);
  */
 void *freadall(size_t size, size_t *read, FILE *f);
 
-/* Shift all bits in `buf` by `amount` bits left up to `size` * BYTE_BIT. */
+/*
+ * Allocate a buffer of at least `min_size` + `size` - 1 bytes, aligned to
+ * VEC_ALIGN, and fill it with repeats of the `size` bytes of `pattern`. This
+ * allows a `min_size` block of the repeated pattern to be found at any phase
+ * `p` < `size` at `buf + p`. The total size of the buffer is put in `total`.
+ * 
+ * Returns NULL if the buffer could not be allocated, or if `size` is 0. The
+ * buffer must be freed with free().
+ */
+byte *mempattern(const byte *pattern, size_t size, size_t min_size, size_t *total);
+
+/*
+ * Shift the bits of `n` + 1 bytes from `src` left by `bits` bits, where `bits`
+ * < BYTE_BIT, and put the first `n` bytes in `dst`. I.e. `dst[i]` gets the
+ * lower bits of `src[i]` and the upper bits of `src[i + 1]`. `dst` may overlap
+ * `src` if it starts at or before it.
+ */
+void bitshiftl(byte *dst, const byte *src, size_t n, shift bits);
+
+/*
+ * Shift the bits of `n` + 1 bytes from `src` right by `bits` bits, where `bits`
+ * < BYTE_BIT, and put the last `n` bytes in `dst`. I.e. `dst[i]` gets the
+ * lower bits of `src[i]` and the upper bits of `src[i + 1]`. `dst` may overlap
+ * `src` if it starts at or after it.
+ */
+void bitshiftr(byte *dst, const byte *src, size_t n, shift bits);
+
+/*
+ * Shift all bits in `buf` left by `amount` bits, up to `size` * BYTE_BIT,
+ * shifting in zeros.
+ */
 void memshiftl(byte *buf, size_t size, shift amount);
 
-/* Shift all bits in `buf` by `amount` bits right up to `size` * BYTE_BIT. */
+/*
+ * Shift all bits in `buf` right by `amount` bits, up to `size` * BYTE_BIT,
+ * shifting in zeros.
+ */
 void memshiftr(byte *buf, size_t size, shift amount);
 
 #endif
@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/wait.h>
+#include <check.h>
+#include "test.h"
+
+#define MAP_SIZE 256
+#define DIR_TEMPLATE "/tmp/bw-batch-XXXXXX"
+
+/* Path of the bw executable, next to the test executable. */
+static char bw_path[PATH_MAX];
+/* Directory the jobs run in, removed after each test. */
+static char dir[sizeof(DIR_TEMPLATE)];
+
+// setup/teardown
+
+/* Find bw_path and make an empty dir. */
+void setup_batch() {
+    ssize_t len = readlink("/proc/self/exe", bw_path, sizeof(bw_path) - 1);
+    check_error(len != -1);
+    bw_path[len] = '\0';
+    strcpy(strrchr(bw_path, '/') + 1, "bw");
+    
+    strcpy(dir, DIR_TEMPLATE);
+    check_error(mkdtemp(dir));
+}
+
+/* Remove a file, for nftw(). */
+static int remove_file(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+/* Remove dir and everything in it. */
+void teardown_batch() {
+    nftw(dir, remove_file, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// Helpers
+
+/* Get the path of `name` in dir. */
+static char *path(const char *name) {
+    static char buf[PATH_MAX];
+    snprintf(buf, sizeof(buf), "%s/%s", dir, name);
+    return buf;
+}
+
+/* Write `size` bytes of `data` to `name` in dir. */
+static void write_file(const char *name, const void *data, size_t size) {
+    FILE *f;
+    check_error(f = fopen(path(name), "wb"));
+    check_error(fwrite(data, 1, size, f) == size);
+    check_error(!fclose(f));
+}
+
+/* Assert that `name` in dir holds exactly the `size` bytes of `data`. */
+static void assert_file(const char *name, const void *data, size_t size) {
+    FILE *f = fopen(path(name), "rb");
+    ck_assert_msg(f != NULL, "Expected %s to exist", name);
+    assert_file_mem(f, size, (void *)data);
+    ck_assert_msg(fgetc(f) == EOF, "Expected %s to be %zu bytes", name, size);
+    fclose(f);
+}
+
+/*
+ * Run bw in dir with the NULL terminated arguments in `args` after --batch of
+ * a manifest holding the `size` bytes of `manifest`, and return its exit status.
+ */
+static int run_batch(const char *manifest, size_t size, va_list args) {
+    write_file("manifest", manifest, size);
+    
+    char *argv[16] = { bw_path, "--batch", "manifest" };
+    size_t argc = 3;
+    while ((argv[argc] = va_arg(args, char *))) {
+        argc++;
+    }
+    
+    pid_t pid = fork();
+    check_error(pid != -1);
+    if (!pid) {
+        // Keep the expected errors out of the test output
+        int null = open("/dev/null", O_WRONLY);
+        if (null == -1 || dup2(null, STDERR_FILENO) == -1 || dup2(null, STDOUT_FILENO) == -1 || chdir(dir)) {
+            _exit(127);
+        }
+        execv(bw_path, argv);
+        _exit(127);
+    }
+    
+    int status;
+    check_error(waitpid(pid, &status, 0) == pid);
+    ck_assert_msg(WIFEXITED(status), "Expected bw to exit");
+    ck_assert_msg(WEXITSTATUS(status) != 127, "Couldn't run %s", bw_path);
+    return WEXITSTATUS(status);
+}
+
+/* Run run_batch() with the NULL terminated arguments after `size` bytes of `manifest`. */
+static int run_sized(const char *manifest, size_t size, ...) {
+    va_list args;
+    va_start(args, size);
+    int status = run_batch(manifest, size, args);
+    va_end(args);
+    return status;
+}
+
+/* Run run_batch() with the NULL terminated arguments after the string `manifest`. */
+static int run_manifest(const char *manifest, ...) {
+    va_list args;
+    va_start(args, manifest);
+    int status = run_batch(manifest, strlen(manifest), args);
+    va_end(args);
+    return status;
+}
+
+// Tests
+
+static const byte input[] = { 0x00, 0x0f, 0xf0, 0xff, 0x5a };
+static const byte inverted[] = { 0xff, 0xf0, 0x0f, 0x00, 0xa5 };
+
+START_TEST(test_batch_manifest) {
+    write_file("in", input, sizeof(input));
+    const char *manifest =
+        "# Comment\n"
+        "\n"
+        "not in out1\n"
+        "  xor\t0xff   in\tout2 \r\n"
+        "   \n"
+        "and 0x0f in out3";
+    ck_assert_int_eq(run_manifest(manifest, NULL), 0);
+    
+    byte masked[sizeof(input)];
+    for (size_t i = 0; i < sizeof(input); i++) {
+        masked[i] = input[i] & 0x0f;
+    }
+    assert_file("out1", inverted, sizeof(inverted));
+    assert_file("out2", inverted, sizeof(inverted));
+    assert_file("out3", masked, sizeof(masked));
+}
+END_TEST
+
+START_TEST(test_batch_manifest_invalid) {
+    write_file("in", input, sizeof(input));
+    
+    // Nothing runs if any line is wrong
+    ck_assert_int_eq(run_manifest("not in out1\nxor in out2\n", NULL), 1);
+    ck_assert_int_eq(run_manifest("not in out1\nfoo in out2\n", NULL), 2);
+    ck_assert_int_eq(access(path("out1"), F_OK), -1);
+}
+END_TEST
+
+START_TEST(test_batch_null) {
+    write_file("in put", input, sizeof(input));
+    const char manifest[] = "not\0in put\0out 1\0xor\0" "0xff\0in put\0out\n2";
+    ck_assert_int_eq(run_sized(manifest, sizeof(manifest), "-z", NULL), 0);
+    
+    assert_file("out 1", inverted, sizeof(inverted));
+    assert_file("out\n2", inverted, sizeof(inverted));
+}
+END_TEST
+
+START_TEST(test_batch_in_place) {
+    write_file("in", input, sizeof(input));
+    ck_assert_int_eq(run_manifest("not in in\n", NULL), 0);
+    assert_file("in", inverted, sizeof(inverted));
+}
+END_TEST
+
+START_TEST(test_batch_literals) {
+    write_file("in", input, sizeof(input));
+    const char *manifest =
+        "xor 0x0ff in out1\n"
+        "xor 0b000000011 in out2\n"
+        "xor 0x1ff in out3\n"
+        "xor 0x00ff in out4\n";
+    ck_assert_int_eq(run_manifest(manifest, NULL), 0);
+    
+    // Numbers which fit in a byte are bytes, others are padded to whole bytes
+    byte expected[4][sizeof(input)];
+    for (size_t i = 0; i < sizeof(input); i++) {
+        expected[0][i] = input[i] ^ 0xff;
+        expected[1][i] = input[i] ^ 0x03;
+        expected[2][i] = input[i] ^ (i % 2 ? 0xff : 0x01);
+        expected[3][i] = input[i] ^ (i % 2 ? 0xff : 0x00);
+    }
+    assert_file("out1", expected[0], sizeof(input));
+    assert_file("out2", expected[1], sizeof(input));
+    assert_file("out3", expected[2], sizeof(input));
+    assert_file("out4", expected[3], sizeof(input));
+}
+END_TEST
+
+/* Threads to run the jobs on, for loop tests. */
+static const char *threads[] = { "1", "4" };
+
+START_TEST(test_batch_status) {
+    write_file("in", input, sizeof(input));
+    write_file("other", inverted, sizeof(inverted));
+    const char *t = threads[_i];
+    
+    // Every job runs, and the first to fail in the manifest decides the status
+    ck_assert_int_eq(run_manifest("not in out1\nnot missing out2\ncmp other in out3\n", "--threads", t, NULL), 3);
+    assert_file("out1", inverted, sizeof(inverted));
+    ck_assert_int_eq(run_manifest("cmp other in out1\nnot missing out2\nnot in out3\n", "--threads", t, NULL), 16);
+    assert_file("out3", inverted, sizeof(inverted));
+    ck_assert_int_eq(run_manifest("xor missing in out1\nnot in out2\n", "--threads", t, NULL), 3);
+    ck_assert_int_eq(run_manifest("cmp in in out1\nnot in out2\n", "--threads", t, NULL), 0);
+}
+END_TEST
+
+START_TEST(test_batch_shared) {
+    byte key[] = { 0x01, 0x02, 0x03 };
+    byte table[MAP_SIZE];
+    for (size_t i = 0; i < MAP_SIZE; i++) {
+        table[i] = ~i;
+    }
+    
+    write_file("in", input, sizeof(input));
+    write_file("key", key, sizeof(key));
+    write_file("table", table, sizeof(table));
+    const char *t = threads[_i];
+    
+    // Key is shorter than the input, so only looping uses all of it
+    const char *manifest =
+        "xor key in out1\n"
+        "map table in out2\n"
+        "xor key in out3\n"
+        "map table in out4\n";
+    ck_assert_int_eq(run_manifest(manifest, "--threads", t, "--eof-mode", "loop", NULL), 0);
+    
+    byte looped[sizeof(input)];
+    for (size_t i = 0; i < sizeof(input); i++) {
+        looped[i] = input[i] ^ key[i % sizeof(key)];
+    }
+    assert_file("out1", looped, sizeof(looped));
+    assert_file("out2", inverted, sizeof(inverted));
+    assert_file("out3", looped, sizeof(looped));
+    assert_file("out4", inverted, sizeof(inverted));
+    
+    // Without looping each job reports the short key itself
+    ck_assert_int_eq(run_manifest(manifest, "--threads", t, NULL), 8);
+    assert_file("out2", inverted, sizeof(inverted));
+}
+END_TEST
+
+START_TEST(test_batch_shared_table_invalid) {
+    write_file("in", input, sizeof(input));
+    write_file("short", input, sizeof(input));
+    const char *t = threads[_i];
+    
+    // Jobs using a table which can't be read fail, without stopping the rest
+    const char *manifest =
+        "not in out1\n"
+        "map short in out2\n"
+        "map short in out3\n"
+        "map missing in out4\n";
+    ck_assert_int_eq(run_manifest(manifest, "--threads", t, NULL), 2);
+    assert_file("out1", inverted, sizeof(inverted));
+    
+    ck_assert_int_eq(run_manifest("not in out1\nmap missing in out2\nmap short in out3\n", "--threads", t, NULL), 3);
+    assert_file("out1", inverted, sizeof(inverted));
+}
+END_TEST
+
+Suite *create_batch_suite() {
+    Suite *s = suite_create("batch");
+    
+    {
+        TCase *tc = tcase_create("manifest");
+        tcase_add_checked_fixture(tc, setup_batch, teardown_batch);
+        
+        tcase_add_test(tc, test_batch_manifest);
+        tcase_add_test(tc, test_batch_manifest_invalid);
+        tcase_add_test(tc, test_batch_null);
+        tcase_add_test(tc, test_batch_in_place);
+        tcase_add_test(tc, test_batch_literals);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("jobs");
+        tcase_add_checked_fixture(tc, setup_batch, teardown_batch);
+        
+        tcase_add_loop_test(tc, test_batch_status, 0, 2);
+        tcase_add_loop_test(tc, test_batch_shared, 0, 2);
+        tcase_add_loop_test(tc, test_batch_shared_table_invalid, 0, 2);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    return s;
+}
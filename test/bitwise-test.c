@@ -0,0 +1,1167 @@
+#include "bitwise.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <check.h>
+#include "test.h"
+#include "io.h"
+#include "parallel.h"
+
+#define MAX_COUNT 100000
+#define NCOUNTS (sizeof(counts) / sizeof(*counts))
+
+/* Input counts for repeated tests. Usually used as size of the input file. */
+static const size_t counts[] = {
+    0,
+    1,
+    10,
+    1000,
+    BUF_SIZE - 1,
+    BUF_SIZE,
+    BUF_SIZE + 1,
+    50000,
+    MAX_COUNT,
+};
+
+static FILE *input;
+static FILE *output;
+
+/* Junk written to input. */
+static byte *in_data;
+
+// setup/teardown
+
+/* Setup input filled with MAX_COUNT bytes of junk and an empty output. */
+void setup_files() {
+    check_error(in_data = malloc(MAX_COUNT));
+    create_junk(in_data, MAX_COUNT);
+    
+    check_error(input = tmpfile());
+    check_error(output = tmpfile());
+}
+
+void teardown_files() {
+    fclose(input);
+    fclose(output);
+    free(in_data);
+}
+
+/* Setup buffers of an odd size much smaller than any pattern or operand. */
+void setup_small_buffers() {
+    buf_size = 13;
+}
+
+void teardown_small_buffers() {
+    buf_size = 0;
+}
+
+/* Write the first `n` bytes of in_data to input and rewind it. */
+static void fill_input(size_t n) {
+    check_error(fwrite(in_data, sizeof(byte), n, input) == n);
+    check_error(fseek(input, 0, SEEK_SET) == 0);
+}
+
+/* Rewind output and check it's `n` bytes long and equal to `expected`. */
+static void assert_output(size_t n, byte *expected) {
+    check_error(fflush(output) == 0);
+    ck_assert_int_eq(fsize(output), n);
+    
+    check_error(fseek(output, 0, SEEK_SET) == 0);
+    assert_file_mem(output, n, expected);
+}
+
+// pattern
+
+#define NPATTERN_SIZES (sizeof(pattern_sizes) / sizeof(*pattern_sizes))
+
+/* Sizes of patterns used in pattern tests. */
+static const size_t pattern_sizes[] = {
+    1,
+    2,
+    3,
+    8,
+    13,
+    64,
+    BUF_SIZE + 3,
+};
+
+/* Test xor_pattern with various input and pattern sizes. */
+START_TEST(test_xor_pattern) {
+    size_t n = counts[_i / NPATTERN_SIZES];
+    size_t size = pattern_sizes[_i % NPATTERN_SIZES];
+    
+    byte pattern[size];
+    create_junk(pattern, size);
+    fill_input(n);
+    
+    bw_error e = xor_pattern(input, output, pattern, size);
+    ck_assert_int_eq(e.type, BW_ERR_NONE);
+    
+    // Expected result
+    byte *expected = malloc(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        expected[i] = in_data[i] ^ pattern[i % size];
+    }
+    
+    assert_output(n, expected);
+    free(expected);
+} END_TEST
+
+/* Test and_pattern and or_pattern with a 2 byte pattern. */
+START_TEST(test_and_or_pattern) {
+    size_t n = counts[_i];
+    byte pattern[] = {0x0f, 0xf0};
+    
+    byte *expected = malloc(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        expected[i] = in_data[i] & pattern[i % 2];
+    }
+    
+    fill_input(n);
+    ck_assert_int_eq(and_pattern(input, output, pattern, 2).type, BW_ERR_NONE);
+    assert_output(n, expected);
+    
+    // OR the result with the pattern
+    for (size_t i = 0; i < n; i++) {
+        expected[i] |= pattern[i % 2];
+    }
+    
+    check_error(fseek(output, 0, SEEK_SET) == 0);
+    FILE *result = output;
+    check_error(output = tmpfile());
+    ck_assert_int_eq(or_pattern(result, output, pattern, 2).type, BW_ERR_NONE);
+    fclose(result);
+    assert_output(n, expected);
+    
+    free(expected);
+} END_TEST
+
+/* Test pattern functions with an empty pattern. */
+START_TEST(test_pattern_empty) {
+    fill_input(10);
+    ck_assert_int_eq(xor_pattern(input, output, NULL, 0).type, BW_ERR_OPERAND_EOF);
+} END_TEST
+
+// loop
+
+/* Operand cache limits used in loop tests. */
+static const size_t cache_limits[] = {BW_LOOP_CACHE_LIMIT, 0};
+
+/* Create an operand file containing `key`, using a pipe if `use_pipe`. */
+static FILE *create_operand(byte *key, size_t size, bool use_pipe) {
+    FILE *f;
+    if (use_pipe) {
+        int fds[2];
+        check_error(pipe(fds) == 0);
+        // Keys are small enough to fit in the pipe without blocking
+        check_error(write(fds[1], key, size) == size);
+        close(fds[1]);
+        check_error(f = fdopen(fds[0], "rb"));
+    } else {
+        check_error(f = tmpfile());
+        check_error(fwrite(key, sizeof(byte), size, f) == size);
+        check_error(fseek(f, 0, SEEK_SET) == 0);
+    }
+    
+    return f;
+}
+
+/* Test xor_file with EOF_LOOP, with and without the operand cache. */
+START_TEST(test_xor_file_loop) {
+    size_t n = counts[_i / NPATTERN_SIZES / 2];
+    size_t size = pattern_sizes[_i % NPATTERN_SIZES];
+    bw_loop_cache_limit = cache_limits[(_i / NPATTERN_SIZES) % 2];
+    
+    byte key[size];
+    create_junk(key, size);
+    FILE *operand = create_operand(key, size, false);
+    fill_input(n);
+    
+    ck_assert_int_eq(xor_file(input, output, operand, EOF_LOOP).type, BW_ERR_NONE);
+    
+    byte *expected = malloc(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        expected[i] = in_data[i] ^ key[i % size];
+    }
+    
+    assert_output(n, expected);
+    free(expected);
+    fclose(operand);
+    bw_loop_cache_limit = BW_LOOP_CACHE_LIMIT;
+} END_TEST
+
+/* Test xor_file with EOF_LOOP and a non-seekable operand. */
+START_TEST(test_xor_file_loop_pipe) {
+    size_t n = counts[_i / NPATTERN_SIZES];
+    size_t size = pattern_sizes[_i % NPATTERN_SIZES];
+    
+    byte key[size];
+    create_junk(key, size);
+    FILE *operand = create_operand(key, size, true);
+    fill_input(n);
+    
+    ck_assert_int_eq(xor_file(input, output, operand, EOF_LOOP).type, BW_ERR_NONE);
+    
+    byte *expected = malloc(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        expected[i] = in_data[i] ^ key[i % size];
+    }
+    
+    assert_output(n, expected);
+    free(expected);
+    fclose(operand);
+} END_TEST
+
+/* Test EOF_LOOP with an empty non-seekable operand. */
+START_TEST(test_xor_file_loop_pipe_empty) {
+    FILE *operand = create_operand(NULL, 0, true);
+    fill_input(10);
+    
+    ck_assert_int_eq(xor_file(input, output, operand, EOF_LOOP).type, BW_ERR_OPERAND_EOF);
+    fclose(operand);
+} END_TEST
+
+// shift
+
+#define NAMOUNTS (sizeof(amounts) / sizeof(*amounts))
+
+/* Shift amounts used in shift tests. */
+static const shift amounts[] = {0, 1, 7, 8, 13, 4096 * BYTE_BIT, BUF_SIZE * BYTE_BIT + 3, MAX_COUNT * BYTE_BIT};
+
+/* Get bit `i` of `n` bytes of `buf`, most significant first. */
+static bool get_bit(const byte *buf, size_t n, size_t i) {
+    return i < n * BYTE_BIT && (buf[i / BYTE_BIT] >> (BYTE_BIT - 1 - i % BYTE_BIT)) & 1;
+}
+
+/* Calculate the expected result of shifting `n` bytes of in_data. */
+static byte *expected_shift(size_t n, shift amount, bool left) {
+    byte *expected = calloc(n + 1, 1);
+    for (size_t i = 0; i < n * BYTE_BIT; i++) {
+        bool bit = left ? get_bit(in_data, n, i + amount) : i >= amount && get_bit(in_data, n, i - amount);
+        expected[i / BYTE_BIT] |= bit << (BYTE_BIT - 1 - i % BYTE_BIT);
+    }
+    
+    return expected;
+}
+
+/* Test lshift and rshift with various sizes and amounts, in place or not. */
+START_TEST(test_shift) {
+    size_t n = counts[_i / NAMOUNTS / 4];
+    shift amount = amounts[(_i / 4) % NAMOUNTS];
+    bool left = _i % 2;
+    bool in_place = (_i / 2) % 2;
+    fill_input(n);
+    
+    FILE *out = in_place ? input : output;
+    bw_error e = left ? lshift(input, out, amount) : rshift(input, out, amount);
+    ck_assert_int_eq(e.type, BW_ERR_NONE);
+    
+    byte *expected = expected_shift(n, amount, left);
+    FILE *result = output;
+    output = out;
+    assert_output(n, expected);
+    output = result;
+    free(expected);
+} END_TEST
+
+/* Test rshift from a pipe, which needs output delayed or truncated. */
+START_TEST(test_rshift_pipe) {
+    size_t n = counts[_i / NAMOUNTS / 2] % 50000;
+    shift amount = amounts[(_i / 2) % NAMOUNTS];
+    
+    FILE *pipe_in = create_operand(in_data, n, true);
+    FILE *out = output;
+    if (_i % 2) {
+        // Output to a pipe as well
+        int fds[2];
+        check_error(pipe(fds) == 0);
+        check_error(out = fdopen(fds[1], "wb"));
+        check_error(output = fdopen(fds[0], "rb"));
+    }
+    
+    ck_assert_int_eq(rshift(pipe_in, out, amount).type, BW_ERR_NONE);
+    
+    byte *expected = expected_shift(n, amount, false);
+    if (out != output) {
+        fclose(out);
+        assert_file_mem(output, n, expected);
+        ck_assert_int_eq(fgetc(output), EOF);
+    } else {
+        assert_output(n, expected);
+    }
+    
+    free(expected);
+    fclose(pipe_in);
+} END_TEST
+
+// in place
+
+/* Test xor_byte and xor_file writing in place, mapped and through stdio. */
+START_TEST(test_in_place) {
+    size_t n = counts[_i / 2];
+    io_use_mmap = _i % 2;
+    
+    byte key[] = {0x00, 0x00, 0x5a};
+    FILE *operand = create_operand(key, sizeof(key), false);
+    fill_input(n);
+    
+    // Only every third byte changes
+    ck_assert_int_eq(xor_file(input, input, operand, EOF_LOOP).type, BW_ERR_NONE);
+    ck_assert_int_eq(ftello(input), n);
+    
+    // Undo with a byte operand on every byte
+    check_error(fseek(input, 0, SEEK_SET) == 0);
+    ck_assert_int_eq(xor_byte(input, input, 0xff).type, BW_ERR_NONE);
+    
+    byte *expected = malloc(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        expected[i] = in_data[i] ^ key[i % sizeof(key)] ^ 0xff;
+    }
+    
+    FILE *result = output;
+    output = input;
+    assert_output(n, expected);
+    output = result;
+    
+    free(expected);
+    fclose(operand);
+    io_use_mmap = true;
+} END_TEST
+
+/* Test truncating in place. */
+START_TEST(test_in_place_truncate) {
+    size_t n = counts[_i];
+    
+    byte key[] = {1, 2, 3, 4, 5};
+    FILE *operand = create_operand(key, sizeof(key), false);
+    fill_input(n);
+    
+    ck_assert_int_eq(and_file(input, input, operand, EOF_TRUNCATE).type, BW_ERR_NONE);
+    
+    byte expected[sizeof(key)];
+    for (size_t i = 0; i < MIN(n, sizeof(key)); i++) {
+        expected[i] = in_data[i] & key[i];
+    }
+    
+    FILE *result = output;
+    output = input;
+    assert_output(MIN(n, sizeof(key)), expected);
+    output = result;
+    
+    fclose(operand);
+} END_TEST
+
+// map
+
+/* Test map with a random table. */
+START_TEST(test_map) {
+    size_t n = counts[_i];
+    
+    byte table[BW_MAP_SIZE];
+    create_junk(table, sizeof(table));
+    fill_input(n);
+    
+    ck_assert_int_eq(map(input, output, table).type, BW_ERR_NONE);
+    
+    byte *expected = malloc(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        expected[i] = table[in_data[i]];
+    }
+    
+    assert_output(n, expected);
+    free(expected);
+} END_TEST
+
+// expression
+
+/* Test an expression with every kind of operand. */
+START_TEST(test_expr) {
+    size_t n = counts[_i];
+    
+    byte key[] = {0x12, 0x34, 0x56, 0x78, 0x9a};
+    FILE *operand = create_operand(key, sizeof(key), false);
+    byte pattern[] = {0x7f, 0xfe, 0xf7};
+    byte value = 0x01;
+    bw_step steps[] = {
+        {.op = BW_XOR, .operand = operand, .eof = EOF_LOOP},
+        {.op = BW_AND, .pattern = pattern, .size = sizeof(pattern)},
+        {.op = BW_NOT},
+        {.op = BW_OR, .pattern = &value, .size = 1},
+    };
+    fill_input(n);
+    
+    size_t failed = -1;
+    ck_assert_int_eq(expr(input, output, steps, 4, &failed).type, BW_ERR_NONE);
+    ck_assert_int_eq(failed, -1);
+    
+    byte *expected = malloc(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        expected[i] = ~((in_data[i] ^ key[i % sizeof(key)]) & pattern[i % sizeof(pattern)]) | value;
+    }
+    
+    assert_output(n, expected);
+    free(expected);
+    fclose(operand);
+} END_TEST
+
+/*
+ * Test that runs of constant steps give the same result when folded, both
+ * into an AND and XOR and into a table.
+ */
+START_TEST(test_expr_fold) {
+    size_t n = counts[_i / 2];
+    bool with_table = _i % 2;
+    
+    byte table[BW_MAP_SIZE];
+    create_junk(table, sizeof(table));
+    byte values[] = {0x5a, 0x0f, 0x81};
+    bw_step steps[] = {
+        {.op = BW_XOR, .pattern = &values[0], .size = 1},
+        {.op = BW_AND, .pattern = &values[1], .size = 1},
+        {.op = BW_NOT},
+        {.op = BW_OR, .pattern = &values[2], .size = 1},
+        {.op = BW_MAP, .pattern = table, .size = BW_MAP_SIZE},
+    };
+    size_t count = with_table ? 5 : 4;
+    fill_input(n);
+    
+    size_t failed;
+    ck_assert_int_eq(expr(input, output, steps, count, &failed).type, BW_ERR_NONE);
+    
+    byte *expected = malloc(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        expected[i] = ~((in_data[i] ^ values[0]) & values[1]) | values[2];
+        if (with_table) {
+            expected[i] = table[expected[i]];
+        }
+    }
+    
+    assert_output(n, expected);
+    free(expected);
+} END_TEST
+
+/*
+ * Test that output stops at the first operand to run out, and that the error
+ * is reported for its step.
+ */
+START_TEST(test_expr_eof) {
+    size_t n = counts[_i];
+    
+    byte long_key[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    byte short_key[] = {11, 12, 13, 14, 15};
+    FILE *long_operand = create_operand(long_key, sizeof(long_key), false);
+    FILE *short_operand = create_operand(short_key, sizeof(short_key), false);
+    bw_step steps[] = {
+        {.op = BW_XOR, .operand = long_operand, .eof = EOF_TRUNCATE},
+        {.op = BW_XOR, .operand = short_operand, .eof = EOF_ERROR},
+    };
+    fill_input(n);
+    
+    size_t failed = -1;
+    bw_error error = expr(input, output, steps, 2, &failed);
+    if (n > sizeof(short_key)) {
+        ck_assert_int_eq(error.type, BW_ERR_OPERAND_EOF);
+        ck_assert_int_eq(failed, 1);
+    } else {
+        ck_assert_int_eq(error.type, BW_ERR_NONE);
+    }
+    
+    size_t expected_n = MIN(n, sizeof(short_key));
+    byte expected[sizeof(short_key)];
+    for (size_t i = 0; i < expected_n; i++) {
+        expected[i] = in_data[i] ^ long_key[i] ^ short_key[i];
+    }
+    
+    assert_output(expected_n, expected);
+    fclose(long_operand);
+    fclose(short_operand);
+} END_TEST
+
+/* Test that only the ranges of the input change, to another file and in place. */
+START_TEST(test_expr_ranges) {
+    size_t n = counts[_i / 2];
+    bool in_place = _i % 2;
+    
+    byte key[] = {0x12, 0x34, 0x56, 0x78, 0x9a};
+    FILE *operand = create_operand(key, sizeof(key), false);
+    byte pattern[] = {0x7f, 0xfe, 0xf7};
+    bw_step steps[] = {
+        {.op = BW_XOR, .operand = operand, .eof = EOF_LOOP},
+        {.op = BW_AND, .pattern = pattern, .size = sizeof(pattern)},
+    };
+    bw_range ranges[] = {
+        {.offset = 1, .length = 10},
+        {.offset = 1000, .length = BUF_SIZE + 1},
+        {.offset = 50000, .length = -1},
+    };
+    fill_input(n);
+    
+    FILE *result = in_place ? input : output;
+    size_t failed = -1;
+    ck_assert_int_eq(expr_ranges(input, result, steps, 2, ranges, 3, &failed).type, BW_ERR_NONE);
+    ck_assert_int_eq(failed, -1);
+    
+    byte *expected = malloc(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        bool in_range = (i >= 1 && i < 11) || (i >= 1000 && i < 1000 + BUF_SIZE + 1) || i >= 50000;
+        expected[i] = in_range ? (in_data[i] ^ key[i % sizeof(key)]) & pattern[i % sizeof(pattern)] : in_data[i];
+    }
+    
+    FILE *saved = output;
+    output = result;
+    assert_output(n, expected);
+    output = saved;
+    
+    free(expected);
+    fclose(operand);
+} END_TEST
+
+// reductions
+
+/* Count the bits of `n` bytes of in_data, XORed with `op` if not NULL. */
+static uint64_t count_bits(size_t n, const byte *op) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < n; i++) {
+        bits += __builtin_popcount(op ? in_data[i] ^ op[i] : in_data[i]);
+    }
+    
+    return bits;
+}
+
+/* Test popcount of various sizes, without writing any output. */
+START_TEST(test_popcount) {
+    size_t n = counts[_i];
+    fill_input(n);
+    
+    uint64_t bits;
+    ck_assert_int_eq(popcount(input, &bits).type, BW_ERR_NONE);
+    ck_assert_uint_eq(bits, count_bits(n, NULL));
+    ck_assert_int_eq(ftello(input), n);
+    ck_assert_int_eq(fsize(output), 0);
+} END_TEST
+
+/* Test hamming against a shorter operand with each EOF mode. */
+START_TEST(test_hamming) {
+    eof_mode eof = (eof_mode[]){EOF_ERROR, EOF_TRUNCATE, EOF_LOOP, EOF_ZERO, EOF_ONE}[_i];
+    size_t n = MAX_COUNT, size = BUF_SIZE + 7;
+    fill_input(n);
+    
+    byte *key = malloc(size), *op = malloc(n);
+    create_junk(key, size);
+    for (size_t i = 0; i < n; i++) {
+        op[i] = i < size ? key[i] : eof == EOF_LOOP ? key[i % size] : eof == EOF_ONE ? 0xff : 0;
+    }
+    FILE *operand = create_operand(key, size, false);
+    
+    uint64_t bits;
+    bw_error error = hamming(input, operand, eof, &bits);
+    if (eof == EOF_ERROR) {
+        ck_assert_int_eq(error.type, BW_ERR_OPERAND_EOF);
+    } else {
+        ck_assert_int_eq(error.type, BW_ERR_NONE);
+        ck_assert_uint_eq(bits, count_bits(eof == EOF_TRUNCATE ? size : n, op));
+    }
+    
+    fclose(operand);
+    free(key);
+    free(op);
+} END_TEST
+
+/* Expected results of cmp tests, from flipping `bit` at `offset` of the input or an operand of `size`. */
+#define NCMP_CASES 5
+static const struct {
+    off_t offset;
+    int bit;
+    size_t size;
+} cmp_cases[NCMP_CASES] = {
+    {-1, -1, MAX_COUNT},
+    {0, 7, MAX_COUNT},
+    {BUF_SIZE + 3, 0, MAX_COUNT},
+    {MAX_COUNT - 1, -1, MAX_COUNT - 1},
+    {MAX_COUNT, -1, MAX_COUNT + 1},
+};
+
+/* Test cmp_file finds the first difference, or an operand of another size. */
+START_TEST(test_cmp_file) {
+    size_t n = MAX_COUNT, size = cmp_cases[_i].size;
+    off_t expected = cmp_cases[_i].offset;
+    int expected_bit = cmp_cases[_i].bit;
+    fill_input(n);
+    
+    // Change the expected bit, and a later one which shouldn't be found
+    byte *key = malloc(size);
+    memcpy(key, in_data, MIN(n, size));
+    if (size > n) {
+        key[n] = 0;
+    } else if (expected_bit != -1) {
+        key[expected] ^= 0x80 >> expected_bit;
+        key[n - 1] ^= 0xff;
+    }
+    FILE *operand = create_operand(key, size, false);
+    
+    off_t offset;
+    int bit;
+    ck_assert_int_eq(cmp_file(input, operand, EOF_ERROR, &offset, &bit).type, BW_ERR_NONE);
+    ck_assert_int_eq(offset, expected);
+    ck_assert_int_eq(bit, expected_bit);
+    ck_assert_int_eq(fsize(output), 0);
+    
+    fclose(operand);
+    free(key);
+} END_TEST
+
+/* Test cmp_expr only finds differences in the bits set in a mask. */
+START_TEST(test_cmp_expr_mask) {
+    size_t n = MAX_COUNT;
+    fill_input(n);
+    
+    // Differences in the low bits of every byte and the top bit of the last
+    byte *key = malloc(n);
+    for (size_t i = 0; i < n; i++) {
+        key[i] = in_data[i] ^ (i == n - 1 ? 0x81 : 0x01);
+    }
+    FILE *operand = create_operand(key, n, false);
+    
+    byte mask = 0xfe;
+    bw_step steps[] = {
+        {.op = BW_XOR, .operand = operand, .eof = EOF_ERROR},
+        {.op = BW_AND, .pattern = &mask, .size = 1},
+    };
+    
+    off_t offset;
+    int bit;
+    size_t failed = -1;
+    ck_assert_int_eq(cmp_expr(input, steps, 2, &offset, &bit, &failed).type, BW_ERR_NONE);
+    ck_assert_int_eq(failed, 0);
+    ck_assert_int_eq(offset, n - 1);
+    ck_assert_int_eq(bit, 0);
+    
+    fclose(operand);
+    free(key);
+} END_TEST
+
+// files
+
+#define MAX_OPERANDS 5
+
+/*
+ * Test xor_files with 1 to MAX_OPERANDS operands, the last of which is short
+ * and uses its own EOF mode while the others error at EOF.
+ */
+START_TEST(test_xor_files) {
+    size_t count = _i % MAX_OPERANDS + 1;
+    eof_mode last_eof = (eof_mode[]){EOF_LOOP, EOF_ZERO, EOF_ONE, EOF_TRUNCATE}[_i / MAX_OPERANDS];
+    size_t n = MAX_COUNT, short_n = 777;
+    fill_input(n);
+    
+    FILE *operands[MAX_OPERANDS];
+    eof_mode eofs[MAX_OPERANDS];
+    byte *expected = malloc(n), *data = malloc(n);
+    memcpy(expected, in_data, n);
+    for (size_t i = 0; i < count; i++) {
+        size_t size = i == count - 1 ? short_n : n;
+        create_junk(data, size);
+        operands[i] = create_operand(data, size, false);
+        eofs[i] = i == count - 1 ? last_eof : EOF_ERROR;
+        
+        for (size_t j = 0; j < n; j++) {
+            byte b = j < size ? data[j] : last_eof == EOF_LOOP ? data[j % size] : last_eof == EOF_ONE ? 0xff : 0;
+            expected[j] ^= b;
+        }
+    }
+    
+    size_t failed;
+    ck_assert_int_eq(xor_files(input, output, operands, eofs, count, &failed).type, BW_ERR_NONE);
+    assert_output(last_eof == EOF_TRUNCATE ? short_n : n, expected);
+    
+    for (size_t i = 0; i < count; i++) {
+        fclose(operands[i]);
+    }
+    free(expected);
+    free(data);
+} END_TEST
+
+/* Test and_files gives the index of the operand which was too short. */
+START_TEST(test_and_files_eof) {
+    fill_input(1000);
+    byte data[1000];
+    create_junk(data, sizeof(data));
+    FILE *operands[] = {
+        create_operand(data, 1000, false),
+        create_operand(data, 999, false),
+        create_operand(data, 1000, false),
+    };
+    eof_mode eofs[] = {EOF_ERROR, EOF_ERROR, EOF_ERROR};
+    
+    size_t failed;
+    ck_assert_int_eq(and_files(input, output, operands, eofs, 3, &failed).type, BW_ERR_OPERAND_EOF);
+    ck_assert_uint_eq(failed, 1);
+    
+    for (size_t i = 0; i < 3; i++) {
+        fclose(operands[i]);
+    }
+} END_TEST
+
+// shortcuts
+
+#define NSHORTCUTS (sizeof(shortcuts) / sizeof(*shortcuts))
+
+/* Byte operands which leave an operator as an identity or constant. */
+static const struct {
+    bw_operator op;
+    byte operand;
+} shortcuts[] = {
+    {BW_AND, 0xff},
+    {BW_OR, 0x00},
+    {BW_XOR, 0x00},
+    {BW_AND, 0x00},
+    {BW_OR, 0xff},
+};
+
+/* Apply `op` to `b` with `operand`. */
+static byte apply_op(bw_operator op, byte b, byte operand) {
+    return op == BW_AND ? b & operand : op == BW_OR ? b | operand : b ^ operand;
+}
+
+/* Run the byte function of `op`. */
+static bw_error run_byte(bw_operator op, FILE *in, FILE *out, byte operand) {
+    return op == BW_AND ? and_byte(in, out, operand)
+        : op == BW_OR ? or_byte(in, out, operand)
+        : xor_byte(in, out, operand);
+}
+
+/* Check output is the first `n` bytes of input with `op` applied with `operand`. */
+static void assert_output_op(size_t n, bw_operator op, byte operand) {
+    byte *expected = malloc(n + 1);
+    for (size_t i = 0; i < n; i++) {
+        expected[i] = apply_op(op, in_data[i], operand);
+    }
+    
+    assert_output(n, expected);
+    free(expected);
+}
+
+/* Test identity and constant byte operands, to output and in place. */
+START_TEST(test_byte_shortcut) {
+    size_t n = counts[_i / (NSHORTCUTS * 2)];
+    bw_operator op = shortcuts[(_i / 2) % NSHORTCUTS].op;
+    byte operand = shortcuts[(_i / 2) % NSHORTCUTS].operand;
+    bool in_place = _i % 2;
+    fill_input(n);
+    
+    ck_assert_int_eq(run_byte(op, input, in_place ? input : output, operand).type, BW_ERR_NONE);
+    ck_assert_int_eq(ftello(input), n);
+    
+    FILE *result = output;
+    output = in_place ? input : output;
+    assert_output_op(n, op, operand);
+    output = result;
+} END_TEST
+
+/* Test identity and constant byte operands with a pipe as input. */
+START_TEST(test_byte_shortcut_pipe) {
+    bw_operator op = shortcuts[_i].op;
+    byte operand = shortcuts[_i].operand;
+    FILE *in = create_operand(in_data, 1000, true);
+    
+    ck_assert_int_eq(run_byte(op, in, output, operand).type, BW_ERR_NONE);
+    assert_output_op(1000, op, operand);
+    
+    fclose(in);
+} END_TEST
+
+/* Test a pattern of a repeated byte is the same as the byte. */
+START_TEST(test_pattern_shortcut) {
+    byte pattern[] = {0xff, 0xff, 0xff};
+    fill_input(MAX_COUNT);
+    
+    ck_assert_int_eq(and_pattern(input, output, pattern, sizeof(pattern)).type, BW_ERR_NONE);
+    assert_output_op(MAX_COUNT, BW_AND, 0xff);
+} END_TEST
+
+/*
+ * Test each file function continues with the byte operand given by EOF_ZERO or
+ * EOF_ONE once the operand runs out.
+ */
+START_TEST(test_file_eof_shortcut) {
+    bw_operator ops[] = {BW_AND, BW_OR, BW_XOR};
+    size_t sizes[] = {0, 10, BUF_SIZE + 1};
+    bw_operator op = ops[_i / 6];
+    size_t size = sizes[_i / 2 % 3];
+    eof_mode eof = _i % 2 ? EOF_ONE : EOF_ZERO;
+    
+    byte key[BUF_SIZE + 1];
+    create_junk(key, size);
+    FILE *operand = create_operand(key, size, false);
+    fill_input(MAX_COUNT);
+    
+    bw_error e = op == BW_AND ? and_file(input, output, operand, eof)
+        : op == BW_OR ? or_file(input, output, operand, eof)
+        : xor_file(input, output, operand, eof);
+    ck_assert_int_eq(e.type, BW_ERR_NONE);
+    ck_assert_int_eq(ftello(input), MAX_COUNT);
+    
+    byte *expected = malloc(MAX_COUNT);
+    for (size_t i = 0; i < MAX_COUNT; i++) {
+        expected[i] = apply_op(op, in_data[i], i < size ? key[i] : eof == EOF_ONE ? 0xff : 0);
+    }
+    assert_output(MAX_COUNT, expected);
+    
+    free(expected);
+    fclose(operand);
+} END_TEST
+
+// sparse
+
+#define SPARSE_SIZE (1024 * 1024)
+#define SPARSE_DATA 1000
+
+/*
+ * Make `f` SPARSE_SIZE bytes long with SPARSE_DATA bytes of junk at the start
+ * and at `offset`, leaving holes between, and put the same in `data`.
+ */
+static void fill_sparse(FILE *f, byte *data, off_t offset) {
+    memset(data, 0, SPARSE_SIZE);
+    create_junk(data, SPARSE_DATA);
+    create_junk(data + offset, SPARSE_DATA);
+    
+    check_error(ftruncate(fileno(f), SPARSE_SIZE) == 0);
+    check_error(fwrite(data, sizeof(byte), SPARSE_DATA, f) == SPARSE_DATA);
+    check_error(fseeko(f, offset, SEEK_SET) == 0);
+    check_error(fwrite(data + offset, sizeof(byte), SPARSE_DATA, f) == SPARSE_DATA);
+    check_error(fseek(f, 0, SEEK_SET) == 0);
+}
+
+/*
+ * Test holes in the input and operand are left as holes in the output where
+ * the result is zero, mapped, async, through stdio and with use_sparse unset.
+ */
+START_TEST(test_sparse) {
+    bool file_operand = _i / 4;
+    int mode = _i % 4;
+    io_use_mmap = mode == 0;
+    io_use_async = mode == 1;
+    use_sparse = mode != 3;
+    
+    byte *data = malloc(SPARSE_SIZE), *op_data = malloc(SPARSE_SIZE), *expected = malloc(SPARSE_SIZE);
+    FILE *operand;
+    check_error(operand = tmpfile());
+    fill_sparse(input, data, SPARSE_SIZE * 3 / 4);
+    fill_sparse(operand, op_data, SPARSE_SIZE / 4);
+    
+    // AND with a byte zeroes input holes, XOR with a file zeroes holes in both
+    bw_error error;
+    if (file_operand) {
+        error = xor_file(input, output, operand, EOF_ERROR);
+    } else {
+        error = and_byte(input, output, 0x0f);
+    }
+    ck_assert_int_eq(error.type, BW_ERR_NONE);
+    ck_assert_int_eq(ftello(output), SPARSE_SIZE);
+    for (size_t i = 0; i < SPARSE_SIZE; i++) {
+        expected[i] = file_operand ? data[i] ^ op_data[i] : data[i] & 0x0f;
+    }
+    assert_output(SPARSE_SIZE, expected);
+    
+    // Only check for holes where the filesystem reported the input's
+    bool in_hole, out_hole;
+    fextent(input, SPARSE_SIZE / 2, &in_hole);
+    fextent(output, SPARSE_SIZE / 2, &out_hole);
+    ck_assert(out_hole == (in_hole && use_sparse));
+    
+    free(data);
+    free(op_data);
+    free(expected);
+    fclose(operand);
+    io_use_mmap = true;
+    io_use_async = true;
+    use_sparse = true;
+} END_TEST
+
+// parallel
+
+/* Input size for parallel tests, large enough to be split between threads. */
+#define PARALLEL_COUNT (3 * PARALLEL_CHUNK + 12345)
+#define NPARALLEL_CASES 7
+
+/* Run parallel test case `c` on `in` and `out`. */
+static bw_error run_parallel_case(int c, FILE *in, FILE *out, FILE *operand) {
+    static const byte pattern[] = {1, 2, 3, 4, 5, 6, 7};
+    bw_error error;
+    
+    switch (c) {
+        case 0: return xor_byte(in, out, 0x5a);
+        case 1: return and_pattern(in, out, pattern, sizeof(pattern));
+        case 2: return xor_file(in, out, operand, EOF_LOOP);
+        case 3:
+            bw_loop_cache_limit = 0;
+            error = xor_file(in, out, operand, EOF_LOOP);
+            bw_loop_cache_limit = BW_LOOP_CACHE_LIMIT;
+            return error;
+        case 4: return or_file(in, out, operand, EOF_ZERO);
+        case 5: return xor_file(in, out, operand, EOF_TRUNCATE);
+        default: return and_file(in, out, operand, EOF_ERROR);
+    }
+}
+
+/*
+ * Test that splitting operations between threads gives the same result as
+ * running them serially, to another file and in place.
+ */
+START_TEST(test_parallel) {
+    int c = _i / 2;
+    bool in_place = _i % 2;
+    
+    // Operand ends part way through a chunk
+    FILE *operand;
+    check_error(operand = tmpfile());
+    write_junk(operand, PARALLEL_COUNT / 2 + 3);
+    write_junk(input, PARALLEL_COUNT);
+    
+    check_error(fseek(input, 0, SEEK_SET) == 0);
+    check_error(fseek(operand, 0, SEEK_SET) == 0);
+    bw_error expected = run_parallel_case(c, input, output, operand);
+    off_t expected_pos = ftello(operand);
+    
+    FILE *result = input;
+    if (!in_place) {
+        check_error(result = tmpfile());
+    }
+    
+    check_error(fseek(input, 0, SEEK_SET) == 0);
+    check_error(fseek(operand, 0, SEEK_SET) == 0);
+    parallel_threads = 4;
+    bw_error error = run_parallel_case(c, input, result, operand);
+    parallel_threads = 1;
+    
+    ck_assert_int_eq(error.type, expected.type);
+    ck_assert_int_eq(ftello(result), ftello(output));
+    ck_assert_int_eq(ftello(operand), expected_pos);
+    
+    // Compare the whole result with the serial output
+    size_t n = ftello(output);
+    byte *expected_data = malloc(n + 1);
+    check_error(fseek(output, 0, SEEK_SET) == 0);
+    check_error(fread(expected_data, sizeof(byte), n, output) == n);
+    
+    check_error(fflush(result) == 0);
+    ck_assert_int_eq(fsize(result), n);
+    check_error(fseek(result, 0, SEEK_SET) == 0);
+    assert_file_mem(result, n, expected_data);
+    
+    free(expected_data);
+    if (!in_place) {
+        fclose(result);
+    }
+    fclose(operand);
+} END_TEST
+
+/* Test appending to a file with threads falls back to appending in order. */
+START_TEST(test_parallel_append) {
+    write_junk(input, PARALLEL_COUNT);
+    check_error(fseek(input, 0, SEEK_SET) == 0);
+    check_error(fwrite("bw", 1, 2, output) == 2);
+    check_error(fflush(output) == 0);
+    check_error(fseek(output, 0, SEEK_SET) == 0);
+    check_error(fcntl(fileno(output), F_SETFL, fcntl(fileno(output), F_GETFL) | O_APPEND) == 0);
+    
+    parallel_threads = 4;
+    bw_error error = xor_byte(input, output, 0x5a);
+    parallel_threads = 1;
+    ck_assert_int_eq(error.type, BW_ERR_NONE);
+    
+    // Everything should be after the prefix, in order
+    check_error(fflush(output) == 0);
+    ck_assert_int_eq(fsize(output), PARALLEL_COUNT + 2);
+    byte *expected = malloc(PARALLEL_COUNT);
+    check_error(fseek(input, 0, SEEK_SET) == 0);
+    check_error(fread(expected, 1, PARALLEL_COUNT, input) == PARALLEL_COUNT);
+    for (size_t i = 0; i < PARALLEL_COUNT; i++) {
+        expected[i] ^= 0x5a;
+    }
+    check_error(fseek(output, 0, SEEK_SET) == 0);
+    assert_file_mem(output, 2, "bw");
+    assert_file_mem(output, PARALLEL_COUNT, expected);
+    
+    free(expected);
+} END_TEST
+
+/* Test files bypassing or dropped from the page cache aren't split between threads. */
+START_TEST(test_parallel_page_cache) {
+    write_junk(input, PARALLEL_COUNT);
+    check_error(fseek(input, 0, SEEK_SET) == 0);
+    parallel_job job = {
+        .input = input,
+        .output = output,
+        .byte_kernel = kernels()->xor_byte,
+        .byte_operand = 0x5a,
+    };
+    
+    parallel_threads = 4;
+    io_direct = _i == 0;
+    io_nocache = _i == 1;
+    ck_assert_int_eq(parallel_run(&job), PARALLEL_UNSUPPORTED);
+    parallel_threads = 1;
+    io_direct = io_nocache = false;
+    ck_assert_int_eq(ftello(input), 0);
+    ck_assert_int_eq(fsize(output), 0);
+} END_TEST
+
+/* Test threads sharing work count their own compute time. */
+START_TEST(test_parallel_stats) {
+    write_junk(input, PARALLEL_COUNT);
+    check_error(fseek(input, 0, SEEK_SET) == 0);
+    stats_enabled = true;
+    stats = (bw_stats){0};
+    
+    parallel_threads = 4;
+    ck_assert_int_eq(xor_byte(input, output, 0x5a).type, BW_ERR_NONE);
+    parallel_threads = 1;
+    stats_enabled = false;
+    
+    ck_assert_uint_eq(stats.threads, 4);
+    ck_assert(stats.compute_seconds > 0);
+    ck_assert(stats.input.seconds > 0 && stats.output.seconds > 0);
+} END_TEST
+
+// Suite
+
+Suite *create_bitwise_suite() {
+    Suite *s = suite_create("bitwise");
+    
+    {
+        TCase *tc = tcase_create("pattern");
+        tcase_add_checked_fixture(tc, setup_files, teardown_files);
+        
+        tcase_add_loop_test(tc, test_xor_pattern, 0, NCOUNTS * NPATTERN_SIZES);
+        tcase_add_loop_test(tc, test_and_or_pattern, 0, NCOUNTS);
+        tcase_add_test(tc, test_pattern_empty);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("loop");
+        tcase_add_checked_fixture(tc, setup_files, teardown_files);
+        
+        tcase_add_loop_test(tc, test_xor_file_loop, 0, NCOUNTS * NPATTERN_SIZES * 2);
+        tcase_add_loop_test(tc, test_xor_file_loop_pipe, 0, NCOUNTS * NPATTERN_SIZES);
+        tcase_add_test(tc, test_xor_file_loop_pipe_empty);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("shift");
+        tcase_add_checked_fixture(tc, setup_files, teardown_files);
+        
+        tcase_add_loop_test(tc, test_shift, 0, NCOUNTS * NAMOUNTS * 4);
+        tcase_add_loop_test(tc, test_rshift_pipe, 0, NCOUNTS * NAMOUNTS * 2);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("in place");
+        tcase_add_checked_fixture(tc, setup_files, teardown_files);
+        
+        tcase_add_loop_test(tc, test_in_place, 0, NCOUNTS * 2);
+        tcase_add_loop_test(tc, test_in_place_truncate, 0, NCOUNTS);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("map");
+        tcase_add_checked_fixture(tc, setup_files, teardown_files);
+        
+        tcase_add_loop_test(tc, test_map, 0, NCOUNTS);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("expression");
+        tcase_add_checked_fixture(tc, setup_files, teardown_files);
+        
+        tcase_add_loop_test(tc, test_expr, 0, NCOUNTS);
+        tcase_add_loop_test(tc, test_expr_eof, 0, NCOUNTS);
+        tcase_add_loop_test(tc, test_expr_fold, 0, NCOUNTS * 2);
+        tcase_add_loop_test(tc, test_expr_ranges, 0, NCOUNTS * 2);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("small buffers");
+        tcase_add_checked_fixture(tc, setup_files, teardown_files);
+        tcase_add_checked_fixture(tc, setup_small_buffers, teardown_small_buffers);
+        
+        tcase_add_loop_test(tc, test_xor_pattern, 0, NCOUNTS * NPATTERN_SIZES);
+        tcase_add_loop_test(tc, test_xor_file_loop, 0, NCOUNTS * NPATTERN_SIZES * 2);
+        tcase_add_loop_test(tc, test_shift, 0, NCOUNTS * NAMOUNTS * 4);
+        tcase_add_loop_test(tc, test_expr, 0, NCOUNTS);
+        tcase_add_loop_test(tc, test_expr_ranges, 0, NCOUNTS * 2);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("reductions");
+        tcase_add_checked_fixture(tc, setup_files, teardown_files);
+        
+        tcase_add_loop_test(tc, test_popcount, 0, NCOUNTS);
+        tcase_add_loop_test(tc, test_hamming, 0, 5);
+        tcase_add_loop_test(tc, test_cmp_file, 0, NCMP_CASES);
+        tcase_add_test(tc, test_cmp_expr_mask);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("files");
+        tcase_add_checked_fixture(tc, setup_files, teardown_files);
+        
+        tcase_add_loop_test(tc, test_xor_files, 0, MAX_OPERANDS * 4);
+        tcase_add_test(tc, test_and_files_eof);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("shortcuts");
+        tcase_add_checked_fixture(tc, setup_files, teardown_files);
+        
+        tcase_add_loop_test(tc, test_byte_shortcut, 0, NCOUNTS * NSHORTCUTS * 2);
+        tcase_add_loop_test(tc, test_byte_shortcut_pipe, 0, NSHORTCUTS);
+        tcase_add_test(tc, test_pattern_shortcut);
+        tcase_add_loop_test(tc, test_file_eof_shortcut, 0, 3 * 3 * 2);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("sparse");
+        tcase_add_checked_fixture(tc, setup_files, teardown_files);
+        
+        tcase_add_loop_test(tc, test_sparse, 0, 2 * 4);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("parallel");
+        tcase_add_checked_fixture(tc, setup_files, teardown_files);
+        
+        tcase_add_loop_test(tc, test_parallel, 0, NPARALLEL_CASES * 2);
+        tcase_add_test(tc, test_parallel_append);
+        tcase_add_loop_test(tc, test_parallel_page_cache, 0, 2);
+        tcase_add_test(tc, test_parallel_stats);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    return s;
+}
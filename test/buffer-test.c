@@ -0,0 +1,244 @@
+#include "buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "test.h"
+#include "bitwise.h"
+
+#define MAX_SIZE 10000
+#define NSIZES (sizeof(sizes) / sizeof(*sizes))
+#define NAMOUNTS (sizeof(amounts) / sizeof(*amounts))
+
+/* Buffer sizes for repeated tests. */
+static const size_t sizes[] = {0, 1, 2, 7, 100, 4097, MAX_SIZE};
+
+/* Shift amounts for repeated tests. */
+static const shift amounts[] = {0, 1, 7, 8, 9, 63, 800, 80001};
+
+/* Block sizes streams are fed in. */
+static const size_t blocks[] = {1, 3, 100, MAX_SIZE};
+
+static byte *src, *dst, *expected;
+
+// setup/teardown
+
+/* Setup src filled with MAX_SIZE bytes of junk, and empty dst and expected. */
+void setup_buffers() {
+    check_error(src = malloc(MAX_SIZE));
+    check_error(dst = malloc(MAX_SIZE));
+    check_error(expected = malloc(MAX_SIZE));
+    create_junk(src, MAX_SIZE);
+}
+
+void teardown_buffers() {
+    free(src);
+    free(dst);
+    free(expected);
+}
+
+// pattern
+
+/* Test patterns of each size from each phase, continuing across calls. */
+START_TEST(test_pattern) {
+    size_t sizes[] = {1, 2, 3, 64, 2049, 5000};
+    size_t size = sizes[_i];
+    byte pattern[5000];
+    create_junk(pattern, size);
+    
+    for (size_t start = 0; start < MIN(size, 5); start++) {
+        for (size_t i = 0; i < MAX_SIZE; i++) {
+            expected[i] = src[i] ^ pattern[(start + i) % size];
+        }
+        
+        // Split into uneven calls, continuing from the returned phase
+        size_t phase = start;
+        for (size_t i = 0, n = 1; i < MAX_SIZE; i += n, n = n * 3 + 1) {
+            n = MIN(n, MAX_SIZE - i);
+            phase = bw_xor_pattern(dst + i, src + i, n, pattern, size, phase);
+            ck_assert_uint_lt(phase, size);
+        }
+        ck_assert_mem_eq(dst, expected, MAX_SIZE);
+    }
+} END_TEST
+
+// shift
+
+/* Get bit `i` of `buf`, counting from the most significant bit. */
+static bool get_bit(const byte *buf, size_t i) {
+    return (buf[i / BYTE_BIT] >> (BYTE_BIT - 1 - i % BYTE_BIT)) & 1;
+}
+
+/* Shift `n` bytes of src left or right into expected a bit at a time. */
+static void ref_shift(size_t n, bool left, shift amount) {
+    memset(expected, 0, n);
+    for (size_t i = 0; i < n * BYTE_BIT; i++) {
+        size_t from = left ? i + amount : i - amount;
+        bool bit = left ? from < n * BYTE_BIT && get_bit(src, from) : i >= amount && get_bit(src, from);
+        expected[i / BYTE_BIT] |= bit << (BYTE_BIT - 1 - i % BYTE_BIT);
+    }
+}
+
+/* Test shifting whole buffers each way by each amount. */
+START_TEST(test_shift_buf) {
+    size_t n = sizes[_i / (2 * NAMOUNTS)];
+    bool left = (_i / NAMOUNTS) % 2;
+    shift amount = amounts[_i % NAMOUNTS];
+    
+    ref_shift(n, left, amount);
+    (left ? bw_lshift_buf : bw_rshift_buf)(dst, src, n, amount);
+    ck_assert_mem_eq(dst, expected, n);
+} END_TEST
+
+/* Test shifting a stream fed in blocks of different sizes. */
+START_TEST(test_shift_stream) {
+    size_t n = sizes[_i / (2 * NAMOUNTS)];
+    bool left = (_i / NAMOUNTS) % 2;
+    shift amount = amounts[_i % NAMOUNTS];
+    ref_shift(n, left, amount);
+    
+    for (size_t b = 0; b < sizeof(blocks) / sizeof(*blocks); b++) {
+        bw_shift_stream s;
+        ck_assert(bw_shift_open(&s, left, amount));
+        
+        size_t out = 0;
+        byte *tail = malloc(amount / BYTE_BIT + 1);
+        for (size_t i = 0, block; i < n; i += block) {
+            block = MIN(blocks[b], n - i);
+            out += bw_shift_next(&s, dst + out, src + i, block);
+            ck_assert_uint_le(out, i + block);
+        }
+        size_t finished = bw_shift_finish(&s, tail);
+        ck_assert_uint_eq(out + finished, n);
+        memcpy(dst + out, tail, finished);
+        free(tail);
+        bw_shift_close(&s);
+        
+        ck_assert_mem_eq(dst, expected, n);
+    }
+} END_TEST
+
+// stream
+
+/* Test a stream with a pattern, a folded run and a looped operand file. */
+START_TEST(test_stream) {
+    size_t block = blocks[_i];
+    const byte pattern[] = {0x12, 0x34, 0x56};
+    const byte and_mask = 0xf0, or_mask = 0x01;
+    
+    FILE *operand;
+    check_error(operand = tmpfile());
+    write_junk(operand, 1000);
+    rewind(operand);
+    byte op_data[1000];
+    check_error(fread(op_data, 1, 1000, operand) == 1000);
+    rewind(operand);
+    
+    bw_step steps[] = {
+        {.op = BW_XOR, .pattern = pattern, .size = sizeof(pattern)},
+        {.op = BW_AND, .pattern = &and_mask, .size = 1},
+        {.op = BW_NOT},
+        {.op = BW_OR, .operand = operand, .eof = EOF_LOOP},
+        {.op = BW_OR, .pattern = &or_mask, .size = 1},
+    };
+    for (size_t i = 0; i < MAX_SIZE; i++) {
+        expected[i] = (~((src[i] ^ pattern[i % 3]) & and_mask) | op_data[i % 1000]) | or_mask;
+    }
+    
+    bw_error error;
+    size_t failed;
+    bw_stream *s = bw_stream_open(steps, sizeof(steps) / sizeof(*steps), &error, &failed);
+    ck_assert_ptr_nonnull(s);
+    for (size_t i = 0, n; i < MAX_SIZE; i += n) {
+        n = MIN(block, MAX_SIZE - i);
+        // Alternate between in place and separate buffers
+        byte *out = i % 2 ? dst + i : memcpy(dst + i, src + i, n);
+        size_t expected_n = n;
+        ck_assert_int_eq(bw_stream_next(s, out, i % 2 ? src + i : out, &n, &failed).type, BW_ERR_NONE);
+        ck_assert_uint_eq(n, expected_n);
+    }
+    bw_stream_close(s);
+    fclose(operand);
+    
+    ck_assert_mem_eq(dst, expected, MAX_SIZE);
+} END_TEST
+
+/* Test a stream stops at the end of a truncated operand. */
+START_TEST(test_stream_truncate) {
+    FILE *operand;
+    check_error(operand = tmpfile());
+    write_junk(operand, 1000);
+    rewind(operand);
+    
+    bw_step step = {.op = BW_XOR, .operand = operand, .eof = EOF_TRUNCATE};
+    bw_error error;
+    size_t failed;
+    bw_stream *s = bw_stream_open(&step, 1, &error, &failed);
+    ck_assert_ptr_nonnull(s);
+    
+    size_t n = 600;
+    ck_assert_int_eq(bw_stream_next(s, dst, src, &n, &failed).type, BW_ERR_NONE);
+    ck_assert_uint_eq(n, 600);
+    n = 600;
+    ck_assert_int_eq(bw_stream_next(s, dst, src, &n, &failed).type, BW_ERR_NONE);
+    ck_assert_uint_eq(n, 400);
+    n = 600;
+    ck_assert_int_eq(bw_stream_next(s, dst, src, &n, &failed).type, BW_ERR_NONE);
+    ck_assert_uint_eq(n, 0);
+    
+    bw_stream_close(s);
+    fclose(operand);
+} END_TEST
+
+/* Test opening a stream with a bad step fails and gives the step. */
+START_TEST(test_stream_error) {
+    byte table[BW_MAP_SIZE - 1] = {0};
+    bw_step steps[] = {
+        {.op = BW_NOT},
+        {.op = BW_MAP, .pattern = table, .size = sizeof(table)},
+    };
+    
+    bw_error error;
+    size_t failed;
+    ck_assert_ptr_null(bw_stream_open(steps, 2, &error, &failed));
+    ck_assert_int_eq(error.type, BW_ERR_OPERAND_EOF);
+    ck_assert_uint_eq(failed, 1);
+} END_TEST
+
+// Suite
+
+Suite *create_buffer_suite() {
+    Suite *s = suite_create("buffer");
+    
+    {
+        TCase *tc = tcase_create("pattern");
+        tcase_add_checked_fixture(tc, setup_buffers, teardown_buffers);
+        
+        tcase_add_loop_test(tc, test_pattern, 0, 6);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("shift");
+        tcase_add_checked_fixture(tc, setup_buffers, teardown_buffers);
+        
+        tcase_add_loop_test(tc, test_shift_buf, 0, NSIZES * 2 * NAMOUNTS);
+        tcase_add_loop_test(tc, test_shift_stream, 0, NSIZES * 2 * NAMOUNTS);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("stream");
+        tcase_add_checked_fixture(tc, setup_buffers, teardown_buffers);
+        
+        tcase_add_loop_test(tc, test_stream, 0, sizeof(blocks) / sizeof(*blocks));
+        tcase_add_test(tc, test_stream_truncate);
+        tcase_add_test(tc, test_stream_error);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    return s;
+}
@@ -4,6 +4,11 @@
 #include <check.h>
 
 Suite *create_utils_suite();
+Suite *create_kernel_suite();
+Suite *create_bitwise_suite();
+Suite *create_io_suite();
+Suite *create_buffer_suite();
+Suite *create_batch_suite();
 
 int main() {
     // Seed rand
@@ -12,6 +17,11 @@ int main() {
     // Create suites
     Suite *suites[] = {
         create_utils_suite(),
+        create_kernel_suite(),
+        create_bitwise_suite(),
+        create_io_suite(),
+        create_buffer_suite(),
+        create_batch_suite(),
     };
     
     // Create runner
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+
+#include "io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <check.h>
+#include "test.h"
+
+#define MAX_COUNT (MAP_BLOCK * 2 + 3)
+#define NCOUNTS (sizeof(counts) / sizeof(*counts))
+
+/* Input counts for repeated tests. Usually used as size of the test file. */
+static const size_t counts[] = {
+    0,
+    1,
+    BUF_SIZE,
+    BUF_SIZE + 1,
+    MAP_BLOCK + 1,
+    MAX_COUNT,
+};
+
+static FILE *file;
+static byte *data;
+
+// setup/teardown
+
+/* Setup file filled with MAX_COUNT bytes of junk, also kept in data. */
+void setup_io() {
+    check_error(data = malloc(MAX_COUNT));
+    create_junk(data, MAX_COUNT);
+    
+    check_error(file = tmpfile());
+    check_error(fwrite(data, sizeof(byte), MAX_COUNT, file) == MAX_COUNT);
+    check_error(fseek(file, 0, SEEK_SET) == 0);
+}
+
+void teardown_io() {
+    fclose(file);
+    free(data);
+    io_use_mmap = true;
+    io_use_async = true;
+    aio_use_uring = true;
+    io_direct = false;
+    io_nocache = false;
+    io_vmsplice = false;
+    stats_enabled = false;
+    stats = (bw_stats){0};
+}
+
+#define NIO_MODES 6
+
+/*
+ * Use stdio, mapping, async with io_uring, async with a thread, O_DIRECT or
+ * dropping from the page cache for regular files, depending on `mode`.
+ */
+static void set_io_mode(int mode) {
+    io_use_mmap = mode == 1;
+    io_use_async = mode >= 2 && mode <= 3;
+    aio_use_uring = mode != 3;
+    io_direct = mode == 4;
+    io_nocache = mode == 5;
+}
+
+// reader
+
+/* Read all of `r` in blocks of `n` and check it matches data from `start`. */
+static void assert_reader(bw_reader *r, size_t start, size_t n) {
+    byte *buf = malloc(n);
+    size_t total = 0, read;
+    
+    do {
+        const byte *next = reader_next(r, buf, n, &read);
+        ck_assert_mem_eq(next, data + start + total, read);
+        total += read;
+    } while (read == n);
+    
+    ck_assert(r->eof);
+    ck_assert(!r->error);
+    ck_assert_uint_eq(total, MAX_COUNT - start);
+    free(buf);
+}
+
+/* Test reading a file from various positions in each I/O mode. */
+START_TEST(test_reader) {
+    size_t start = counts[_i / NIO_MODES];
+    set_io_mode(_i % NIO_MODES);
+    check_error(fseek(file, start, SEEK_SET) == 0);
+    
+    bw_reader r;
+    reader_open(&r, file);
+    ck_assert(io_use_mmap == (r.map != NULL));
+    ck_assert((io_use_async || io_direct || io_nocache) == (r.aio != NULL));
+    ck_assert_int_eq(reader_remaining(&r), MAX_COUNT - start);
+    
+    assert_reader(&r, start, BUF_SIZE);
+    // O_DIRECT is only ever turned on for a descriptor of the aio's own
+    ck_assert(!(fcntl(fileno(file), F_GETFL) & O_DIRECT));
+    
+    // Rewind and read again
+    ck_assert(reader_rewind(&r));
+    assert_reader(&r, 0, MAP_BLOCK);
+    
+    // FILE should be left at EOF, and usable with stdio again
+    reader_close(&r);
+    ck_assert_int_eq(ftello(file), MAX_COUNT);
+    ck_assert(!(fcntl(fileno(file), F_GETFL) & O_DIRECT));
+} END_TEST
+
+/* Test skipping and stopping part way through a file in each I/O mode. */
+START_TEST(test_reader_skip) {
+    size_t n = counts[_i / NIO_MODES];
+    set_io_mode(_i % NIO_MODES);
+    
+    bw_reader r;
+    reader_open(&r, file);
+    
+    // Skip within and past what has been read
+    byte buf[BUF_SIZE];
+    ck_assert_uint_eq(reader_read(&r, buf, 1), 1);
+    ck_assert_uint_eq(reader_skip(&r, n), MIN(n, MAX_COUNT - 1));
+    ck_assert_int_eq(reader_tell(&r), MIN(n + 1, MAX_COUNT));
+    
+    size_t read = reader_read(&r, buf, BUF_SIZE);
+    ck_assert_uint_eq(read, MIN(BUF_SIZE, MAX_COUNT - MIN(n + 1, MAX_COUNT)));
+    ck_assert_mem_eq(buf, data + MIN(n + 1, MAX_COUNT), read);
+    
+    // FILE should be left after what was read, not what was read ahead
+    reader_close(&r);
+    ck_assert_int_eq(ftello(file), MIN(n + 1, MAX_COUNT) + read);
+} END_TEST
+
+/* Test reading from a pipe. */
+START_TEST(test_reader_pipe) {
+    int fds[2];
+    check_error(pipe(fds) == 0);
+    check_error(write(fds[1], data, BUF_SIZE) == BUF_SIZE);
+    close(fds[1]);
+    
+    FILE *f = fdopen(fds[0], "rb");
+    bw_reader r;
+    reader_open(&r, f);
+    ck_assert_ptr_null(r.map);
+    ck_assert_int_eq(reader_remaining(&r), -1);
+    
+    byte buf[BUF_SIZE + 1];
+    size_t read;
+    ck_assert_ptr_eq(reader_next(&r, buf, sizeof(buf), &read), buf);
+    ck_assert_uint_eq(read, BUF_SIZE);
+    ck_assert(r.eof);
+    ck_assert_mem_eq(buf, data, BUF_SIZE);
+    
+    ck_assert(!reader_rewind(&r));
+    
+    reader_close(&r);
+    fclose(f);
+} END_TEST
+
+/*
+ * Test reading several times AIO_DEPTH blocks asynchronously, letting the
+ * read-ahead finish first so finished blocks aren't mistaken for returned
+ * ones, with io_uring or a thread depending on `_i`.
+ */
+START_TEST(test_aio_read_ahead) {
+    aio_use_uring = !_i;
+    size_t size = 4 * AIO_DEPTH * AIO_BLOCK + 123;
+    byte *junk = malloc(size);
+    create_junk(junk, size);
+    
+    FILE *f;
+    check_error(f = tmpfile());
+    check_error(fwrite(junk, 1, size, f) == size);
+    check_error(fflush(f) == 0);
+    
+    bw_aio *aio = aio_open_read(fileno(f), 0, 0);
+    ck_assert(aio != NULL);
+    usleep(100 * 1000);
+    
+    size_t total = 0;
+    ssize_t n;
+    byte *block;
+    while ((n = aio_read(aio, &block)) > 0) {
+        ck_assert_uint_le(total + n, size);
+        ck_assert_mem_eq(block, junk + total, n);
+        total += n;
+    }
+    ck_assert_int_eq(n, 0);
+    ck_assert_uint_eq(total, size);
+    
+    ck_assert(aio_close(aio));
+    fclose(f);
+    free(junk);
+} END_TEST
+
+// writer
+
+/* Write `n` bytes of data to `w` in blocks of up to `block`. */
+static void write_data(bw_writer *w, size_t n, size_t block) {
+    size_t total = 0;
+    while (total < n) {
+        size_t reserved = MIN(block, n - total);
+        byte *dst = writer_reserve(w, &reserved);
+        ck_assert_uint_gt(reserved, 0);
+        memcpy(dst, data + total, reserved);
+        ck_assert(writer_commit(w, reserved));
+        total += reserved;
+    }
+}
+
+/*
+ * Test writing with the size known, unknown, under and over estimated, in
+ * each I/O mode.
+ */
+START_TEST(test_writer) {
+    size_t n = counts[_i / (4 * NIO_MODES)];
+    off_t sizes[] = {n, -1, n / 2, n * 2};
+    off_t size = sizes[(_i / NIO_MODES) % 4];
+    set_io_mode(_i % NIO_MODES);
+    
+    FILE *out;
+    check_error(out = tmpfile());
+    // Start part way into the file to check unaligned mappings
+    check_error(fwrite("bw", 1, 2, out) == 2);
+    
+    bw_writer w;
+    writer_open(&w, out, size, NULL);
+    ck_assert(w.map == NULL || io_use_mmap);
+    ck_assert(w.aio == NULL || io_use_async || io_direct || io_nocache);
+    write_data(&w, n, MAP_BLOCK);
+    ck_assert(writer_close(&w));
+    
+    // Output should be exactly what was written, after the prefix
+    ck_assert_int_eq(ftello(out), n + 2);
+    check_error(fflush(out) == 0);
+    ck_assert_int_eq(fsize(out), n + 2);
+    check_error(fseek(out, 2, SEEK_SET) == 0);
+    assert_file_mem(out, n, data);
+    
+    fclose(out);
+} END_TEST
+
+/* Test appending to a file which already has something in it, in each I/O mode. */
+START_TEST(test_writer_append) {
+    size_t n = counts[_i / NIO_MODES];
+    set_io_mode(_i % NIO_MODES);
+    
+    FILE *out;
+    check_error(out = tmpfile());
+    check_error(fwrite("bw", 1, 2, out) == 2);
+    check_error(fflush(out) == 0);
+    // Like opening with "a+", the position stays where it was until written
+    check_error(fseek(out, 0, SEEK_SET) == 0);
+    check_error(fcntl(fileno(out), F_SETFL, fcntl(fileno(out), F_GETFL) | O_APPEND) == 0);
+    
+    bw_writer w;
+    writer_open(&w, out, n, NULL);
+    ck_assert(w.map == NULL && w.aio == NULL);
+    write_data(&w, n, MAP_BLOCK);
+    ck_assert(writer_close(&w));
+    
+    // Output should be appended after the prefix
+    check_error(fflush(out) == 0);
+    ck_assert_int_eq(fsize(out), n + 2);
+    check_error(fseek(out, 0, SEEK_SET) == 0);
+    assert_file_mem(out, 2, "bw");
+    assert_file_mem(out, n, data);
+    
+    fclose(out);
+} END_TEST
+
+/* Read everything from the pipe `fd` into a new buffer of MAX_COUNT + 1 bytes. */
+static void *read_pipe(void *fd) {
+    byte *buf = malloc(MAX_COUNT + 1);
+    size_t total = 0;
+    ssize_t n;
+    while ((n = read((intptr_t)fd, buf + total, MAX_COUNT + 1 - total)) > 0) {
+        total += n;
+    }
+    
+    ck_assert_uint_eq(total, MAX_COUNT);
+    return buf;
+}
+
+/* Test writing to a pipe with vmsplice(), while something reads it. */
+START_TEST(test_writer_vmsplice) {
+    io_vmsplice = true;
+    int fds[2];
+    check_error(pipe(fds) == 0);
+    pthread_t reader;
+    check_error(pthread_create(&reader, NULL, read_pipe, (void *)(intptr_t)fds[0]) == 0);
+    
+    FILE *out = fdopen(fds[1], "wb");
+    check_error(fputc(data[0], out) != EOF);
+    bw_writer w;
+    writer_open(&w, out, -1, NULL);
+    ck_assert(w.gift != NULL);
+    
+    // Continue after what stdio already buffered, in blocks which don't line
+    // up with the ring
+    for (size_t total = 1, reserved; total < MAX_COUNT; total += reserved) {
+        reserved = MIN(BUF_SIZE - 1, MAX_COUNT - total);
+        byte *dst = writer_reserve(&w, &reserved);
+        memcpy(dst, data + total, reserved);
+        ck_assert(writer_commit(&w, reserved));
+    }
+    ck_assert(writer_close(&w));
+    fclose(out);
+    
+    byte *buf;
+    pthread_join(reader, (void **)&buf);
+    ck_assert_mem_eq(buf, data, MAX_COUNT);
+    
+    free(buf);
+    close(fds[0]);
+} END_TEST
+
+/* Splice everything from the pipe fds[0] on to the pipe fds[1], without reading it. */
+static void *splice_pipe(void *fds) {
+    int *ends = fds;
+    ssize_t n;
+    while ((n = splice(ends[0], NULL, ends[1], NULL, MAP_BLOCK, 0)) > 0 || (n == -1 && errno == EINTR));
+    
+    ck_assert_int_eq(n, 0);
+    return NULL;
+}
+
+/*
+ * Test blocks given with vmsplice() aren't changed by the blocks after them,
+ * while they're still in another pipe they were spliced on to.
+ */
+START_TEST(test_writer_vmsplice_spliced) {
+    io_vmsplice = true;
+    size_t size = MAP_BLOCK / 2;
+    int in[2], out[2];
+    check_error(pipe(in) == 0);
+    check_error(pipe(out) == 0);
+    check_error(fcntl(out[1], F_SETPIPE_SZ, MAP_BLOCK) != -1);
+    
+    // Blocks are as big as the pipe, so there are several of them
+    int ends[] = { in[0], out[1] };
+    pthread_t splicer;
+    check_error(pthread_create(&splicer, NULL, splice_pipe, ends) == 0);
+    
+    FILE *f = fdopen(in[1], "wb");
+    bw_writer w;
+    writer_open(&w, f, -1, NULL);
+    ck_assert(w.gift != NULL);
+    ck_assert_uint_lt(w.gift_size, size);
+    for (size_t total = 0, reserved; total < size; total += reserved) {
+        reserved = MIN(BUF_SIZE, size - total);
+        byte *dst = writer_reserve(&w, &reserved);
+        memcpy(dst, data + total, reserved);
+        ck_assert(writer_commit(&w, reserved));
+    }
+    ck_assert(writer_close(&w));
+    fclose(f);
+    pthread_join(splicer, NULL);
+    close(in[0]);
+    close(out[1]);
+    
+    // Everything is only read once it's all been written
+    byte *buf = malloc(size + 1);
+    size_t total = 0;
+    ssize_t n;
+    while ((n = read(out[0], buf + total, size + 1 - total)) > 0) {
+        total += n;
+    }
+    ck_assert_uint_eq(total, size);
+    ck_assert_mem_eq(buf, data, size);
+    
+    free(buf);
+    close(out[0]);
+} END_TEST
+
+// stats
+
+/* Test reading and writing are counted and timed in each I/O mode. */
+START_TEST(test_stats) {
+    set_io_mode(_i);
+    stats_enabled = true;
+    
+    bw_reader r;
+    reader_open(&r, file);
+    assert_reader(&r, 0, BUF_SIZE);
+    reader_close(&r);
+    ck_assert_uint_eq(stats.input.bytes, MAX_COUNT);
+    ck_assert_uint_gt(stats.input.calls, 0);
+    ck_assert(stats.input.seconds >= 0);
+    
+    FILE *out;
+    check_error(out = tmpfile());
+    bw_writer w;
+    writer_open(&w, out, MAX_COUNT, NULL);
+    write_data(&w, MAX_COUNT, BUF_SIZE);
+    ck_assert(writer_close(&w));
+    ck_assert_uint_eq(stats.output.bytes, MAX_COUNT);
+    ck_assert_uint_gt(stats.output.calls, 0);
+    ck_assert(stats.output.seconds >= 0);
+    fclose(out);
+    
+    // Nothing else was touched
+    ck_assert_uint_eq(stats.operand.bytes, 0);
+    ck_assert_uint_eq(stats.rewinds, 0);
+} END_TEST
+
+// Suite
+
+Suite *create_io_suite() {
+    Suite *s = suite_create("io");
+    
+    {
+        TCase *tc = tcase_create("reader");
+        tcase_add_checked_fixture(tc, setup_io, teardown_io);
+        
+        tcase_add_loop_test(tc, test_reader, 0, NCOUNTS * NIO_MODES);
+        tcase_add_loop_test(tc, test_reader_skip, 0, NCOUNTS * NIO_MODES);
+        tcase_add_test(tc, test_reader_pipe);
+        tcase_add_loop_test(tc, test_aio_read_ahead, 0, 2);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("writer");
+        tcase_add_checked_fixture(tc, setup_io, teardown_io);
+        
+        tcase_add_loop_test(tc, test_writer, 0, NCOUNTS * 4 * NIO_MODES);
+        tcase_add_loop_test(tc, test_writer_append, 0, NCOUNTS * NIO_MODES);
+        tcase_add_test(tc, test_writer_vmsplice);
+        tcase_add_test(tc, test_writer_vmsplice_spliced);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("stats");
+        tcase_add_checked_fixture(tc, setup_io, teardown_io);
+        
+        tcase_add_loop_test(tc, test_stats, 0, NIO_MODES);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    return s;
+}
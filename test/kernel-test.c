@@ -0,0 +1,300 @@
+#include "kernel.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "test.h"
+
+#define MAX_SIZE 1000
+#define NSIZES (sizeof(sizes) / sizeof(*sizes))
+
+/* Buffer sizes for repeated tests. Covers partial and whole vectors. */
+static const size_t sizes[] = {
+    0,
+    1,
+    7,
+    8,
+    15,
+    16,
+    31,
+    33,
+    63,
+    64,
+    65,
+    129,
+    MAX_SIZE,
+};
+
+/* Offsets used to test unaligned buffers. */
+#define NOFFSETS 3
+static const size_t offsets[NOFFSETS] = {0, 1, 13};
+
+#define NOPS (sizeof(ops) / sizeof(*ops))
+
+/* Reference implementation of each operator. */
+static byte ref_op(int op, byte a, byte b) {
+    switch (op) {
+        case 0: return a | b;
+        case 1: return a & b;
+        case 2: return a ^ b;
+        default: return ~a;
+    }
+}
+
+static const char *ops[] = {"or", "and", "xor", "not"};
+
+/* Get the byte kernel for `op` from `set`. */
+static bw_kernel_byte get_byte_kernel(const kernel_set *set, int op) {
+    bw_kernel_byte kernels[] = {set->or_byte, set->and_byte, set->xor_byte, set->not_byte};
+    return kernels[op];
+}
+
+/* Get the mem kernel for `op` from `set`, or NULL for NOT. */
+static bw_kernel get_mem_kernel(const kernel_set *set, int op) {
+    bw_kernel kernels[] = {set->or_mem, set->and_mem, set->xor_mem, NULL};
+    return kernels[op];
+}
+
+/* Run `test` for every supported kernel set. */
+static void for_each_set(void (*test)(const kernel_set *, size_t, size_t, int), int i) {
+    size_t size = sizes[i % NSIZES];
+    size_t offset = offsets[(i / NSIZES) % NOFFSETS];
+    int op = i / NSIZES / NOFFSETS;
+    
+    for (const kernel_set *const *set = kernel_sets; *set; set++) {
+        if ((*set)->supported()) {
+            test(*set, size, offset, op);
+        }
+    }
+}
+
+// Byte kernels
+
+static void check_byte_kernel(const kernel_set *set, size_t size, size_t offset, int op) {
+    byte src[MAX_SIZE + 16], dst[MAX_SIZE + 16], operand;
+    create_junk(src, sizeof(src));
+    create_junk(&operand, 1);
+    
+    // Out of place
+    get_byte_kernel(set, op)(dst + offset, src + offset, operand, size);
+    for (size_t i = 0; i < size; i++) {
+        byte expected = ref_op(op, src[offset + i], operand);
+        ck_assert_msg(dst[offset + i] == expected,
+                      "%s %s: Expected byte %zu to be %u but %u",
+                      set->name, ops[op], i, expected, dst[offset + i]);
+    }
+    
+    // In place
+    get_byte_kernel(set, op)(src + offset, src + offset, operand, size);
+    ck_assert_mem_eq(src + offset, dst + offset, size);
+}
+
+/* Test byte kernels of every set with various sizes and alignments. */
+START_TEST(test_byte_kernel) {
+    for_each_set(check_byte_kernel, _i);
+} END_TEST
+
+// Mem kernels
+
+static void check_mem_kernel(const kernel_set *set, size_t size, size_t offset, int op) {
+    byte src[MAX_SIZE + 16], dst[MAX_SIZE + 16], operand[MAX_SIZE + 16];
+    create_junk(src, sizeof(src));
+    create_junk(operand, sizeof(operand));
+    
+    // Operand deliberately misaligned relative to src/dst
+    get_mem_kernel(set, op)(dst + offset, src + offset, operand + offset + 1, size);
+    for (size_t i = 0; i < size; i++) {
+        byte expected = ref_op(op, src[offset + i], operand[offset + 1 + i]);
+        ck_assert_msg(dst[offset + i] == expected,
+                      "%s %s: Expected byte %zu to be %u but %u",
+                      set->name, ops[op], i, expected, dst[offset + i]);
+    }
+    
+    // In place
+    get_mem_kernel(set, op)(src + offset, src + offset, operand + offset + 1, size);
+    ck_assert_mem_eq(src + offset, dst + offset, size);
+}
+
+/* Test mem kernels of every set with various sizes and alignments. */
+START_TEST(test_mem_kernel) {
+    for_each_set(check_mem_kernel, _i);
+} END_TEST
+
+// Map kernels
+
+static void check_map_kernel(const kernel_set *set, size_t size, size_t offset, int op) {
+    byte src[MAX_SIZE + 16], dst[MAX_SIZE + 16], table[256];
+    create_junk(src, sizeof(src));
+    create_junk(table, sizeof(table));
+    
+    set->map(dst + offset, src + offset, table, size);
+    for (size_t i = 0; i < size; i++) {
+        byte expected = table[src[offset + i]];
+        ck_assert_msg(dst[offset + i] == expected,
+                      "%s map: Expected byte %zu to be %u but %u",
+                      set->name, i, expected, dst[offset + i]);
+    }
+    
+    // In place
+    set->map(src + offset, src + offset, table, size);
+    ck_assert_mem_eq(src + offset, dst + offset, size);
+}
+
+/* Test map kernels of every set with various sizes and alignments. */
+START_TEST(test_map_kernel) {
+    for_each_set(check_map_kernel, _i);
+} END_TEST
+
+// Shift kernels
+
+static void check_shift_kernel(const kernel_set *set, size_t size, size_t offset, int bits) {
+    byte src[MAX_SIZE + 16], dst[MAX_SIZE + 16];
+    create_junk(src, sizeof(src));
+    
+    set->shiftl(dst + offset, src + offset, size, bits);
+    for (size_t i = 0; i < size; i++) {
+        unsigned pair = (src[offset + i] << BYTE_BIT) | src[offset + i + 1];
+        byte expected = pair >> (BYTE_BIT - bits);
+        ck_assert_msg(dst[offset + i] == expected,
+                      "%s shiftl %d: Expected byte %zu to be %u but %u",
+                      set->name, bits, i, expected, dst[offset + i]);
+    }
+    
+    // Overlapping, with dst before src
+    set->shiftl(src + offset, src + offset, size, bits);
+    ck_assert_mem_eq(src + offset, dst + offset, size);
+    
+    create_junk(src, sizeof(src));
+    set->shiftr(dst + offset, src + offset, size, bits);
+    for (size_t i = 0; i < size; i++) {
+        unsigned pair = (src[offset + i] << BYTE_BIT) | src[offset + i + 1];
+        byte expected = pair >> bits;
+        ck_assert_msg(dst[offset + i] == expected,
+                      "%s shiftr %d: Expected byte %zu to be %u but %u",
+                      set->name, bits, i, expected, dst[offset + i]);
+    }
+    
+    // Overlapping, with dst after src
+    set->shiftr(src + offset + 1, src + offset, size, bits);
+    ck_assert_mem_eq(src + offset + 1, dst + offset, size);
+}
+
+/* Test shift kernels of every set with every bit shift, size and alignment. */
+START_TEST(test_shift_kernel) {
+    for_each_set(check_shift_kernel, _i);
+} END_TEST
+
+// Popcount kernels
+
+static void check_popcount_kernel(const kernel_set *set, size_t size, size_t offset, int op) {
+    byte src[MAX_SIZE + 16];
+    create_junk(src, sizeof(src));
+    
+    uint64_t expected = 0;
+    for (size_t i = 0; i < size; i++) {
+        expected += __builtin_popcount(src[offset + i]);
+    }
+    ck_assert_msg(set->popcount(src + offset, size) == expected, "%s popcount: Wrong count of %zu bytes", set->name, size);
+    
+    // All ones, which would overflow the per-byte counts of vector kernels
+    memset(src, 0xff, sizeof(src));
+    ck_assert_uint_eq(set->popcount(src + offset, size), size * BYTE_BIT);
+}
+
+/* Test popcount kernels of every set with various sizes and alignments. */
+START_TEST(test_popcount_kernel) {
+    for_each_set(check_popcount_kernel, _i);
+} END_TEST
+
+// Nonzero kernels
+
+static void check_nonzero_kernel(const kernel_set *set, size_t size, size_t offset, int op) {
+    byte src[MAX_SIZE + 16] = {0};
+    ck_assert_uint_eq(set->nonzero(src + offset, size), size);
+    
+    // Each byte as the first nonzero one, with another after it
+    for (size_t i = 0; i < size; i++) {
+        src[offset + i] = 0x01;
+        src[offset + size - 1] |= 0x80;
+        ck_assert_msg(set->nonzero(src + offset, size) == i, "%s nonzero: Wrong index %zu of %zu bytes", set->name, i, size);
+        memset(src, 0, sizeof(src));
+    }
+}
+
+/* Test nonzero kernels of every set with various sizes and alignments. */
+START_TEST(test_nonzero_kernel) {
+    for_each_set(check_nonzero_kernel, _i);
+} END_TEST
+
+// Selection
+
+/* Test the selected kernel set is supported. */
+START_TEST(test_kernels_supported) {
+    ck_assert_ptr_nonnull(kernels());
+    ck_assert(kernels()->supported());
+} END_TEST
+
+// Suite
+
+Suite *create_kernel_suite() {
+    Suite *s = suite_create("kernel");
+    
+    {
+        TCase *tc = tcase_create("byte");
+        
+        tcase_add_loop_test(tc, test_byte_kernel, 0, NSIZES * NOFFSETS * NOPS);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("mem");
+        
+        // Skip NOT which has no mem kernel
+        tcase_add_loop_test(tc, test_mem_kernel, 0, NSIZES * NOFFSETS * (NOPS - 1));
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("map");
+        
+        tcase_add_loop_test(tc, test_map_kernel, 0, NSIZES * NOFFSETS);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("shift");
+        
+        tcase_add_loop_test(tc, test_shift_kernel, 0, NSIZES * NOFFSETS * BYTE_BIT);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("popcount");
+        
+        tcase_add_loop_test(tc, test_popcount_kernel, 0, NSIZES * NOFFSETS);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("nonzero");
+        
+        tcase_add_loop_test(tc, test_nonzero_kernel, 0, NSIZES * NOFFSETS);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("select");
+        
+        tcase_add_test(tc, test_kernels_supported);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    return s;
+}
@@ -1,6 +1,11 @@
+#define _GNU_SOURCE
+
 #include "utils.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <check.h>
 #include "test.h"
 
@@ -107,6 +112,77 @@ START_TEST(test_fskip_eof) {
     ck_assert_int_eq(ftell(reg_file), MAX_COUNT);
 } END_TEST
 
+// fcopy
+
+/* Test fcopy with various counts after output already buffered by stdio. */
+START_TEST(test_fcopy) {
+    size_t n = counts[_i];
+    size_t expected_n = MIN(n, MAX_COUNT - 1);
+    
+    byte *data = malloc(MAX_COUNT);
+    check_error(fread(data, sizeof(byte), MAX_COUNT, reg_file) == MAX_COUNT);
+    check_error(fseek(reg_file, 1, SEEK_SET) == 0);
+    
+    FILE *out;
+    check_error(out = tmpfile());
+    check_error(fputc(0xaa, out) != EOF);
+    
+    ck_assert_int_eq(fcopy(reg_file, out, n), expected_n);
+    ck_assert_int_eq(ftello(reg_file), 1 + expected_n);
+    ck_assert_int_eq(ftello(out), 1 + expected_n);
+    
+    // Check the copy comes after what was buffered
+    check_error(fseek(out, 0, SEEK_SET) == 0);
+    assert_file_bytes(out, 1, 0xaa);
+    assert_file_mem(out, expected_n, data + 1);
+    
+    fclose(out);
+    free(data);
+} END_TEST
+
+/* Test fcopy with various counts to a character device. */
+START_TEST(test_fcopy_char) {
+    size_t n = counts[_i];
+    ck_assert_int_eq(fcopy(reg_file, char_file, n), n);
+    ck_assert_int_eq(ftell(reg_file), n);
+} END_TEST
+
+/*
+ * Test fcopy from a pipe after stdio has read ahead of it, with counts within
+ * and past what was read ahead, or after reading from it unbuffered.
+ */
+START_TEST(test_fcopy_pipe) {
+    size_t n = counts[_i / 2];
+    size_t size = 10000, expected_n = MIN(n, size - 1);
+    
+    byte data[size];
+    create_junk(data, size);
+    int fds[2];
+    check_error(pipe(fds) == 0);
+    check_error(write(fds[1], data, size) == size);
+    close(fds[1]);
+    
+    FILE *in, *out;
+    check_error(in = fdopen(fds[0], "rb"));
+    check_error(out = tmpfile());
+    // Spliced if unbuffered, otherwise copied on from what stdio read ahead
+    if (_i % 2) {
+        check_error(setvbuf(in, NULL, _IONBF, 0) == 0);
+    }
+    ck_assert_int_eq(fgetc(in), data[0]);
+    
+    ck_assert_int_eq(fcopy(in, out, n), expected_n);
+    ck_assert_int_eq(ftello(out), expected_n);
+    
+    // Anything left is still read in order
+    check_error(fseek(out, 0, SEEK_SET) == 0);
+    assert_file_mem(out, expected_n, data + 1);
+    assert_file_mem(in, size - 1 - expected_n, data + 1 + expected_n);
+    
+    fclose(in);
+    fclose(out);
+} END_TEST
+
 // fzero
 
 /* Test fzero with various counts. */
@@ -151,6 +227,77 @@ START_TEST(test_fzero_middle) {
     assert_file_bytes(reg_file, n, 0);
 } END_TEST
 
+/* Test fzero leaves a hole past the end of a file, or writes if not sparse. */
+START_TEST(test_fzero_hole) {
+    use_sparse = _i;
+    write_junk(reg_file, 1);
+    
+    ck_assert_int_eq(fzero(reg_file, HOLE_MIN * 4), HOLE_MIN * 4);
+    ck_assert_int_eq(ftello(reg_file), HOLE_MIN * 4 + 1);
+    check_error(fflush(reg_file) == 0);
+    ck_assert_int_eq(fsize(reg_file), HOLE_MIN * 4 + 1);
+    
+    // Data at the start, then a hole (if the filesystem has them)
+    bool hole;
+    off_t end = fextent(reg_file, 0, &hole);
+    ck_assert(!hole);
+    ck_assert_int_gt(end, 0);
+    if (use_sparse && end < fsize(reg_file)) {
+        ck_assert_int_ne(fextent(reg_file, end, &hole), -1);
+        ck_assert(hole);
+        ck_assert(fsparse(reg_file) || ftello(reg_file) >= end);
+    } else if (!use_sparse) {
+        ck_assert_int_eq(end, fsize(reg_file));
+    }
+    
+    check_error(fseek(reg_file, 1, SEEK_SET) == 0);
+    assert_file_bytes(reg_file, HOLE_MIN * 4, 0);
+    use_sparse = true;
+} END_TEST
+
+/* Test fzero writes zeros at the end of a file opened for appending. */
+START_TEST(test_fzero_append) {
+    write_junk(reg_file, 1);
+    check_error(fflush(reg_file) == 0);
+    check_error(fseek(reg_file, 0, SEEK_SET) == 0);
+    check_error(fcntl(fileno(reg_file), F_SETFL, fcntl(fileno(reg_file), F_GETFL) | O_APPEND) == 0);
+    
+    ck_assert_int_eq(fzero(reg_file, HOLE_MIN * 4), HOLE_MIN * 4);
+    check_error(fflush(reg_file) == 0);
+    ck_assert_int_eq(fsize(reg_file), HOLE_MIN * 4 + 1);
+    
+    check_error(fseek(reg_file, 1, SEEK_SET) == 0);
+    assert_file_bytes(reg_file, HOLE_MIN * 4, 0);
+} END_TEST
+
+/* Test fcollapse and finsert move the rest of a file, where supported. */
+START_TEST(test_fcollapse_finsert) {
+    byte data[3 * HOLE_MIN];
+    create_junk(data, sizeof(data));
+    check_error(fwrite(data, 1, sizeof(data), reg_file) == sizeof(data));
+    check_error(fflush(reg_file) == 0);
+    
+    // Unaligned ranges and ranges reaching the end can't be moved
+    ck_assert(!fcollapse(reg_file, 1, HOLE_MIN));
+    ck_assert(!fcollapse(reg_file, HOLE_MIN, 2 * HOLE_MIN));
+    ck_assert_int_eq(fsize(reg_file), sizeof(data));
+    
+    size_t dropped = 0;
+    if (fcollapse(reg_file, 0, HOLE_MIN)) {
+        dropped = HOLE_MIN;
+        ck_assert_int_eq(fsize(reg_file), sizeof(data) - dropped);
+        rewind(reg_file);
+        assert_file_mem(reg_file, sizeof(data) - dropped, data + dropped);
+    }
+    
+    if (finsert(reg_file, 0, HOLE_MIN)) {
+        ck_assert_int_eq(fsize(reg_file), sizeof(data) - dropped + HOLE_MIN);
+        rewind(reg_file);
+        assert_file_bytes(reg_file, HOLE_MIN, 0);
+        assert_file_mem(reg_file, sizeof(data) - dropped, data + dropped);
+    }
+} END_TEST
+
 // freadall
 
 #define NSIZES (sizeof(sizes) / sizeof(*sizes))
@@ -202,6 +349,168 @@ START_TEST(test_freadall) {
     free(junk);
 } END_TEST
 
+// mempattern
+
+/* Test mempattern with various pattern sizes. */
+START_TEST(test_mempattern) {
+    size_t size = sizes[_i % NSIZES] % 1000 + 1;
+    size_t min_size = counts[_i / NSIZES];
+    
+    byte pattern[1000];
+    create_junk(pattern, size);
+    
+    size_t total;
+    byte *buf = mempattern(pattern, size, min_size, &total);
+    ck_assert_ptr_nonnull(buf);
+    ck_assert_uint_eq((uintptr_t) buf % VEC_ALIGN, 0);
+    ck_assert_uint_eq(total, min_size + size - 1);
+    
+    // Check the pattern repeats for the whole buffer
+    for (size_t i = 0; i < total; i++) {
+        ck_assert_msg(buf[i] == pattern[i % size],
+                      "Expected byte %zu to be %u but %u",
+                      i, pattern[i % size], buf[i]);
+    }
+    
+    free(buf);
+} END_TEST
+
+/* Test mempattern with an empty pattern. */
+START_TEST(test_mempattern_empty) {
+    size_t total;
+    ck_assert_ptr_null(mempattern(NULL, 0, BUF_SIZE, &total));
+} END_TEST
+
+// buf_alloc/buf_size_for
+
+/* Sizes of buffers to allocate, including ones backed by huge pages. */
+static const size_t buf_sizes[] = {
+    1,
+    VEC_ALIGN,
+    BUF_SIZE,
+    HUGEPAGE_SIZE - 1,
+    HUGEPAGE_SIZE,
+    HUGEPAGE_SIZE * 2 + 1,
+};
+
+#define NBUF_SIZES (sizeof(buf_sizes) / sizeof(*buf_sizes))
+
+/* Test buf_alloc gives aligned buffers that can be used in full. */
+START_TEST(test_buf_alloc) {
+    size_t size = buf_sizes[_i];
+    
+    byte *buf = buf_alloc(size);
+    ck_assert_ptr_nonnull(buf);
+    ck_assert_uint_eq((uintptr_t) buf % VEC_ALIGN, 0);
+    
+    memset(buf, 0xa5, size);
+    ck_assert_uint_eq(buf[0], 0xa5);
+    ck_assert_uint_eq(buf[size - 1], 0xa5);
+    
+    buf_free(buf);
+    buf_free(NULL);
+} END_TEST
+
+/* Test buf_reuse keeps freed buffers for later allocations that fit in them. */
+START_TEST(test_buf_reuse) {
+    buf_reuse = true;
+    
+    byte *buf = buf_alloc(BUF_SIZE);
+    ck_assert_ptr_nonnull(buf);
+    buf_free(buf);
+    ck_assert_ptr_eq(buf_alloc(BUF_SIZE / 2), buf);
+    
+    // Too big for the kept buffer
+    byte *big = buf_alloc(BUF_SIZE * 2);
+    ck_assert_ptr_nonnull(big);
+    ck_assert(big != buf);
+    
+    // Both are kept until released
+    buf_free(buf);
+    buf_free(big);
+    ck_assert_ptr_eq(buf_alloc(BUF_SIZE * 2), big);
+    buf_free(big);
+    buf_release();
+    buf_reuse = false;
+} END_TEST
+
+/* Test buf_size_for chooses sizes in range, or buf_size if set. */
+START_TEST(test_buf_size_for) {
+    size_t size = buf_size_for(reg_file);
+    ck_assert_uint_ge(size, BUF_SIZE);
+    ck_assert_uint_le(size, BUF_SIZE_MAX);
+    
+    // A pipe's whole capacity is used
+    int fds[2];
+    check_error(pipe(fds) == 0);
+    FILE *pipe_file = fdopen(fds[0], "rb");
+    check_error(pipe_file);
+    size = buf_size_for(pipe_file);
+    ck_assert_uint_ge(size, BUF_SIZE);
+    ck_assert_uint_le(size, BUF_SIZE_MAX);
+#ifdef F_GETPIPE_SZ
+    ck_assert_uint_eq(size, MAX(fcntl(fds[0], F_GETPIPE_SZ), BUF_SIZE));
+#endif
+
+    buf_size = 13;
+    ck_assert_uint_eq(buf_size_for(reg_file), 13);
+    ck_assert_uint_eq(buf_size_for(pipe_file), 13);
+    buf_size = 0;
+    
+    fclose(pipe_file);
+    close(fds[1]);
+} END_TEST
+
+// bitshiftl/bitshiftr
+
+/* Test bitshiftl and bitshiftr with every bit shift against a byte loop. */
+START_TEST(test_bitshift) {
+    size_t n = counts[_i / BYTE_BIT] % 1000;
+    shift bits = _i % BYTE_BIT;
+    
+    byte src[1001], dst[1000];
+    create_junk(src, n + 1);
+    
+    bitshiftl(dst, src, n, bits);
+    for (size_t i = 0; i < n; i++) {
+        byte expected = (byte) (src[i] << bits) | (byte) ((src[i + 1] << bits) >> BYTE_BIT);
+        ck_assert_uint_eq(dst[i], expected);
+    }
+    
+    bitshiftr(dst, src, n, bits);
+    for (size_t i = 0; i < n; i++) {
+        unsigned pair = (src[i] << BYTE_BIT) | src[i + 1];
+        ck_assert_uint_eq(dst[i], (byte) (pair >> bits));
+    }
+} END_TEST
+
+/* Get bit `i` of `buf`, counting from the most significant bit. */
+static bool get_bit(const byte *buf, size_t i) {
+    return (buf[i / BYTE_BIT] >> (BYTE_BIT - 1 - i % BYTE_BIT)) & 1;
+}
+
+/* Test memshiftl and memshiftr with every amount up to the whole buffer. */
+START_TEST(test_memshift) {
+    size_t sizes[] = {1, 2, 9, 33, 100};
+    size_t size = sizes[_i / 2];
+    bool left = _i % 2;
+    
+    byte src[100], buf[100], expected[100];
+    create_junk(src, size);
+    for (shift amount = 0; amount <= size * BYTE_BIT; amount++) {
+        memset(expected, 0, size);
+        for (size_t i = 0; i < size * BYTE_BIT; i++) {
+            bool bit = left ? i + amount < size * BYTE_BIT && get_bit(src, i + amount)
+                            : i >= amount && get_bit(src, i - amount);
+            expected[i / BYTE_BIT] |= bit << (BYTE_BIT - 1 - i % BYTE_BIT);
+        }
+        
+        memcpy(buf, src, size);
+        (left ? memshiftl : memshiftr)(buf, size, amount);
+        ck_assert_msg(memcmp(buf, expected, size) == 0, "Wrong shift by %zu of %zu bytes", amount, size);
+    }
+} END_TEST
+
 // Suite
 
 Suite *create_utils_suite() {
@@ -232,6 +541,18 @@ Suite *create_utils_suite() {
         suite_add_tcase(s, tc);
     }
     
+    {
+        TCase *tc = tcase_create("fcopy");
+        tcase_add_checked_fixture(tc, setup_reg_filled, teardown_reg);
+        tcase_add_checked_fixture(tc, setup_special, teardown_special);
+        
+        tcase_add_loop_test(tc, test_fcopy, 0, NCOUNTS);
+        tcase_add_loop_test(tc, test_fcopy_char, 0, NCOUNTS);
+        tcase_add_loop_test(tc, test_fcopy_pipe, 0, NCOUNTS * 2);
+        
+        suite_add_tcase(s, tc);
+    }
+    
     {
         TCase *tc = tcase_create("fzero");
         tcase_add_checked_fixture(tc, setup_reg_empty, teardown_reg);
@@ -239,6 +560,9 @@ Suite *create_utils_suite() {
         tcase_add_loop_test(tc, test_fzero, 0, NCOUNTS);
         tcase_add_loop_test(tc, test_fzero_end, 0, NCOUNTS);
         tcase_add_loop_test(tc, test_fzero_middle, 0, NCOUNTS);
+        tcase_add_loop_test(tc, test_fzero_hole, 0, 2);
+        tcase_add_test(tc, test_fzero_append);
+        tcase_add_test(tc, test_fcollapse_finsert);
         
         suite_add_tcase(s, tc);
     }
@@ -252,5 +576,34 @@ Suite *create_utils_suite() {
         suite_add_tcase(s, tc);
     }
     
+    {
+        TCase *tc = tcase_create("bitshift");
+        
+        tcase_add_loop_test(tc, test_bitshift, 0, NCOUNTS * BYTE_BIT);
+        tcase_add_loop_test(tc, test_memshift, 0, 5 * 2);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("buf");
+        tcase_add_checked_fixture(tc, setup_reg_filled, teardown_reg);
+        
+        tcase_add_loop_test(tc, test_buf_alloc, 0, NBUF_SIZES);
+        tcase_add_test(tc, test_buf_reuse);
+        tcase_add_test(tc, test_buf_size_for);
+        
+        suite_add_tcase(s, tc);
+    }
+    
+    {
+        TCase *tc = tcase_create("mempattern");
+        
+        tcase_add_loop_test(tc, test_mempattern, 0, NCOUNTS * NSIZES);
+        tcase_add_test(tc, test_mempattern_empty);
+        
+        suite_add_tcase(s, tc);
+    }
+    
     return s;
 }